@@ -0,0 +1,1491 @@
+/*
+ * Unpack cpio, tar and rpm archives.
+ *
+ * Supported formats:
+ *   - cpio: newc, crc, odc
+ *   - tar: ustar (including GNU long names and pax headers)
+ *   - rpm: cpio payload
+ *
+ * Archives may be gzip or xz compressed (see zstream.c).
+ *
+ * Files are extracted like 'cpio --sparse -dimu --no-absolute-filenames'
+ * resp. 'tar -xpf' would do.
+ *
+ * Alternatively, the archive can be converted into a tar stream (to build
+ * a file system image from it without unpacking it first).
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include "global.h"
+#include "util.h"
+#include "zstream.h"
+#include "archive.h"
+
+#define AR_BUF_SIZE		(256 << 10)
+/* feed compressed data in small pieces to limit the output buffer size */
+#define AR_ZCHUNK_SIZE		(16 << 10)
+#define AR_BLOCK_SIZE		4096
+
+/*
+ * Archive data stream.
+ */
+typedef struct {
+  int fd;
+  zstream_t *zs;		// decoder, if compressed
+  unsigned char *in;		// compressed data
+  unsigned char *buf;		// archive data
+  size_t buf_size;
+  size_t buf_len;
+  size_t buf_pos;
+  uint64_t pos;			// archive data consumed so far
+  char *err;			// error message, if any
+  unsigned eof:1;
+} ar_stream_t;
+
+/*
+ * Archive member.
+ */
+typedef struct {
+  char *name;
+  char *link;			// symlink target, hard link target (tar)
+  char *link_id;		// identifies hard linked files (cpio)
+  unsigned mode;		// including file type
+  unsigned uid, gid;
+  unsigned nlink;
+  unsigned rdev_major, rdev_minor;
+  uint64_t size;
+  time_t mtime;
+  uint64_t real_size;		// file size, if sparse
+  unsigned hardlink:1;		// tar hard link
+  unsigned sparse:1;		// GNU sparse file (pax format 1.0)
+} ar_entry_t;
+
+/*
+ * Symlink pointing outside the archive tree.
+ *
+ * It is created only after all other members, replacing an empty placeholder
+ * file - so no archive member can be written through it.
+ */
+typedef struct ar_symlink_s {
+  struct ar_symlink_s *next;
+  char *path;
+  char *target;
+  dev_t dev;			// placeholder file
+  ino_t ino;
+  unsigned uid, gid;
+  time_t mtime;
+} ar_symlink_t;
+
+typedef struct {
+  ar_stream_t s;
+  char *file;
+  char *dir;
+  slist_t *file_list;		// extract only these (shell patterns)
+  slist_t *links;		// key: link_id, value: extracted file
+  slist_t *pending;		// key: link_id, value: file still waiting for data
+  slist_t *dirs;		// key: directory, value: mtime
+  ar_symlink_t *symlinks;	// delayed symlinks
+  int tar_fd;			// write tar stream here instead of unpacking
+  unsigned files;
+  unsigned errors;
+} ar_t;
+
+static int ar_process(ar_t *ar, char *type, char *compr);
+static int ar_write(void *data, void *buf, size_t len);
+static int ar_fill(ar_stream_t *s);
+static int ar_read(ar_stream_t *s, void *buf, size_t len);
+static int ar_skip(ar_stream_t *s, uint64_t len);
+static int ar_align(ar_stream_t *s, unsigned align);
+static int ar_cpio(ar_t *ar);
+static int ar_tar(ar_t *ar);
+static int ar_rpm_payload(int fd, uint64_t *ofs);
+static int ar_entry(ar_t *ar, ar_entry_t *entry);
+static int ar_file(ar_t *ar, ar_entry_t *entry, char *path);
+static int ar_data(ar_t *ar, int fd, char *path, uint64_t ofs, uint64_t len);
+static int ar_sparse_map(ar_stream_t *s, uint64_t **map, unsigned *chunks);
+static int ar_line(ar_stream_t *s, char *buf, unsigned size);
+static int ar_tar_entry(ar_t *ar, ar_entry_t *entry, char *name);
+static int ar_tar_header(ar_t *ar, ar_entry_t *entry, char *name);
+static int ar_tar_block(ar_t *ar, char *hdr);
+static int ar_tar_data(ar_t *ar, ar_entry_t *entry);
+static void ar_pax_add(char **pax, char *key, char *val);
+static int ar_out(ar_t *ar, void *buf, uint64_t len);
+static int ar_out_zero(ar_t *ar, uint64_t len);
+static char *ar_name(char *name);
+static int ar_dotdot(char *name);
+static void ar_symlink_delay(ar_t *ar, ar_entry_t *entry, char *path);
+static void ar_symlinks(ar_t *ar);
+static void ar_mkdir(char *path);
+static void ar_error(ar_t *ar, char *path, char *msg);
+static int ar_pax(char *data, size_t size, ar_entry_t *entry);
+static uint64_t ar_num(char *str, unsigned len, unsigned base);
+
+
+/*
+ * Unpack 'file' into 'dir'.
+ *
+ * 'type' is one of "cpio", "tar", "rpm"; 'compr' the compression type
+ * (or NULL). If 'file_list' is set, extract only matching files.
+ *
+ * return:
+ *   0: ok
+ *   ARCHIVE_UNSUPPORTED: can't handle this archive
+ *   else: error
+ */
+int archive_unpack(char *file, char *dir, char *type, char *compr, slist_t *file_list)
+{
+  ar_t ar = { .file = file, .dir = dir, .file_list = file_list, .tar_fd = -1 };
+
+  if(!dir) return ARCHIVE_UNSUPPORTED;
+
+  return ar_process(&ar, type, compr);
+}
+
+
+/*
+ * Convert 'file' into a tar stream and write it to 'fd'.
+ *
+ * Arguments and return value are like archive_unpack().
+ */
+int archive_to_tar(char *file, int fd, char *type, char *compr, slist_t *file_list)
+{
+  ar_t ar = { .file = file, .file_list = file_list, .tar_fd = fd };
+
+  return ar_process(&ar, type, compr);
+}
+
+
+int ar_process(ar_t *ar, char *type, char *compr)
+{
+  ar_stream_t *s = &ar->s;
+  char *file = ar->file;
+  uint64_t ofs = 0;
+  unsigned char magic[6];
+  struct timespec ts0, ts1;
+  unsigned ms;
+  int err = 0;
+  slist_t *sl;
+  struct timespec times[2] = { };
+  ar_entry_t entry = { .mode = S_IFREG | 0644 };
+
+  if(!file || !type) return ARCHIVE_UNSUPPORTED;
+
+  if(strcmp(type, "cpio") && strcmp(type, "tar") && strcmp(type, "rpm")) return ARCHIVE_UNSUPPORTED;
+
+  if((s->fd = open(file, O_RDONLY | O_LARGEFILE | O_CLOEXEC)) == -1) {
+    perror_debug(file);
+
+    return 1;
+  }
+
+  if(!strcmp(type, "rpm")) {
+    if(
+      ar_rpm_payload(s->fd, &ofs) ||
+      pread(s->fd, magic, sizeof magic, ofs) != sizeof magic
+    ) {
+      log_info("%s: invalid rpm\n", file);
+      close(s->fd);
+
+      return 1;
+    }
+    compr = compress_type(magic);
+    if(!compr && memcmp(magic, "070701", 6)) {
+      // e.g. zstd payload
+      close(s->fd);
+
+      return ARCHIVE_UNSUPPORTED;
+    }
+    lseek(s->fd, ofs, SEEK_SET);
+  }
+
+  if(compr && !zstream_supported(compr)) {
+    close(s->fd);
+
+    return ARCHIVE_UNSUPPORTED;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &ts0);
+
+  s->buf_size = AR_BUF_SIZE;
+  s->buf = malloc(s->buf_size);
+
+  if(compr) {
+    s->in = malloc(AR_ZCHUNK_SIZE);
+    s->zs = zstream_new(compr, ar_write, s);
+  }
+
+  /* only the ASCII cpio formats (newc, crc, odc); leave e.g. binary cpio to cpio(1) */
+  if(
+    strcmp(type, "tar") &&
+    ar_fill(s) >= 6 &&
+    memcmp(s->buf + s->buf_pos, "070701", 6) &&
+    memcmp(s->buf + s->buf_pos, "070702", 6) &&
+    memcmp(s->buf + s->buf_pos, "070707", 6)
+  ) {
+    close(s->fd);
+    zstream_free(s->zs);
+    free(s->in);
+    free(s->buf);
+
+    return ARCHIVE_UNSUPPORTED;
+  }
+
+  err = strcmp(type, "tar") ? ar_cpio(ar) : ar_tar(ar);
+
+  if(ar->tar_fd >= 0) {
+    /* hard linked files that never got any data */
+    for(sl = ar->pending; sl && !err; sl = sl->next) {
+      if(sl->key) err = ar_tar_header(ar, &entry, sl->value);
+    }
+
+    /* end of archive */
+    if(!err) err = ar_out_zero(ar, 1024);
+  }
+  else {
+    /* hard linked files that never got any data */
+    for(sl = ar->pending; sl; sl = sl->next) {
+      if(sl->key) close(open(sl->value, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+    }
+
+    ar_symlinks(ar);
+
+    /* set directory times last */
+    for(sl = ar->dirs; sl; sl = sl->next) {
+      times[0].tv_sec = times[1].tv_sec = strtoll(sl->value, NULL, 10);
+      utimensat(AT_FDCWD, sl->key, times, 0);
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &ts1);
+  ms = (ts1.tv_sec - ts0.tv_sec) * 1000 + (ts1.tv_nsec - ts0.tv_nsec) / 1000000;
+
+  if(s->err) log_info("%s: %s\n", file, s->err);
+
+  log_info(
+    "%s: %s%s%s%s: %u files, %"PRIu64" kB in %u ms (%.1f MB/s)%s\n",
+    file, type, compr ? "." : "", compr ?: "", ar->tar_fd >= 0 ? " -> tar" : "",
+    ar->files, s->pos >> 10, ms,
+    ms ? (double) s->pos / (ms * 1000.0) : 0, err || ar->errors ? ", failed" : ""
+  );
+
+  if(ar->errors) err = 1;
+
+  close(s->fd);
+  zstream_free(s->zs);
+  free(s->in);
+  free(s->buf);
+
+  slist_free(ar->links);
+  slist_free(ar->pending);
+  slist_free(ar->dirs);
+
+  return err;
+}
+
+
+/*
+ * Decoder callback: append decompressed data to stream buffer.
+ */
+int ar_write(void *data, void *buf, size_t len)
+{
+  ar_stream_t *s = data;
+
+  if(s->buf_len + len > s->buf_size) {
+    while(s->buf_len + len > s->buf_size) s->buf_size <<= 1;
+    s->buf = realloc(s->buf, s->buf_size);
+  }
+
+  memcpy(s->buf + s->buf_len, buf, len);
+  s->buf_len += len;
+
+  return 0;
+}
+
+
+/*
+ * Make sure there's some data in the stream buffer.
+ *
+ * Return number of bytes available (0: end of archive or error).
+ */
+int ar_fill(ar_stream_t *s)
+{
+  ssize_t len;
+
+  if(s->buf_pos < s->buf_len) return s->buf_len - s->buf_pos;
+
+  s->buf_pos = s->buf_len = 0;
+
+  while(!s->buf_len && !s->eof) {
+    len = read(s->fd, s->zs ? s->in : s->buf, s->zs ? AR_ZCHUNK_SIZE : s->buf_size);
+
+    if(len == -1 && errno == EINTR) continue;
+
+    if(len <= 0) {
+      if(len) s->err = "read error";
+      s->eof = 1;
+      if(s->zs && !s->err && zstream_finish(s->zs)) s->err = s->zs->err;
+      break;
+    }
+
+    if(!s->zs) {
+      s->buf_len = len;
+    }
+    else if(zstream_write(s->zs, s->in, len)) {
+      s->err = s->zs->err;
+      s->eof = 1;
+    }
+  }
+
+  return s->buf_len;
+}
+
+
+/*
+ * Read 'len' bytes.
+ *
+ * Return 0 if ok, else 1.
+ */
+int ar_read(ar_stream_t *s, void *buf, size_t len)
+{
+  size_t n;
+
+  while(len) {
+    if(!(n = ar_fill(s))) return 1;
+    if(n > len) n = len;
+    memcpy(buf, s->buf + s->buf_pos, n);
+    s->buf_pos += n;
+    s->pos += n;
+    buf += n;
+    len -= n;
+  }
+
+  return 0;
+}
+
+
+/*
+ * Skip 'len' bytes.
+ *
+ * Return 0 if ok, else 1.
+ */
+int ar_skip(ar_stream_t *s, uint64_t len)
+{
+  size_t n;
+
+  while(len) {
+    if(!(n = ar_fill(s))) return 1;
+    if(n > len) n = len;
+    s->buf_pos += n;
+    s->pos += n;
+    len -= n;
+  }
+
+  return 0;
+}
+
+
+/*
+ * Skip to next multiple of 'align'.
+ */
+int ar_align(ar_stream_t *s, unsigned align)
+{
+  return ar_skip(s, (align - s->pos % align) % align);
+}
+
+
+/*
+ * Unpack cpio archive.
+ */
+int ar_cpio(ar_t *ar)
+{
+  ar_stream_t *s = &ar->s;
+  char hdr[110], *name = NULL, *link = NULL;
+  ar_entry_t entry;
+  unsigned namesize, ino, dev_major, dev_minor;
+  int newc, err = 0;
+
+  for(;;) {
+    memset(&entry, 0, sizeof entry);
+
+    if(ar_read(s, hdr, 6)) {
+      if(!s->err) s->err = "cpio: unexpected end of archive";
+      err = 1;
+      break;
+    }
+
+    newc = !memcmp(hdr, "070701", 6) || !memcmp(hdr, "070702", 6);
+
+    if(!newc && memcmp(hdr, "070707", 6)) {
+      s->err = "cpio: unsupported format";
+      err = 1;
+      break;
+    }
+
+    if(newc) {
+      if(ar_read(s, hdr + 6, 104)) { err = 1; break; }
+      ino = ar_num(hdr + 6, 8, 16);
+      entry.mode = ar_num(hdr + 14, 8, 16);
+      entry.uid = ar_num(hdr + 22, 8, 16);
+      entry.gid = ar_num(hdr + 30, 8, 16);
+      entry.nlink = ar_num(hdr + 38, 8, 16);
+      entry.mtime = ar_num(hdr + 46, 8, 16);
+      entry.size = ar_num(hdr + 54, 8, 16);
+      dev_major = ar_num(hdr + 62, 8, 16);
+      dev_minor = ar_num(hdr + 70, 8, 16);
+      entry.rdev_major = ar_num(hdr + 78, 8, 16);
+      entry.rdev_minor = ar_num(hdr + 86, 8, 16);
+      namesize = ar_num(hdr + 94, 8, 16);
+    }
+    else {
+      if(ar_read(s, hdr + 6, 70)) { err = 1; break; }
+      dev_major = ar_num(hdr + 6, 6, 8);
+      dev_minor = 0;
+      ino = ar_num(hdr + 12, 6, 8);
+      entry.mode = ar_num(hdr + 18, 6, 8);
+      entry.uid = ar_num(hdr + 24, 6, 8);
+      entry.gid = ar_num(hdr + 30, 6, 8);
+      entry.nlink = ar_num(hdr + 36, 6, 8);
+      entry.rdev_major = major(ar_num(hdr + 42, 6, 8));
+      entry.rdev_minor = minor(ar_num(hdr + 42, 6, 8));
+      entry.mtime = ar_num(hdr + 48, 11, 8);
+      namesize = ar_num(hdr + 59, 6, 8);
+      entry.size = ar_num(hdr + 65, 11, 8);
+    }
+
+    if(!namesize || namesize > 4096) {
+      s->err = "cpio: invalid header";
+      err = 1;
+      break;
+    }
+
+    name = realloc(name, namesize + 1);
+    if(ar_read(s, name, namesize) || (newc && ar_align(s, 4))) { err = 1; break; }
+    name[namesize] = 0;
+
+    if(!strcmp(name, "TRAILER!!!")) break;
+
+    entry.name = name;
+
+    if(S_ISLNK(entry.mode)) {
+      if(entry.size > 4096) {
+        s->err = "cpio: invalid symlink";
+        err = 1;
+        break;
+      }
+      link = realloc(link, entry.size + 1);
+      if(ar_read(s, link, entry.size)) { err = 1; break; }
+      link[entry.size] = 0;
+      entry.link = link;
+      entry.size = 0;
+    }
+
+    if(S_ISREG(entry.mode) && entry.nlink > 1) {
+      asprintf(&entry.link_id, "%x:%x:%x", dev_major, dev_minor, ino);
+    }
+
+    err = ar_entry(ar, &entry);
+
+    free(entry.link_id);
+
+    if(err || (newc && ar_align(s, 4))) {
+      err = 1;
+      break;
+    }
+  }
+
+  free(name);
+  free(link);
+
+  return err;
+}
+
+
+/*
+ * Unpack tar archive.
+ */
+int ar_tar(ar_t *ar)
+{
+  ar_stream_t *s = &ar->s;
+  unsigned char hdr[512];
+  char *long_name = NULL, *long_link = NULL, *pax = NULL, *name = NULL, *link = NULL;
+  ar_entry_t entry, pax_entry = { };
+  unsigned u, sum;
+  uint64_t size;
+  int err = 0, type;
+
+  for(;;) {
+    if(ar_read(s, hdr, sizeof hdr)) {
+      if(!s->err) s->err = "tar: unexpected end of archive";
+      err = 1;
+      break;
+    }
+
+    // end of archive
+    for(u = 0; u < sizeof hdr && !hdr[u]; u++);
+    if(u == sizeof hdr) break;
+
+    for(sum = u = 0; u < sizeof hdr; u++) sum += u >= 148 && u < 156 ? ' ' : hdr[u];
+
+    if(sum != ar_num((char *) hdr + 148, 8, 8)) {
+      s->err = "tar: checksum error";
+      err = 1;
+      break;
+    }
+
+    size = ar_num((char *) hdr + 124, 12, 8);
+    type = hdr[156];
+
+    /* meta data for the next entry */
+    if(type == 'L' || type == 'K' || type == 'x' || type == 'g') {
+      if(size > (1 << 20)) {
+        s->err = "tar: invalid header";
+        err = 1;
+        break;
+      }
+
+      free(pax);
+      pax = calloc(1, size + 1);
+      if(ar_read(s, pax, size) || ar_align(s, 512)) { err = 1; break; }
+
+      if(type == 'L') {
+        free(long_name);
+        long_name = pax;
+        pax = NULL;
+      }
+      else if(type == 'K') {
+        free(long_link);
+        long_link = pax;
+        pax = NULL;
+      }
+      else if(type == 'x') {
+        if(ar_pax(pax, size, &pax_entry)) {
+          s->err = "tar: invalid pax header";
+          err = 1;
+          break;
+        }
+      }
+
+      continue;
+    }
+
+    memset(&entry, 0, sizeof entry);
+
+    free(name);
+    if(long_name) {
+      name = long_name;
+      long_name = NULL;
+    }
+    else if(!memcmp(hdr + 257, "ustar", 5) && hdr[345]) {
+      asprintf(&name, "%.155s/%.100s", hdr + 345, hdr);
+    }
+    else {
+      asprintf(&name, "%.100s", hdr);
+    }
+
+    free(link);
+    if(long_link) {
+      link = long_link;
+      long_link = NULL;
+    }
+    else {
+      asprintf(&link, "%.100s", hdr + 157);
+    }
+
+    if(pax_entry.name) {
+      free(name);
+      name = pax_entry.name;
+    }
+    if(pax_entry.link) {
+      free(link);
+      link = pax_entry.link;
+    }
+
+    entry.name = name;
+    entry.link = link;
+    entry.mode = ar_num((char *) hdr + 100, 8, 8) & 07777;
+    entry.uid = ar_num((char *) hdr + 108, 8, 8);
+    entry.gid = ar_num((char *) hdr + 116, 8, 8);
+    entry.size = pax_entry.size ?: size;
+    entry.mtime = pax_entry.mtime ?: (time_t) ar_num((char *) hdr + 136, 12, 8);
+    entry.rdev_major = ar_num((char *) hdr + 329, 8, 8);
+    entry.rdev_minor = ar_num((char *) hdr + 337, 8, 8);
+    entry.real_size = pax_entry.real_size;
+    entry.sparse = pax_entry.sparse;
+
+    memset(&pax_entry, 0, sizeof pax_entry);
+
+    switch(type) {
+      case '0':
+      case '7':
+      case 0:
+        entry.mode |= S_IFREG;
+        break;
+
+      case '1':
+        entry.mode |= S_IFREG;
+        entry.hardlink = 1;
+        break;
+
+      case '2':
+        entry.mode |= S_IFLNK;
+        break;
+
+      case '3':
+        entry.mode |= S_IFCHR;
+        break;
+
+      case '4':
+        entry.mode |= S_IFBLK;
+        break;
+
+      case '5':
+        entry.mode |= S_IFDIR;
+        break;
+
+      case '6':
+        entry.mode |= S_IFIFO;
+        break;
+
+      default:
+        log_info("%s: %s: unsupported tar entry type '%c'\n", ar->file, name, type);
+        if(ar_skip(s, entry.size) || ar_align(s, 512)) err = 1;
+        continue;
+    }
+
+    if(!S_ISREG(entry.mode) || entry.hardlink) entry.size = 0;
+
+    if(ar_entry(ar, &entry) || ar_align(s, 512)) {
+      err = 1;
+      break;
+    }
+  }
+
+  free(long_name);
+  free(long_link);
+  free(pax);
+  free(name);
+  free(link);
+
+  return err;
+}
+
+
+/*
+ * Parse pax extended header.
+ *
+ * Records look like "<len> <key>=<value>\n". 'size' is the size of 'data'.
+ *
+ * Return 0 if ok, else 1.
+ */
+int ar_pax(char *data, size_t size, ar_entry_t *entry)
+{
+  char *s, *key, *val, *end;
+  unsigned long len;
+  int sparse_name = 0;
+
+  for(s = data; *s; s = end) {
+    len = strtoul(s, &key, 10);
+    if(!len || *key != ' ') return 1;
+    if(len > strnlen(s, data + size - s)) return 1;
+    end = s + len;
+    if(end <= key) return 1;
+    if(end[-1] != '\n' || !(val = memchr(key, '=', end - key))) return 1;
+    *val++ = 0;
+    end[-1] = 0;
+    key++;
+
+    if(!strcmp(key, "path")) {
+      if(!sparse_name) str_copy(&entry->name, val);
+    }
+    else if(!strcmp(key, "linkpath")) {
+      str_copy(&entry->link, val);
+    }
+    else if(!strcmp(key, "size")) {
+      entry->size = strtoull(val, NULL, 10);
+    }
+    else if(!strcmp(key, "mtime")) {
+      entry->mtime = strtoll(val, NULL, 10);
+    }
+    else if(!strcmp(key, "GNU.sparse.name")) {
+      str_copy(&entry->name, val);
+      sparse_name = 1;
+    }
+    else if(!strcmp(key, "GNU.sparse.realsize")) {
+      entry->real_size = strtoull(val, NULL, 10);
+    }
+    else if(!strcmp(key, "GNU.sparse.major")) {
+      entry->sparse = !strcmp(val, "1");
+    }
+  }
+
+  return 0;
+}
+
+
+/*
+ * Find offset of cpio payload in rpm.
+ *
+ * Return 0 if ok, else 1.
+ */
+int ar_rpm_payload(int fd, uint64_t *ofs)
+{
+  unsigned char buf[16];
+  uint64_t pos = 96;	/* rpm lead */
+  unsigned u, index_len, data_len;
+
+  /* signature header (8-byte aligned), then main header */
+  for(u = 0; u < 2; u++) {
+    if(
+      pread(fd, buf, sizeof buf, pos) != sizeof buf ||
+      memcmp(buf, "\x8e\xad\xe8\x01", 4)
+    ) return 1;
+
+    index_len = (buf[8] << 24) + (buf[9] << 16) + (buf[10] << 8) + buf[11];
+    data_len = (buf[12] << 24) + (buf[13] << 16) + (buf[14] << 8) + buf[15];
+
+    pos += 16 + index_len * 16 + data_len;
+    if(!u) pos = (pos + 7) & ~7ull;
+  }
+
+  *ofs = pos;
+
+  return 0;
+}
+
+
+/*
+ * Extract archive member.
+ *
+ * Reads the member data from the archive stream.
+ *
+ * Return 0 if ok, 1 on fatal errors (the archive can't be read).
+ * Problems creating files are just counted.
+ */
+int ar_entry(ar_t *ar, ar_entry_t *entry)
+{
+  char *name = entry->name, *path = NULL, *s;
+  slist_t *sl;
+  struct timespec times[2] = { };
+  int err = 0, skip = 0;
+
+  name = ar_name(name);
+
+  if(!*name || !strcmp(name, ".")) skip = 1;
+
+  if(!skip && ar_dotdot(name)) {
+    log_info("%s: %s: contains '..', skipped\n", ar->file, entry->name);
+    skip = 1;
+  }
+
+  if(!skip && entry->hardlink && ar_dotdot(ar_name(entry->link))) {
+    log_info("%s: %s: link target contains '..', skipped\n", ar->file, entry->name);
+    skip = 1;
+  }
+
+  if(!skip && ar->file_list) {
+    for(sl = ar->file_list; sl; sl = sl->next) {
+      if(!fnmatch(sl->key, entry->name, 0)) break;
+    }
+    if(!sl) skip = 1;
+  }
+
+  if(skip) return ar_skip(&ar->s, entry->size);
+
+  if(ar->tar_fd >= 0) return ar_tar_entry(ar, entry, name);
+
+  strprintf(&path, "%s/%s", ar->dir, name);
+
+  // remove trailing '/'
+  for(s = path + strlen(path); s > path + 1 && s[-1] == '/'; *--s = 0);
+
+  ar_mkdir(path);
+
+  if(!S_ISDIR(entry->mode) && unlink(path) && errno == EISDIR) rmdir(path);
+
+  times[0].tv_sec = times[1].tv_sec = entry->mtime;
+
+  switch(entry->mode & S_IFMT) {
+    case S_IFDIR:
+      if(mkdir(path, 0700) && errno != EEXIST) {
+        ar_error(ar, path, "mkdir");
+        break;
+      }
+      if(lchown(path, entry->uid, entry->gid)) {}
+      chmod(path, entry->mode & 07777);
+      sl = slist_append_str(&ar->dirs, path);
+      strprintf(&sl->value, "%lld", (long long) entry->mtime);
+      break;
+
+    case S_IFREG:
+      if(entry->hardlink) {
+        s = NULL;
+        strprintf(&s, "%s/%s", ar->dir, ar_name(entry->link));
+        if(link(s, path)) ar_error(ar, path, "link");
+        free(s);
+        break;
+      }
+
+      if(entry->link_id && (sl = slist_getentry(ar->links, entry->link_id))) {
+        if(link(sl->value, path)) ar_error(ar, path, "link");
+        break;
+      }
+
+      /* newc: data come with the last link */
+      if(entry->link_id && !entry->size) {
+        sl = slist_add(&ar->pending, slist_new());
+        sl->key = strdup(entry->link_id);
+        sl->value = strdup(path);
+        break;
+      }
+
+      err = ar_file(ar, entry, path);
+
+      if(entry->link_id) {
+        sl = slist_append_str(&ar->links, entry->link_id);
+        str_copy(&sl->value, path);
+
+        /* link all names that had been waiting for the data */
+        for(sl = ar->pending; sl; sl = sl->next) {
+          if(sl->key && !strcmp(sl->key, entry->link_id)) {
+            unlink(sl->value);
+            if(link(path, sl->value)) ar_error(ar, sl->value, "link");
+            // done
+            str_copy(&sl->key, NULL);
+          }
+        }
+      }
+      break;
+
+    case S_IFLNK:
+      if(*entry->link == '/' || ar_dotdot(entry->link)) {
+        ar_symlink_delay(ar, entry, path);
+        break;
+      }
+      if(symlink(entry->link, path)) {
+        ar_error(ar, path, "symlink");
+        break;
+      }
+      if(lchown(path, entry->uid, entry->gid)) {}
+      utimensat(AT_FDCWD, path, times, AT_SYMLINK_NOFOLLOW);
+      break;
+
+    case S_IFCHR:
+    case S_IFBLK:
+    case S_IFIFO:
+    case S_IFSOCK:
+      if(mknod(path, entry->mode, makedev(entry->rdev_major, entry->rdev_minor))) {
+        ar_error(ar, path, "mknod");
+        break;
+      }
+      if(lchown(path, entry->uid, entry->gid)) {}
+      chmod(path, entry->mode & 07777);
+      utimensat(AT_FDCWD, path, times, 0);
+      break;
+
+    default:
+      log_info("%s: %s: unsupported file type 0%o\n", ar->file, entry->name, entry->mode & S_IFMT);
+      break;
+  }
+
+  ar->files++;
+
+  free(path);
+
+  if(!err && entry->size) err = ar_skip(&ar->s, entry->size);
+
+  return err;
+}
+
+
+/*
+ * Write regular file.
+ *
+ * Return 0 if ok, 1 if the archive can't be read.
+ */
+int ar_file(ar_t *ar, ar_entry_t *entry, char *path)
+{
+  ar_stream_t *s = &ar->s;
+  int fd, err = 0;
+  unsigned u, chunks = 1;
+  uint64_t map0[2] = { 0, entry->size }, *map = map0;
+  uint64_t size = entry->size, pos = s->pos;
+  struct timespec times[2] = { };
+
+  fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+
+  if(fd == -1) ar_error(ar, path, "open");
+
+  if(entry->sparse) {
+    size = entry->real_size;
+    err = ar_sparse_map(s, &map, &chunks);
+  }
+
+  for(u = 0; u < chunks && !err; u++) {
+    err = ar_data(ar, fd, path, map[2 * u], map[2 * u + 1]);
+  }
+
+  if(map != map0) free(map);
+
+  if(err && !s->err) s->err = "unexpected end of archive";
+
+  entry->size -= s->pos - pos;
+
+  if(fd != -1) {
+    if(ftruncate(fd, size)) ar_error(ar, path, "truncate");
+
+    if(fchown(fd, entry->uid, entry->gid)) {}
+    fchmod(fd, entry->mode & 07777);
+
+    times[0].tv_sec = times[1].tv_sec = entry->mtime;
+    futimens(fd, times);
+
+    close(fd);
+  }
+
+  return err;
+}
+
+
+/*
+ * Copy 'len' bytes from archive to file offset 'ofs'.
+ *
+ * Zeros are skipped, leaving holes in the (new) file.
+ *
+ * Return 0 if ok, 1 if the archive can't be read.
+ */
+int ar_data(ar_t *ar, int fd, char *path, uint64_t ofs, uint64_t len)
+{
+  ar_stream_t *s = &ar->s;
+  size_t n, u, k;
+  unsigned char *p;
+  static const unsigned char zero[AR_BLOCK_SIZE];
+
+  if(fd == -1) return ar_skip(s, len);
+
+  while(len) {
+    if(!(n = ar_fill(s))) return 1;
+    if(n > len) n = len;
+
+    p = s->buf + s->buf_pos;
+
+    /* write in file system blocks */
+    for(u = 0; u < n; u += k) {
+      k = AR_BLOCK_SIZE - (ofs + u) % AR_BLOCK_SIZE;
+      if(k > n - u) k = n - u;
+      if(!memcmp(p + u, zero, k)) continue;
+      if(pwrite(fd, p + u, k, ofs + u) != (ssize_t) k) {
+        ar_error(ar, path, "write");
+
+        return ar_skip(s, len);
+      }
+    }
+
+    s->buf_pos += n;
+    s->pos += n;
+    ofs += n;
+    len -= n;
+  }
+
+  return 0;
+}
+
+
+/*
+ * Read GNU sparse file map (pax format 1.0).
+ *
+ * The map is at the start of the file data: '\n'-terminated numbers
+ * <count> (<offset> <size>)*, padded to 512 bytes.
+ *
+ * Return 0 if ok, else 1.
+ */
+int ar_sparse_map(ar_stream_t *s, uint64_t **map, unsigned *chunks)
+{
+  char buf[32];
+  unsigned u;
+
+  *map = NULL;
+  *chunks = 0;
+
+  if(ar_line(s, buf, sizeof buf)) return 1;
+  *chunks = strtoul(buf, NULL, 10);
+  if(*chunks > (1 << 20)) return 1;
+
+  *map = calloc(2 * *chunks + 1, sizeof **map);
+
+  for(u = 0; u < 2 * *chunks; u++) {
+    if(ar_line(s, buf, sizeof buf)) return 1;
+    (*map)[u] = strtoull(buf, NULL, 10);
+  }
+
+  return ar_align(s, 512);
+}
+
+
+/*
+ * Read a '\n'-terminated line.
+ *
+ * Return 0 if ok, else 1.
+ */
+int ar_line(ar_stream_t *s, char *buf, unsigned size)
+{
+  unsigned u;
+
+  for(u = 0; u < size; u++) {
+    if(ar_read(s, buf + u, 1)) return 1;
+    if(buf[u] == '\n') {
+      buf[u] = 0;
+
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+
+/*
+ * Add archive member to tar stream.
+ *
+ * Return 0 if ok, else 1.
+ */
+int ar_tar_entry(ar_t *ar, ar_entry_t *entry, char *name)
+{
+  ar_entry_t link_entry;
+  slist_t *sl;
+  int err = 0;
+
+  if(S_ISSOCK(entry->mode)) {
+    log_info("%s: %s: socket skipped\n", ar->file, entry->name);
+
+    return 0;
+  }
+
+  ar->files++;
+
+  if(entry->hardlink) entry->link = ar_name(entry->link);
+
+  /* cpio hard links */
+  if(S_ISREG(entry->mode) && entry->link_id && !entry->hardlink) {
+    if((sl = slist_getentry(ar->links, entry->link_id))) {
+      entry->hardlink = 1;
+      entry->link = sl->value;
+    }
+    else if(!entry->size) {
+      /* newc: data come with the last link */
+      sl = slist_add(&ar->pending, slist_new());
+      sl->key = strdup(entry->link_id);
+      sl->value = strdup(name);
+
+      return 0;
+    }
+  }
+
+  err = ar_tar_header(ar, entry, name);
+
+  if(!err && S_ISREG(entry->mode) && !entry->hardlink) {
+    err = ar_tar_data(ar, entry);
+
+    if(!err && entry->link_id) {
+      sl = slist_append_str(&ar->links, entry->link_id);
+      str_copy(&sl->value, name);
+
+      /* add all names that had been waiting for the data */
+      link_entry = *entry;
+      link_entry.hardlink = 1;
+      link_entry.link = name;
+      for(sl = ar->pending; sl && !err; sl = sl->next) {
+        if(sl->key && !strcmp(sl->key, entry->link_id)) {
+          err = ar_tar_header(ar, &link_entry, sl->value);
+          // done
+          str_copy(&sl->key, NULL);
+        }
+      }
+    }
+  }
+
+  if(!err && entry->size) err = ar_skip(&ar->s, entry->size);
+
+  return err;
+}
+
+
+/*
+ * Write tar header (ustar, plus pax header if needed).
+ *
+ * Return 0 if ok, else 1.
+ */
+int ar_tar_header(ar_t *ar, ar_entry_t *entry, char *name)
+{
+  char hdr[512] = { }, *pax = NULL, *link = "", buf[32];
+  uint64_t size = 0;
+  unsigned u;
+  int err = 0, type;
+
+  switch(entry->mode & S_IFMT) {
+    case S_IFREG:
+      type = entry->hardlink ? '1' : '0';
+      if(entry->hardlink) {
+        link = entry->link;
+      }
+      else {
+        size = entry->sparse ? entry->real_size : entry->size;
+      }
+      break;
+
+    case S_IFLNK:
+      type = '2';
+      link = entry->link;
+      break;
+
+    case S_IFCHR:
+      type = '3';
+      break;
+
+    case S_IFBLK:
+      type = '4';
+      break;
+
+    case S_IFDIR:
+      type = '5';
+      break;
+
+    default:
+      type = '6';
+      break;
+  }
+
+  if(strlen(name) > 100) ar_pax_add(&pax, "path", name);
+  if(strlen(link) > 100) ar_pax_add(&pax, "linkpath", link);
+  if(size >= 077777777777ull) {
+    snprintf(buf, sizeof buf, "%"PRIu64, size);
+    ar_pax_add(&pax, "size", buf);
+  }
+
+  if(pax) {
+    snprintf(hdr, 100, "PaxHeaders/%s", name);
+    sprintf(hdr + 100, "%07o", 0644);
+    sprintf(hdr + 124, "%011o", (unsigned) strlen(pax));
+    hdr[156] = 'x';
+
+    u = strlen(pax);
+    err =
+      ar_tar_block(ar, hdr) ||
+      ar_out(ar, pax, u) ||
+      ar_out_zero(ar, (512 - u % 512) % 512);
+
+    memset(hdr, 0, sizeof hdr);
+  }
+
+  strncpy(hdr, name, 100);
+  sprintf(hdr + 100, "%07o", entry->mode & 07777);
+  sprintf(hdr + 108, "%07o", entry->uid & 07777777);
+  sprintf(hdr + 116, "%07o", entry->gid & 07777777);
+  sprintf(hdr + 124, "%011llo", (unsigned long long) size & 077777777777ull);
+  sprintf(hdr + 136, "%011llo", (unsigned long long) entry->mtime & 077777777777ull);
+  hdr[156] = type;
+  strncpy(hdr + 157, link, 100);
+  if(type == '3' || type == '4') {
+    sprintf(hdr + 329, "%07o", entry->rdev_major & 07777777);
+    sprintf(hdr + 337, "%07o", entry->rdev_minor & 07777777);
+  }
+
+  if(!err) err = ar_tar_block(ar, hdr);
+
+  free(pax);
+
+  return err;
+}
+
+
+/*
+ * Write tar header block; fills in magic and checksum.
+ *
+ * Return 0 if ok, else 1.
+ */
+int ar_tar_block(ar_t *ar, char *hdr)
+{
+  unsigned u, sum;
+
+  memcpy(hdr + 257, "ustar\00000", 8);
+
+  memset(hdr + 148, ' ', 8);
+  for(sum = u = 0; u < 512; u++) sum += (unsigned char) hdr[u];
+  sprintf(hdr + 148, "%06o", sum);
+
+  return ar_out(ar, hdr, 512);
+}
+
+
+/*
+ * Copy file data to tar stream.
+ *
+ * Sparse files are expanded.
+ *
+ * Return 0 if ok, else 1.
+ */
+int ar_tar_data(ar_t *ar, ar_entry_t *entry)
+{
+  ar_stream_t *s = &ar->s;
+  unsigned u, chunks = 1;
+  uint64_t map0[2] = { 0, entry->size }, *map = map0;
+  uint64_t size = entry->size, pos = s->pos, ofs = 0, len;
+  size_t n;
+  int err = 0;
+
+  if(entry->sparse) {
+    size = entry->real_size;
+    err = ar_sparse_map(s, &map, &chunks);
+  }
+
+  for(u = 0; u < chunks && !err; u++) {
+    if(map[2 * u] < ofs || map[2 * u] + map[2 * u + 1] > size) {
+      s->err = "tar: invalid sparse map";
+      err = 1;
+      break;
+    }
+
+    err = ar_out_zero(ar, map[2 * u] - ofs);
+
+    for(len = map[2 * u + 1]; len && !err; len -= n) {
+      if(!(n = ar_fill(s))) {
+        err = 1;
+        break;
+      }
+      if(n > len) n = len;
+      err = ar_out(ar, s->buf + s->buf_pos, n);
+      s->buf_pos += n;
+      s->pos += n;
+    }
+
+    ofs = map[2 * u] + map[2 * u + 1];
+  }
+
+  if(map != map0) free(map);
+
+  if(!err) err = ar_out_zero(ar, size - ofs + (512 - size % 512) % 512);
+
+  if(err && !s->err) s->err = "unexpected end of archive";
+
+  entry->size -= s->pos - pos;
+
+  return err;
+}
+
+
+/*
+ * Append pax record "<len> <key>=<val>\n" to 'pax'.
+ */
+void ar_pax_add(char **pax, char *key, char *val)
+{
+  unsigned len, u, total;
+
+  // ' ', '=', '\n'
+  len = strlen(key) + strlen(val) + 3;
+
+  // the record length includes its own digits
+  for(total = len + 1, u = 10; total >= u; u *= 10) total++;
+
+  strprintf(pax, "%s%u %s=%s\n", *pax ?: "", total, key, val);
+}
+
+
+/*
+ * Write to tar stream.
+ *
+ * Return 0 if ok, else 1.
+ */
+int ar_out(ar_t *ar, void *buf, uint64_t len)
+{
+  ssize_t n;
+
+  while(len) {
+    n = write(ar->tar_fd, buf, len);
+    if(n == -1 && errno == EINTR) continue;
+    if(n <= 0) {
+      ar->s.err = "tar: write error";
+
+      return 1;
+    }
+    buf += n;
+    len -= n;
+  }
+
+  return 0;
+}
+
+
+int ar_out_zero(ar_t *ar, uint64_t len)
+{
+  static const unsigned char zero[AR_BLOCK_SIZE];
+  unsigned n;
+
+  for(; len; len -= n) {
+    n = len > sizeof zero ? sizeof zero : len;
+    if(ar_out(ar, (void *) zero, n)) return 1;
+  }
+
+  return 0;
+}
+
+
+/*
+ * Remove leading '/' and './' (like --no-absolute-filenames).
+ */
+char *ar_name(char *name)
+{
+  while(*name == '/') name++;
+  while(!strncmp(name, "./", 2)) name += 2;
+
+  return name;
+}
+
+
+/*
+ * Check for '..' path components.
+ */
+int ar_dotdot(char *name)
+{
+  char *s;
+
+  for(s = name; (s = strstr(s, "..")); s += 2) {
+    if((s == name || s[-1] == '/') && (!s[2] || s[2] == '/')) return 1;
+  }
+
+  return 0;
+}
+
+
+/*
+ * Remember symlink that might point outside the archive tree and create
+ * an empty placeholder file instead (like GNU tar).
+ */
+void ar_symlink_delay(ar_t *ar, ar_entry_t *entry, char *path)
+{
+  ar_symlink_t *sym;
+  struct stat sbuf;
+  int fd;
+
+  fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0);
+  if(fd == -1 || fstat(fd, &sbuf)) {
+    ar_error(ar, path, "open");
+    if(fd != -1) close(fd);
+
+    return;
+  }
+  close(fd);
+
+  sym = calloc(1, sizeof *sym);
+  sym->path = strdup(path);
+  sym->target = strdup(entry->link);
+  sym->dev = sbuf.st_dev;
+  sym->ino = sbuf.st_ino;
+  sym->uid = entry->uid;
+  sym->gid = entry->gid;
+  sym->mtime = entry->mtime;
+
+  sym->next = ar->symlinks;
+  ar->symlinks = sym;
+}
+
+
+/*
+ * Replace placeholder files with the delayed symlinks.
+ */
+void ar_symlinks(ar_t *ar)
+{
+  ar_symlink_t *sym, *next;
+  struct stat sbuf;
+  struct timespec times[2] = { };
+
+  for(sym = ar->symlinks; sym; sym = next) {
+    next = sym->next;
+
+    if(
+      !lstat(sym->path, &sbuf) &&
+      S_ISREG(sbuf.st_mode) &&
+      sbuf.st_dev == sym->dev &&
+      sbuf.st_ino == sym->ino &&
+      !unlink(sym->path)
+    ) {
+      if(symlink(sym->target, sym->path)) {
+        ar_error(ar, sym->path, "symlink");
+      }
+      else {
+        if(lchown(sym->path, sym->uid, sym->gid)) {}
+        times[0].tv_sec = times[1].tv_sec = sym->mtime;
+        utimensat(AT_FDCWD, sym->path, times, AT_SYMLINK_NOFOLLOW);
+      }
+    }
+    else {
+      log_info("%s: %s: placeholder changed, symlink not created\n", ar->file, sym->path);
+    }
+
+    free(sym->path);
+    free(sym->target);
+    free(sym);
+  }
+
+  ar->symlinks = NULL;
+}
+
+
+/*
+ * Create parent directories of 'path'.
+ */
+void ar_mkdir(char *path)
+{
+  char *s;
+
+  for(s = path + 1; (s = strchr(s, '/')); s++) {
+    *s = 0;
+    mkdir(path, 0755);
+    *s = '/';
+  }
+}
+
+
+void ar_error(ar_t *ar, char *path, char *msg)
+{
+  log_info("%s: %s: %s: %s\n", ar->file, path, msg, strerror(errno));
+
+  ar->errors++;
+}
+
+
+/*
+ * Convert (not 0-terminated) number; tar's base-256 encoding is
+ * recognized, too.
+ */
+uint64_t ar_num(char *str, unsigned len, unsigned base)
+{
+  char buf[32];
+  uint64_t val = 0;
+  unsigned u;
+
+  if(base == 8 && (*str & 0x80)) {
+    for(u = 1; u < len; u++) val = (val << 8) + (unsigned char) str[u];
+
+    return val;
+  }
+
+  if(len >= sizeof buf) len = sizeof buf - 1;
+
+  memcpy(buf, str, len);
+  buf[len] = 0;
+
+  return strtoull(buf, NULL, base);
+}
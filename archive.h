@@ -0,0 +1,11 @@
+/*
+ * Unpack cpio, tar and rpm archives.
+ *
+ * Replaces 'cpio -dimu', 'tar -xpf' and 'rpm2cpio | cpio' in util_mount().
+ */
+
+/* archive_unpack() return value if the archive has to be handled externally */
+#define ARCHIVE_UNSUPPORTED	-2
+
+int archive_unpack(char *file, char *dir, char *type, char *compr, slist_t *file_list);
+int archive_to_tar(char *file, int fd, char *type, char *compr, slist_t *file_list);
@@ -148,7 +148,9 @@ void auto2_scan_hardware()
   driver_info_t *di;
   int ju, err;
   slist_t *usb_modules = NULL, *sl, **names;
-  int storage_loaded = 0, max_wait;
+  int storage_loaded = 0, max_wait, settle_fd;
+  unsigned usb_quiet;
+  char *s;
   hd_data_t *hd_data;
   hd_hw_item_t hw_items[] = {
     hw_storage_ctrl, hw_network_ctrl, hw_hotplug_ctrl, hw_sys, 0
@@ -192,16 +194,16 @@ void auto2_scan_hardware()
 
     hd_data->progress = NULL;
 
-    config.module.delay += 2;
+    config.module.settle += 2;
+
+    settle_fd = util_wait_settle_start();
 
     for(hd = hd_pcmcia; hd; hd = hd->next) activate_driver(hd_data, hd, NULL, 0);
     hd_pcmcia = hd_free_hd_list(hd_pcmcia);
 
-    config.module.delay -= 2;
-
-    if(config.usbwait > 0) sleep(config.usbwait);
+    config.module.settle -= 2;
 
-    sleep(2);
+    util_wait_settle(settle_fd, "pcmcia", "pcmcia", ((config.usbwait > 0 ? config.usbwait : 0) + 2) * 1000, 1000);
 
     hd_pcmcia2 = hd_list(hd_data, hw_pcmcia, 1, NULL);
     for(hd = hd_pcmcia2; hd; hd = hd->next) activate_driver(hd_data, hd, NULL, 0);
@@ -215,7 +217,9 @@ void auto2_scan_hardware()
 
     hd_data->progress = NULL;
 
-    config.module.delay += 1;
+    config.module.settle += 1;
+
+    settle_fd = util_wait_settle_start();
 
     /* ehci needs to be loaded first */
     for(hd = hd_usb; hd; hd = hd->next) {
@@ -238,12 +242,17 @@ void auto2_scan_hardware()
     mod_modprobe("keybdev", NULL);
     mod_modprobe("usb-storage", NULL);
 
-    max_wait = 50;
-    do {
-      sleep(1);
-    } while(max_wait-- && util_process_running("usb-stor-scan"));
+    /* older kernels scan usb storage devices in a separate thread */
+    for(max_wait = 50; max_wait-- && util_process_running("usb-stor-scan");) sleep(1);
+
+    /*
+     * usb-storage waits 'delay_use' before scanning a new device, so
+     * don't take a quiet period shorter than that as 'settled'.
+     */
+    usb_quiet = strtoul(util_get_attr("/sys/module/usb_storage/parameters/delay_use"), &s, 10);
+    usb_quiet = (strstr(s, "ms") == s ? usb_quiet : usb_quiet * 1000) + 500;
 
-    sleep(config.usbwait + 1);
+    util_wait_settle(settle_fd, "usb", "usb scsi block", (config.usbwait + 2) * 1000, usb_quiet);
 
     hd_list(hd_data, hw_usb, 1, NULL);
 
@@ -251,7 +260,7 @@ void auto2_scan_hardware()
 
     load_drivers(hd_data, hw_usb);
 
-    config.module.delay -= 1;
+    config.module.settle -= 1;
   }
 
   if((hd_fw = hd_list(hd_data, hw_ieee1394_ctrl, 0, NULL)) && !config.test) {
@@ -259,16 +268,18 @@ void auto2_scan_hardware()
 
     hd_data->progress = NULL;
 
-    config.module.delay += 3;
+    config.module.settle += 3;
+
+    settle_fd = util_wait_settle_start();
 
     for(hd = hd_fw; hd; hd = hd->next) activate_driver(hd_data, hd, NULL, 0);
     hd_fw = hd_free_hd_list(hd_fw);
 
     mod_modprobe("sbp2", NULL);
 
-    config.module.delay -= 3;
+    config.module.settle -= 3;
 
-    if(config.usbwait > 0) sleep(config.usbwait);
+    util_wait_settle(settle_fd, "ieee1394", "firewire ieee1394 scsi block", config.usbwait > 0 ? config.usbwait * 1000 : 0, 1000);
 
     log_show(" ok\n");
   }
@@ -747,13 +758,41 @@ void load_network_mods()
 
 void load_drivers(hd_data_t *hd_data, hd_hw_item_t hw_item)
 {
-  hd_t *hd;
+  hd_t *hd, *hd0;
   driver_info_t *di;
+  str_list_t *sl;
+  slist_t *chains = NULL, *chain;
   int i, active;
   char *mods;
 
-  for(hd = hd_list(hd_data, hw_item, 0, NULL); hd; hd = hd->next) {
+  hd0 = hd_list(hd_data, hw_item, 0, NULL);
+
+  /*
+   * Load the drivers for all devices in parallel first; activate_driver()
+   * below then only has to deal with what is left.
+   */
+  for(hd = hd0; hd; hd = hd->next) {
     hd_add_driver_data(hd_data, hd);
+    if(hd->is.notready || driver_is_active(hd)) continue;
+    // keep disk enumeration order (/dev/sdX) stable: storage drivers are loaded serially
+    if(hd_is_hw_class(hd, hw_storage_ctrl)) continue;
+    for(di = hd->driver_info; di; di = di->next) {
+      if(di->module.type == di_module && di->module.names) break;
+    }
+    if(!di) continue;
+    // leave modules with explicit args to activate_driver()
+    for(sl = di->module.mod_args; sl && !(sl->str && *sl->str); sl = sl->next);
+    if(sl) continue;
+    mods = hd_join(" ", di->module.names);
+    chain = slist_append_str(&chains, mods);
+    if(di->module.modprobe) str_copy(&chain->value, "1");
+    free(mods);
+  }
+
+  mod_load_parallel(chains);
+  slist_free(chains);
+
+  for(hd = hd0; hd; hd = hd->next) {
     i = 0;
     if(
       (di = hd->driver_info) &&
@@ -862,21 +901,15 @@ char *auto2_serial_console()
  */
 void auto2_read_repo_files(url_t *url)
 {
-  int i;
-  char *dst = NULL;
-  static char *default_list[][2] = {
-    { "/media.1/info.txt", "/info.txt" },
-    { "/license.tar.gz", "/license.tar.gz" },
-    { "/part.info", "/part.info" },
-    { "/control.xml", "/control.xml" },
-    { "/autoinst.xml", "/tmp/autoinst.xml" }
+  url_file_t default_list[] = {
+    { "/media.1/info.txt", "/info.txt", URL_FLAG_NODIGEST },
+    { "/license.tar.gz", "/license.tar.gz", URL_FLAG_NODIGEST },
+    { "/part.info", "/part.info", URL_FLAG_NODIGEST },
+    { "/control.xml", "/control.xml", URL_FLAG_NODIGEST },
+    { "/autoinst.xml", "/tmp/autoinst.xml", URL_FLAG_NODIGEST }
   };
 
-  for(i = 0; i < sizeof default_list / sizeof *default_list; i++) {
-    url_read_file(url, NULL, default_list[i][0], default_list[i][1], NULL, URL_FLAG_NODIGEST);
-  }
-
-  str_copy(&dst, NULL);
+  url_read_files_batch(url, NULL, default_list, sizeof default_list / sizeof *default_list);
 
   if(!config.autoyast) {
     if(util_check_exist("/tmp/autoinst.xml")) rename("/tmp/autoinst.xml", "/autoinst.xml");
@@ -1012,6 +1045,7 @@ void auto2_driverupdate(url_t *url)
   slist_t **names;
   int err = 0;
   window_t win;
+  url_file_t dud = { };
 
   dud_count = config.update.count;
 
@@ -1020,15 +1054,12 @@ void auto2_driverupdate(url_t *url)
 
   if(config.win) dia_info(&win, "Reading Driver Update...", MSGTYPE_INFO);
 
-  /* first, look for 'driverupdate' archive */
-  err = url_read_file(
-    url,
-    NULL,
-    "driverupdate",
-    file_name = strdup(new_download()),
-    "Loading Driver Update",
-    URL_FLAG_NODIGEST + URL_FLAG_KEEP_MOUNTED + (config.secure ? URL_FLAG_CHECK_SIG : 0)
-  );
+  /* first, look for 'driverupdate' archive (and its signature) */
+  dud.src = "driverupdate";
+  dud.dst = file_name = strdup(new_download());
+  dud.flags = URL_FLAG_NODIGEST + URL_FLAG_KEEP_MOUNTED + (config.secure ? URL_FLAG_CHECK_SIG : 0);
+
+  err = url_read_files_batch(url, NULL, &dud, 1);
 
   if(!err) err = util_mount_ro(file_name, config.mountpoint.update, NULL);
 
@@ -5,8 +5,12 @@
 #include <string.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <errno.h>
+#include <inttypes.h>
 #include <fcntl.h>
 #include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
@@ -21,6 +25,21 @@
 
 #define MAX_DIGEST_SIZE SHA512_DIGEST_SIZE
 
+/* read buffers: count and size */
+#define MEDIA_BUFFERS		4
+#define MEDIA_BUFFER_SIZE	(1 << 20)
+
+/* data are passed to the digest functions in pieces of this size */
+#define MEDIA_DIGEST_CHUNK	(64 << 10)
+
+/* sector size and read attempts when reading around bad sectors */
+#define MEDIA_SECTOR_SIZE	(2 << 10)
+#define MEDIA_READ_RETRIES	3
+
+/* state of a canceled media check */
+#define MEDIA_STATE_FILE	"/tmp/checkmedia.state"
+#define MEDIA_STATE_VERSION	1
+
 typedef enum {
   digest_none, digest_md5, digest_sha1, digest_sha224, digest_sha256, digest_sha384, digest_sha512
 } digest_t;
@@ -35,7 +54,56 @@ typedef union {
 } digest_ctx_t;
 
 
+/*
+ * Reader thread state.
+ *
+ * The thread reads into buf[head], do_digest() processes buf[tail].
+ */
+typedef struct {
+  pthread_t thread;
+  int fd;
+  uint64_t start;		// start offset
+  uint64_t size;		// bytes to read
+  unsigned skip_errors:1;	// continue after read errors
+  unsigned bad_count, bad_max;	// unreadable sectors
+  unsigned *bad;
+  sem_t empty, filled;
+  unsigned head, tail;
+  volatile unsigned stop;	// tell thread to exit
+  struct {
+    unsigned char *data;
+    unsigned len;		// bytes read
+    unsigned err:1;		// read error after 'len' bytes
+  } buf[MEDIA_BUFFERS];
+} media_reader_t;
+
+/*
+ * Saved state of a canceled check, followed by bad_count sector numbers.
+ */
+typedef struct {
+  unsigned version;
+  char device[64];
+  char app_id[81];
+  unsigned size;
+  digest_t type;
+  unsigned char old[MAX_DIGEST_SIZE];
+  uint64_t pos;
+  digest_ctx_t ctx;
+  digest_ctx_t full_ctx;
+  unsigned bad_count;
+} media_state_t;
+
 static void do_digest(char *file);
+static int media_reader_start(media_reader_t *mr, int fd, uint64_t start, uint64_t size);
+static void media_reader_stop(media_reader_t *mr);
+static void *media_reader_run(void *data);
+static unsigned media_read(int fd, unsigned char *buf, unsigned len, uint64_t pos);
+static void media_read_sectors(media_reader_t *mr, unsigned char *buf, unsigned len, uint64_t pos, unsigned ok);
+static void media_add_bad(media_reader_t *mr, unsigned sector);
+static void media_log_bad(void);
+static int media_state_load(char *device, media_reader_t *mr, uint64_t *pos);
+static void media_state_save(char *device, media_reader_t *mr, uint64_t pos);
+static void digest_media_process_both(unsigned char *buffer, unsigned len, int first);
 static void get_info(char *file);
 static void update_progress(unsigned size);
 
@@ -54,6 +122,8 @@ struct {
   char app_id[81];		/* application id */
   char app_data[0x201];		/* app specific data*/
   unsigned pad;			/* pad size in kb */
+  unsigned bad_count;		/* number of unreadable sectors */
+  unsigned *bad;		/* unreadable sectors (2k) */
   struct {
     digest_t type;				/* digest type */
     char *name;					/* digest name */
@@ -144,6 +214,8 @@ void digest_media_verify(char *device)
     log_info("  err: sector %u\n", iso.err_ofs >> 1);
   }
 
+  if(iso.bad_count) media_log_bad();
+
   log_info("check: ");
   if(iso.digest.got_old) {
     if(iso.digest.ok) {
@@ -167,7 +239,10 @@ void digest_media_verify(char *device)
     dia_message("No errors found.", MSGTYPE_INFO);
   }
   else if(iso.err) {
-    if(iso.err_ofs) {
+    if(iso.bad_count > 1) {
+      sprintf(buf, "Error reading %u sectors (first: %u).", iso.bad_count, iso.bad[0]);
+    }
+    else if(iso.err_ofs) {
       sprintf(buf, "Error reading sector %u.", iso.err_ofs >> 1);
     }
     else {
@@ -189,94 +264,148 @@ void digest_media_verify(char *device)
  * Normal digest, except that we assume
  *   - 0x0000 - 0x01ff is filled with zeros (0)
  *   - 0x8373 - 0x8572 is filled with spaces (' ').
+ *
+ * A separate thread reads the data while we compute the digests.
+ *
+ * With 'mediacheck=2' unreadable sectors are skipped (and assumed to be
+ * zero) and reported at the end.
+ *
+ * If the check is canceled, the current state is saved and the user may
+ * continue from there next time.
  */
 void do_digest(char *file)
 {
-  unsigned char buffer[64 << 10]; /* at least 36k! */
-  int fd, err = 0;
-  unsigned chunks = (iso.size - iso.pad) / (sizeof buffer >> 10);
-  unsigned chunk, u;
-  unsigned last_size = ((iso.size - iso.pad) % (sizeof buffer >> 10)) << 10;
+  media_reader_t mr = { };
+  int fd, err = 0, first = 1, canceled = 0;
+  uint64_t start = 0, pos, size = (uint64_t) (iso.size - iso.pad) << 10;
+  unsigned u, len;
+  unsigned char *buffer;
   char msg[256];
   time_t t0 = 0, t1 = 0;
+  struct timespec ts0, ts1;
+  double sec;
 
   if((fd = open(file, O_RDONLY | O_LARGEFILE)) == -1) return;
 
+  digest_media_init(&iso.digest.ctx);
+  digest_media_init(&iso.digest.full_ctx);
+
+  if(media_state_load(file, &mr, &start)) {
+    sprintf(msg, "Continue previous check at %u%%?", (unsigned) ((start >> 10) * 100 / (iso.size ?: 1)));
+    if(dia_yesno(msg, YES) == YES) {
+      log_info("checkmedia: continuing at %"PRIu64" kB\n", start >> 10);
+    }
+    else {
+      digest_media_init(&iso.digest.ctx);
+      digest_media_init(&iso.digest.full_ctx);
+      free(mr.bad);
+      mr.bad = NULL;
+      mr.bad_count = mr.bad_max = 0;
+      start = 0;
+    }
+  }
+  unlink(MEDIA_STATE_FILE);
+
+  pos = start;
+  first = start == 0;
+
+  posix_fadvise(fd, start, size - start, POSIX_FADV_SEQUENTIAL);
+
+  mr.skip_errors = config.mediacheck == 2 ? 1 : 0;
+
+  if(!media_reader_start(&mr, fd, start, size)) {
+    free(mr.bad);
+    close(fd);
+    return;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &ts0);
+
   sprintf(msg, "%s, %s%u", iso.app_id, iso.media_type, iso.media_nr ?: 1);
   dia_status_on(&win, msg);
 
-  digest_media_init(&iso.digest.ctx);
-  digest_media_init(&iso.digest.full_ctx);
+  while(pos < size) {
+    sem_wait(&mr.filled);
+    buffer = mr.buf[mr.tail].data;
+    len = mr.buf[mr.tail].len;
 
-  for(chunk = 0; chunk < chunks; chunk++) {
-    if((u = read(fd, buffer, sizeof buffer)) != sizeof buffer) {
+    if(mr.buf[mr.tail].err) {
       err = 1;
-      if(u > sizeof buffer) u = 0 ;
-      iso.err_ofs = (u >> 10) + chunk * (sizeof buffer >> 10);
+      iso.err_ofs = (pos + len) >> 10;
       break;
-    };
+    }
 
-    digest_media_process(&iso.digest.full_ctx, buffer, sizeof buffer);
+    digest_media_process_both(buffer, len, first);
+    first = 0;
 
-    if(chunk == 0) {
-      memset(buffer, 0, 0x200);
-      memset(buffer + 0x8373, ' ', 0x200);
-    }
+    pos += len;
+    mr.tail = (mr.tail + 1) % MEDIA_BUFFERS;
+    sem_post(&mr.empty);
 
-    digest_media_process(&iso.digest.ctx, buffer, sizeof buffer);
-
-    if(!(chunk % 16)) {
-      update_progress((chunk + 1) * (sizeof buffer >> 10));
-
-      t1 = time(NULL);
-
-      // once a second is enough
-      if(t1 != t0 && kbd_getch_old(0) == KEY_ESC) {
-         digest_media_finish(&iso.digest.ctx, iso.digest.current);
-         digest_media_finish(&iso.digest.full_ctx, iso.digest.full);
-         dia_status_off(&win);
-         iso.digest.got_current = 0;
-         iso.digest.got_old = 0;
-         iso.digest.ok = 0;
-         iso.err_ofs = 0;
-         iso.err = 0;
-         close(fd);
-         return;
-      }
+    update_progress(pos >> 10);
+
+    t1 = time(NULL);
 
-      t0 = t1;
+    // once a second is enough
+    if(t1 != t0 && kbd_getch_old(0) == KEY_ESC) {
+      canceled = 1;
+      break;
     }
+
+    t0 = t1;
   }
 
-  if(!err && last_size) {
-    if((u = read(fd, buffer, last_size)) != last_size) {
-      err = 1;
-      if(u > sizeof buffer) u = 0 ;
-      iso.err_ofs = (u >> 10) + chunk * (sizeof buffer >> 10);
-    }
-    else {
-      digest_media_process(&iso.digest.ctx, buffer, last_size);
-      digest_media_process(&iso.digest.full_ctx, buffer, last_size);
+  media_reader_stop(&mr);
 
-      update_progress(iso.size - iso.pad);
-    }
+  if(canceled) {
+    media_state_save(file, &mr, pos);
+    free(mr.bad);
+  }
+  else if(mr.bad_count) {
+    err = 1;
+    iso.bad = mr.bad;
+    iso.bad_count = mr.bad_count;
+    iso.err_ofs = iso.bad[0] << 1;
   }
 
-  if(!err) {
-    memset(buffer, 0, 2 << 10);		/* 2k */
-    for(u = 0; u < (iso.pad >> 1); u++) {
-      digest_media_process(&iso.digest.ctx, buffer, 2 << 10);
-      digest_media_process(&iso.digest.full_ctx, buffer, 2 << 10);
+  if(!canceled && (!err || iso.bad_count)) {
+    // padding is all zeros; reuse a read buffer
+    buffer = mr.buf[0].data;
+    memset(buffer, 0, MEDIA_BUFFER_SIZE);
+    for(u = 0; u < iso.pad; u += len) {
+      len = iso.pad - u;
+      if(len > MEDIA_BUFFER_SIZE >> 10) len = MEDIA_BUFFER_SIZE >> 10;
+      digest_media_process_both(buffer, len << 10, 0);
 
-      update_progress(iso.size - iso.pad + ((u + 1) << 1));
+      update_progress(iso.size - iso.pad + u + len);
     }
   }
 
+  for(u = 0; u < MEDIA_BUFFERS; u++) free(mr.buf[u].data);
+
   digest_media_finish(&iso.digest.ctx, iso.digest.current);
   digest_media_finish(&iso.digest.full_ctx, iso.digest.full);
 
+  clock_gettime(CLOCK_MONOTONIC, &ts1);
+  sec = (ts1.tv_sec - ts0.tv_sec) + (ts1.tv_nsec - ts0.tv_nsec) / 1e9;
+  log_info(
+    "  read: %"PRIu64" MB in %.1f s (%.1f MB/s)\n",
+    (pos - start) >> 20, sec, sec > 0 ? ((pos - start) >> 20) / sec : 0
+  );
+
   dia_status_off(&win);
 
+  if(canceled) {
+    iso.digest.got_current = 0;
+    iso.digest.got_old = 0;
+    iso.digest.ok = 0;
+    iso.err_ofs = 0;
+    iso.err = 0;
+    close(fd);
+
+    return;
+  }
+
   if(err) iso.err = 1;
 
   iso.digest.got_current = 1;
@@ -292,6 +421,295 @@ void do_digest(char *file)
 }
 
 
+/*
+ * Add data to both digests.
+ *
+ * 'first' indicates the first buffer (which has to be at least 36k).
+ *
+ * The two digests run over the same piece of data before moving to the
+ * next piece; that way each piece is read from memory only once.
+ */
+void digest_media_process_both(unsigned char *buffer, unsigned len, int first)
+{
+  unsigned chunk;
+
+  for(; len; len -= chunk, buffer += chunk, first = 0) {
+    chunk = len > MEDIA_DIGEST_CHUNK ? MEDIA_DIGEST_CHUNK : len;
+
+    digest_media_process(&iso.digest.full_ctx, buffer, chunk);
+
+    if(first) {
+      memset(buffer, 0, 0x200);
+      memset(buffer + 0x8373, ' ', 0x200);
+    }
+
+    digest_media_process(&iso.digest.ctx, buffer, chunk);
+  }
+}
+
+
+/*
+ * Allocate buffers and start reader thread.
+ *
+ * Reads from 'start' to 'size'. mr->skip_errors and mr->bad* must be set
+ * up before.
+ *
+ * Return 1 if ok, else 0.
+ */
+int media_reader_start(media_reader_t *mr, int fd, uint64_t start, uint64_t size)
+{
+  unsigned u;
+  int err;
+
+  mr->fd = fd;
+  mr->start = start;
+  mr->size = size;
+  mr->head = mr->tail = 0;
+  mr->stop = 0;
+
+  for(u = 0; u < MEDIA_BUFFERS; u++) {
+    // page aligned to allow zero-copy reads
+    if(posix_memalign((void **) &mr->buf[u].data, 4096, MEDIA_BUFFER_SIZE)) {
+      while(u--) free(mr->buf[u].data);
+      return 0;
+    }
+  }
+
+  sem_init(&mr->empty, 0, MEDIA_BUFFERS);
+  sem_init(&mr->filled, 0, 0);
+
+  if((err = pthread_create(&mr->thread, NULL, media_reader_run, mr))) {
+    log_info("checkmedia: %s\n", strerror(err));
+    for(u = 0; u < MEDIA_BUFFERS; u++) free(mr->buf[u].data);
+    return 0;
+  }
+
+  return 1;
+}
+
+
+/*
+ * Stop reader thread.
+ *
+ * The buffers are not freed.
+ */
+void media_reader_stop(media_reader_t *mr)
+{
+  mr->stop = 1;
+
+  // in case it is waiting for a free buffer
+  sem_post(&mr->empty);
+
+  pthread_join(mr->thread, NULL);
+
+  sem_destroy(&mr->empty);
+  sem_destroy(&mr->filled);
+}
+
+
+void *media_reader_run(void *data)
+{
+  media_reader_t *mr = data;
+  uint64_t pos = mr->start;
+  unsigned len, err;
+
+  while(pos < mr->size) {
+    sem_wait(&mr->empty);
+    if(mr->stop) break;
+
+    len = mr->size - pos > MEDIA_BUFFER_SIZE ? MEDIA_BUFFER_SIZE : mr->size - pos;
+
+    // let the kernel fetch the next buffer while we read this one
+    posix_fadvise(mr->fd, pos + len, MEDIA_BUFFER_SIZE, POSIX_FADV_WILLNEED);
+
+    mr->buf[mr->head].err = 0;
+    mr->buf[mr->head].len = media_read(mr->fd, mr->buf[mr->head].data, len, pos);
+
+    if(mr->buf[mr->head].len < len) {
+      if(mr->skip_errors) {
+        media_read_sectors(mr, mr->buf[mr->head].data, len, pos, mr->buf[mr->head].len);
+        mr->buf[mr->head].len = len;
+      }
+      else {
+        mr->buf[mr->head].err = 1;
+      }
+    }
+
+    pos += mr->buf[mr->head].len;
+
+    err = mr->buf[mr->head].err;
+
+    mr->head = (mr->head + 1) % MEDIA_BUFFERS;
+    sem_post(&mr->filled);
+
+    if(err) break;
+  }
+
+  return NULL;
+}
+
+
+/*
+ * Read 'len' bytes at 'pos'.
+ *
+ * Return number of bytes read before an error occurred.
+ */
+unsigned media_read(int fd, unsigned char *buf, unsigned len, uint64_t pos)
+{
+  unsigned ok = 0;
+  ssize_t i;
+
+  while(ok < len) {
+    i = pread(fd, buf + ok, len - ok, pos + ok);
+    if(i < 0 && errno == EINTR) continue;
+    if(i <= 0) break;
+    ok += i;
+  }
+
+  return ok;
+}
+
+
+/*
+ * Read the remaining part of a buffer sector by sector after a read error.
+ *
+ * 'ok' bytes have already been read. Unreadable sectors are zeroed and
+ * added to the bad sector list.
+ */
+void media_read_sectors(media_reader_t *mr, unsigned char *buf, unsigned len, uint64_t pos, unsigned ok)
+{
+  unsigned ofs, sec_len, retry;
+
+  for(ofs = ok - ok % MEDIA_SECTOR_SIZE; ofs < len && !mr->stop; ofs += sec_len) {
+    sec_len = len - ofs > MEDIA_SECTOR_SIZE ? MEDIA_SECTOR_SIZE : len - ofs;
+
+    for(retry = 0; retry < MEDIA_READ_RETRIES; retry++) {
+      if(media_read(mr->fd, buf + ofs, sec_len, pos + ofs) == sec_len) break;
+    }
+
+    if(retry == MEDIA_READ_RETRIES) {
+      memset(buf + ofs, 0, sec_len);
+      media_add_bad(mr, (pos + ofs) / MEDIA_SECTOR_SIZE);
+    }
+  }
+}
+
+
+void media_add_bad(media_reader_t *mr, unsigned sector)
+{
+  if(mr->bad_count == mr->bad_max) {
+    mr->bad_max = mr->bad_max ? 2 * mr->bad_max : 64;
+    mr->bad = realloc(mr->bad, mr->bad_max * sizeof *mr->bad);
+  }
+
+  mr->bad[mr->bad_count++] = sector;
+}
+
+
+/*
+ * Log bad sector list; consecutive sectors are merged.
+ */
+void media_log_bad()
+{
+  unsigned u, first;
+
+  log_info("  bad: %u sectors:", iso.bad_count);
+
+  for(u = 0; u < iso.bad_count; u++) {
+    first = iso.bad[u];
+    while(u + 1 < iso.bad_count && iso.bad[u + 1] == iso.bad[u] + 1) u++;
+    if(first == iso.bad[u]) {
+      log_info(" %u", first);
+    }
+    else {
+      log_info(" %u-%u", first, iso.bad[u]);
+    }
+  }
+
+  log_info("\n");
+}
+
+
+/*
+ * Load state of a previously canceled check of 'device'.
+ *
+ * Sets digest contexts, bad sector list, and start position.
+ *
+ * Return 1 if there was a matching state, else 0.
+ */
+int media_state_load(char *device, media_reader_t *mr, uint64_t *pos)
+{
+  FILE *f;
+  media_state_t state;
+  int ok = 0;
+
+  if(!(f = fopen(MEDIA_STATE_FILE, "r"))) return 0;
+
+  if(
+    fread(&state, sizeof state, 1, f) == 1 &&
+    state.version == MEDIA_STATE_VERSION &&
+    !strncmp(state.device, device, sizeof state.device) &&
+    !strcmp(state.app_id, iso.app_id) &&
+    state.size == iso.size &&
+    state.type == iso.digest.type &&
+    !memcmp(state.old, iso.digest.old, sizeof state.old) &&
+    state.pos < (uint64_t) (iso.size - iso.pad) << 10
+  ) {
+    mr->bad_count = mr->bad_max = state.bad_count;
+    mr->bad = calloc(state.bad_count + 1, sizeof *mr->bad);
+    if(fread(mr->bad, sizeof *mr->bad, state.bad_count, f) == state.bad_count) {
+      iso.digest.ctx = state.ctx;
+      iso.digest.full_ctx = state.full_ctx;
+      *pos = state.pos;
+      ok = 1;
+    }
+    else {
+      free(mr->bad);
+      mr->bad = NULL;
+      mr->bad_count = mr->bad_max = 0;
+    }
+  }
+
+  fclose(f);
+
+  return ok;
+}
+
+
+/*
+ * Save current state so a canceled check can be continued later.
+ *
+ * 'pos' is the position up to which the digests have been calculated.
+ */
+void media_state_save(char *device, media_reader_t *mr, uint64_t pos)
+{
+  FILE *f;
+  media_state_t state = { };
+  unsigned bad_count;
+
+  // the reader may have got further than 'pos'
+  for(bad_count = mr->bad_count; bad_count && (uint64_t) mr->bad[bad_count - 1] * MEDIA_SECTOR_SIZE >= pos; bad_count--);
+
+  state.version = MEDIA_STATE_VERSION;
+  strncpy(state.device, device, sizeof state.device - 1);
+  strcpy(state.app_id, iso.app_id);
+  state.size = iso.size;
+  state.type = iso.digest.type;
+  memcpy(state.old, iso.digest.old, sizeof state.old);
+  state.pos = pos;
+  state.ctx = iso.digest.ctx;
+  state.full_ctx = iso.digest.full_ctx;
+  state.bad_count = bad_count;
+
+  if((f = fopen(MEDIA_STATE_FILE, "w"))) {
+    fwrite(&state, sizeof state, 1, f);
+    if(bad_count) fwrite(mr->bad, sizeof *mr->bad, bad_count, f);
+    fclose(f);
+    log_info("checkmedia: canceled at %"PRIu64" kB, state saved\n", pos >> 10);
+  }
+}
+
+
 /*
  * Read all kinds of iso header info.
  */
@@ -302,6 +720,8 @@ void get_info(char *file)
   char *s;
   unsigned u, u1, idx;
 
+  free(iso.bad);
+
   memset(&iso, 0, sizeof iso);
 
   iso.err = 1;
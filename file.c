@@ -19,6 +19,7 @@
 #include <netinet/in.h>
 #include <fcntl.h>
 #include <sys/select.h>
+#include <errno.h>
 
 #include <hd.h>
 
@@ -46,8 +47,14 @@
 #define INET_WRITE_NAME_OR_IP	4
 #define INET_WRITE_PREFIX	8
 
+/* keyword hash table size; must be larger than keywords[] */
+#define KEYWORD_HASH_SIZE	1024
+
 static char *file_key2str(file_key_t key);
 static file_key_t file_str2key(char *value, file_key_flag_t flags);
+static int strcasecmpignorestrich(const char *s1, const char *s2);
+static unsigned keyword_hash(const char *str);
+static void keyword_hash_init(void);
 static int sym2index(char *sym);
 static void parse_value(file_t *ft);
 
@@ -309,6 +316,11 @@ static struct {
   { key_sethostname,    "SetHostname",    kf_cfg + kf_cmd_early          },
   { key_debugshell,     "DebugShell",     kf_cfg + kf_cmd + kf_cmd_early },
   { key_self_update,    "SelfUpdate",     kf_cfg + kf_cmd                },
+  { key_paralleldownloads, "ParallelDownloads", kf_cfg + kf_cmd          },
+  { key_downloadsegments, "DownloadSegments", kf_cfg + kf_cmd            },
+  { key_digestthread,   "DigestThread",     kf_cfg + kf_cmd                },
+  { key_parallelmodules, "ParallelModules", kf_cfg + kf_cmd + kf_cmd_early },
+  { key_netrace,        "NetRace",        kf_cfg + kf_cmd                },
 };
 
 static struct {
@@ -396,54 +408,76 @@ char *file_key2str(file_key_t key)
  * Compare strings, ignoring '-', '_', and '.' characters in strings not
  * starting with '_'.
  */
-static int strcasecmpignorestrich(const char *s1, const char *s2)
+int strcasecmpignorestrich(const char *s1, const char *s2)
 {
-  char *str1 = strdup(s1);
-  char *str2 = strdup(s2);
-  char *s;
-  int i;
-  
-  /* remove all '-' and '_' */
-  if(*str1 != '_') {
-    for(i = 0, s = str1; str1[i]; i++) {
-      if(str1[i] != '_' && str1[i] != '-' && str1[i] != '.') {
-        *s++ = str1[i];
-      }
-    }
-    *s = 0;
+  int skip1 = *s1 != '_', skip2 = *s2 != '_';
+  int c1, c2;
+
+  do {
+    if(skip1) while(*s1 == '_' || *s1 == '-' || *s1 == '.') s1++;
+    if(skip2) while(*s2 == '_' || *s2 == '-' || *s2 == '.') s2++;
+    c1 = tolower(*(unsigned char *) s1++);
+    c2 = tolower(*(unsigned char *) s2++);
   }
+  while(c1 == c2 && c1);
 
-  /* remove all '-' and '_' */
-  if(*str2 != '_') {
-    for(i = 0, s = str2; str2[i]; i++) {
-      if(str2[i] != '_' && str2[i] != '-' && str2[i] != '.') {
-        *s++ = str2[i];
-      }
-    }
-    *s = 0;
+  return c1 - c2;
+}
+
+
+/*
+ * Hash function matching strcasecmpignorestrich().
+ */
+unsigned keyword_hash(const char *str)
+{
+  unsigned h = 2166136261u;
+  int skip = *str != '_';
+
+  for(; *str; str++) {
+    if(skip && (*str == '_' || *str == '-' || *str == '.')) continue;
+    h = (h ^ tolower(*(unsigned char *) str)) * 16777619u;
   }
 
-  i = strcasecmp(str1, str2);
+  return h;
+}
 
-  free(str1);
-  free(str2);
 
-  return i;
+/*
+ * Table of keywords[] indices (+ 1), open addressing.
+ *
+ * Keywords with the same name keep their keywords[] order along the probe
+ * sequence, so the first matching entry wins as before.
+ */
+static unsigned short keyword_hash_table[KEYWORD_HASH_SIZE];
+static int keyword_hash_ok;
+
+void keyword_hash_init()
+{
+  unsigned u, h;
+
+  for(u = 0; u < sizeof keywords / sizeof *keywords; u++) {
+    h = keyword_hash(keywords[u].value);
+    while(keyword_hash_table[h % KEYWORD_HASH_SIZE]) h++;
+    keyword_hash_table[h % KEYWORD_HASH_SIZE] = u + 1;
+  }
+
+  keyword_hash_ok = 1;
 }
 
 
 file_key_t file_str2key(char *str, file_key_flag_t flags)
 {
-  int i;
+  unsigned h, idx;
   slist_t *sl;
 
   if(!str || !*str || flags == kf_none) return key_none;
 
-  if(!*str) return key_none;
+  if(!keyword_hash_ok) keyword_hash_init();
 
-  for(i = 0; i < sizeof keywords / sizeof *keywords; i++) {
-    if((keywords[i].flags & flags) && !strcasecmpignorestrich(keywords[i].value, str)) {
-      return keywords[i].key;
+  for(h = keyword_hash(str); (idx = keyword_hash_table[h % KEYWORD_HASH_SIZE]); h++) {
+    idx--;
+    if((keywords[idx].flags & flags) && !strcasecmpignorestrich(keywords[idx].value, str)) {
+      return keywords[idx].key;
     }
   }
 
@@ -514,19 +548,51 @@ void parse_value(file_t *ft)
 }
 
 
+/*
+ * Read config file 'name' and split it into key/value pairs.
+ *
+ * The file is read in one go and parsed in place; the list entries are
+ * stored in the same memory block. Free it with file_free_file().
+ */
 file_t *file_read_file(char *name, file_key_flag_t flags)
 {
-  FILE *f;
-  char buf[1024];
-  char *s, *t, *t1;
-  file_t *ft0 = NULL, **ft = &ft0, *prev = NULL;
+  int fd;
+  ssize_t i;
+  size_t len = 0, size = 4096, lines, ofs;
+  char *buf, *line, *next, *s, *t, *t1;
+  file_t *ft0 = NULL, **ft = &ft0, *prev = NULL, *entries;
 
-  if(!name || !(f = fopen(name, "r"))) return NULL;
+  if(!name || (fd = open(name, O_RDONLY)) == -1) return NULL;
 
-  while(fgets(buf, sizeof buf, f)) {
-    for(s = buf; *s && isspace(*s); s++);
+  buf = malloc(size);
+
+  // don't rely on the file size, files in /proc don't have one
+  while((i = read(fd, buf + len, size - len - 1))) {
+    if(i < 0) {
+      if(errno == EINTR) continue;
+      break;
+    }
+    len += i;
+    if(len + 1 == size) buf = realloc(buf, size *= 2);
+  }
+
+  close(fd);
+
+  buf[len] = 0;
+
+  for(lines = 1, s = buf; (s = strchr(s, '\n')); s++) lines++;
+
+  // list entries go after the text
+  ofs = (len + 1 + __alignof__ (file_t) - 1) & ~(__alignof__ (file_t) - 1);
+  buf = realloc(buf, ofs + lines * sizeof *entries);
+  entries = memset(buf + ofs, 0, lines * sizeof *entries);
+
+  for(line = buf; line; line = next) {
+    if((next = strchr(line, '\n'))) *next++ = 0;
+
+    for(s = line; *s && isspace(*s); s++);
     t = s;
-    strsep(&t, ":= \t\n");
+    strsep(&t, ":= \t");
     if(t) {
       while(*t && (*t == ':' || *t == '=' || isspace(*t))) t++;
       for(t1 = t + strlen(t); t1 > t;) {
@@ -534,7 +600,7 @@ file_t *file_read_file(char *name, file_key_flag_t flags)
       }
     }
     else {
-      t = "";
+      t = s + strlen(s);
     }
 
     /* remove quotes */
@@ -547,11 +613,11 @@ file_t *file_read_file(char *name, file_key_flag_t flags)
     }
 
     if(*s) {
-      *ft = calloc(1, sizeof **ft);
+      *ft = entries++;
 
-      (*ft)->key_str = strdup(s);
+      (*ft)->key_str = s;
       (*ft)->key = file_str2key(s, flags);
-      (*ft)->value = strdup(t);
+      (*ft)->value = t;
 
       parse_value(*ft);
 
@@ -561,23 +627,25 @@ file_t *file_read_file(char *name, file_key_flag_t flags)
     }
   }
 
-  fclose(f);
+  if(ft0) {
+    ft0->mem = buf;
+  }
+  else {
+    free(buf);
+  }
 
   return ft0;
 }
 
 
+/*
+ * Free list returned by file_read_file() or file_parse_buffer().
+ *
+ * Everything is in a single memory block referenced by the first entry.
+ */
 void file_free_file(file_t *file)
 {
-  file_t *next;
-
-  for(; file; file = next) {
-    next = file->next;
-    if(file->unparsed) free(file->unparsed);
-    if(file->key_str) free(file->key_str);
-    if(file->value) free(file->value);
-    free(file);
-  }
+  if(file) free(file->mem);
 }
 
 
@@ -1329,7 +1397,8 @@ void file_do_info(file_t *f0, file_key_flag_t flags)
           s = strchr(s1, '.');
           t = strchr(s1, ' ');
           if(!s || (t && t < s)) break;	/* no spaces in module name */
-          str_copy(&f->value, s1);
+          /* s1 is part of f->unparsed, see file_parse_buffer() */
+          f->value = s1;
         }
         else {
           break;
@@ -1590,6 +1659,26 @@ void file_do_info(file_t *f0, file_key_flag_t flags)
         if(f->is.numeric) config.squash = f->nvalue;
         break;
 
+      case key_paralleldownloads:
+        if(f->is.numeric) config.download.parallel = f->nvalue;
+        break;
+
+      case key_downloadsegments:
+        if(f->is.numeric) config.download.segments = f->nvalue;
+        break;
+
+      case key_digestthread:
+        if(f->is.numeric) config.download.digest_thread = f->nvalue;
+        break;
+
+      case key_parallelmodules:
+        if(f->is.numeric) config.module.parallel = f->nvalue;
+        break;
+
+      case key_netrace:
+        if(f->is.numeric) config.net.race = f->nvalue;
+        break;
+
       case key_kexec_reboot:
         if(f->is.numeric) config.kexec_reboot = f->nvalue;
         break;
@@ -2089,14 +2178,25 @@ file_t *file_read_cmdline(file_key_flag_t flags)
 
 file_t *file_parse_buffer(char *buf, file_key_flag_t flags)
 {
-  file_t *ft0 = NULL, **ft = &ft0;
-  char *current, *s, *s1, *t, *t1, sep = ' ';
+  file_t *ft0 = NULL, **ft = &ft0, *entries;
+  char *current, *s, *s1, *t, *t1, *mem, *str, sep = ' ';
   int i, quote;
+  size_t len, max_entries;
 
   if(!buf) return NULL;
 
   if((flags & kf_comma)) sep = ',';
 
+  /*
+   * Allocate everything in one block: entries are separated by at least
+   * one char and each needs two copies of its text (unparsed + key/value).
+   */
+  len = strlen(buf);
+  max_entries = len / 2 + 1;
+  mem = malloc(max_entries * sizeof *entries + 2 * (len + max_entries));
+  entries = memset(mem, 0, max_entries * sizeof *entries);
+  str = mem + max_entries * sizeof *entries;
+
   current = buf;
 
   do {
@@ -2110,8 +2210,10 @@ file_t *file_parse_buffer(char *buf, file_key_flag_t flags)
       }
     }
     if(s > current) {
-      t = malloc(s - current + 1);
-      t1 = malloc(s - current + 1);
+      t = str;
+      str += s - current + 1;
+      t1 = str;
+      str += s - current + 1;
 
       memcpy(t1, current, s - current);
       t1[s - current] = 0;
@@ -2138,25 +2240,30 @@ file_t *file_parse_buffer(char *buf, file_key_flag_t flags)
 
       if((s1 = strchr(t, '='))) *s1++ = 0;
 
-      *ft = calloc(1, sizeof **ft);
+      *ft = entries++;
 
       i = strlen(t);
-      if(i && t[i - 1] == ':') t[i - 1] = 0;
+      if(i && t[i - 1] == ':') t[--i] = 0;
 
       (*ft)->unparsed = t1;
-      (*ft)->key_str = strdup(t);
+      (*ft)->key_str = t;
       (*ft)->key = file_str2key(t, flags);
-      (*ft)->value = strdup(s1 ?: "");
+      (*ft)->value = s1 ?: t + i;
 
       parse_value(*ft);
 
-      free(t);
-
       ft = &(*ft)->next;
     }
   }
   while(*current);
 
+  if(ft0) {
+    ft0->mem = mem;
+  }
+  else {
+    free(mem);
+  }
+
   return ft0;
 }
 
@@ -54,7 +54,9 @@ typedef enum {
   key_namescheme, key_ptoptions, key_is_ptoption, key_withfcoe, key_digests,
   key_plymouth, key_sslcerts, key_restart, key_restarted, key_autoyast2,
   key_withipoib, key_upgrade, key_ifcfg, key_defaultinstall, key_nanny, key_vlanid,
-  key_sshkey, key_systemboot, key_sethostname, key_debugshell, key_self_update
+  key_sshkey, key_systemboot, key_sethostname, key_debugshell, key_self_update,
+  key_paralleldownloads, key_downloadsegments,
+  key_digestthread, key_parallelmodules, key_netrace
 } file_key_t;
 
 typedef enum {
@@ -82,6 +84,7 @@ typedef struct file_s {
   struct {
     unsigned numeric:1;
   } is; 
+  void *mem;		// memory holding the whole list (first entry only)
 } file_t;
 
 file_t *file_getentry(file_t *f, char *key);
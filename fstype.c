@@ -37,6 +37,7 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <unistd.h>
+#include <stdlib.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
@@ -45,6 +46,9 @@
 #include "linux_fs.h"
 #include "fstype.h"
 
+/* fstype() reads this much from the start of a device */
+#define FSTYPE_HEAD_SIZE	0x11000
+
 /*
  * Most file system types can be recognized by a `magic' number
  * in the superblock.  Note that the order of the tests is
@@ -124,302 +128,299 @@ static int is_reiserfs_magic_string(struct reiserfs_super_block * rs)
 }
 
 
-char *fstype(const char *device)
+typedef union {
+  struct xiafs_super_block xiasb;
+  char romfs_magic[8];
+  char qnx4fs_magic[10];	/* ignore first 4 bytes */
+  long bfs_magic;
+  struct ntfs_super_block ntfssb;
+  struct fat_super_block fatsb;
+  struct xfs_super_block xfsb;
+  struct cramfs_super_block cramfssb;
+  unsigned char data[512];
+} block0_t;
+
+typedef union {
+  struct minix_super_block ms;
+  struct ext_super_block es;
+  struct ext2_super_block e2s;
+  struct vxfs_super_block vs;
+} block1_t;
+
+typedef union {
+  struct iso_volume_descriptor iso;
+  struct hs_volume_descriptor hs;
+} iso_t;
+
+
+/*
+ * Superblock checks.
+ *
+ * Each function gets a pointer to the data at the offset given in the
+ * probe table below and returns the fs type or NULL.
+ */
+
+static char *probe_block0(const unsigned char *buf)
 {
-  int fd;
-  char *type = NULL;
-  struct stat64 statbuf;
+  const block0_t *xsb = (const void *) buf;
+
+  if(xiafsmagic(xsb->xiasb) == _XIAFS_SUPER_MAGIC) return "xiafs";
+
+  if(!strncmp(xsb->romfs_magic, "-rom1fs-", 8)) return "romfs";
+
+  if(!strncmp(xsb->xfsb.s_magic, XFS_SUPER_MAGIC, 4)) return "xfs";
+
+  if(!strncmp(xsb->qnx4fs_magic+4, "QNX4FS", 6)) return "qnx4";
+
+  if(xsb->bfs_magic == 0x1badface) return "bfs";
+
+  if(!strncmp(xsb->ntfssb.s_magic, NTFS_SUPER_MAGIC, sizeof xsb->ntfssb.s_magic)) return "ntfs";
+
+  if(
+    cramfsmagic(xsb->cramfssb) == CRAMFS_SUPER_MAGIC ||
+    cramfsmagic(xsb->cramfssb) == CRAMFS_SUPER_MAGIC_BIG
+  ) return "cramfs";
+
+  if(
+    xsb->data[0x1fe] == 0x55 &&
+    xsb->data[0x1ff] == 0xaa &&
+    xsb->data[0x0b] == 0 &&	/* bytes per sector, bits 0-7 */
+    (
+      (	/* FAT12/16 */
+        xsb->data[0x26] == 0x29 && (
+          !strncmp(xsb->fatsb.s_fs, "FAT12   ", 8) ||
+          !strncmp(xsb->fatsb.s_fs, "FAT16   ", 8)
+        )
+      ) ||
+      (	/* FAT32 */
+        xsb->data[0x42] == 0x29 &&
+        !strncmp(xsb->fatsb.s_fs2, "FAT32   ", 8)
+      )
+    )
+  ) return "vfat";
+
+  return NULL;
+}
+
+
+static char *probe_archive(const unsigned char *buf)
+{
+  if(!memcmp(buf, "070701", 6) || !memcmp(buf, "\xc7\x71", 2)) return "cpio";
+
+  /* any compression (gzip, xz, zstd, ...) */
+  if(!memcmp(buf, "hsqs", 4) || !memcmp(buf, "sqsh", 4)) return "squashfs";
+
+  if(!memcmp(buf, "\xed\xab\xee\xdb", 4) && buf[4] >= 3) return "rpm";
+
+  return NULL;
+}
+
+
+static char *probe_sysv(const unsigned char *buf)
+{
+  const struct sysv_super_block *svsb = (const void *) buf;
+
+  return sysvmagic((*svsb)) == SYSV_SUPER_MAGIC ? "sysv" : NULL;
+}
+
+
+static char *probe_block1(const unsigned char *buf)
+{
+  const block1_t *sb = (const void *) buf;
 
   /*
-   * opening and reading an arbitrary unknown path can have
-   * undesired side effects - first check that `device' refers
-   * to a block device
+   * ext2 has magic in little-endian on disk, so "swapped" is
+   * superfluous; however, there have existed strange byteswapped
+   * PPC ext2 systems
    */
   if(
-    stat64(device, &statbuf) ||
-    !(S_ISBLK(statbuf.st_mode) || S_ISREG(statbuf.st_mode))
+    ext2magic(sb->e2s) == EXT2_SUPER_MAGIC ||
+    ext2magic(sb->e2s) == EXT2_PRE_02B_MAGIC ||
+    ext2magic(sb->e2s) == swapped(EXT2_SUPER_MAGIC)
   ) {
-    return 0;
-  }
+    if(
+      !(assemble4le((unsigned char *) sb->e2s.s_feature_compat) & EXT3_FEATURE_COMPAT_HAS_JOURNAL) ||
+      assemble4le((unsigned char *) sb->e2s.s_journal_inum) == 0
+    ) return "ext2";
 
-  fd = open(device, O_RDONLY | O_LARGEFILE);
-  /* try harder */
-  if(fd < 0 && errno == ENOMEDIUM) fd = open(device, O_RDONLY | O_LARGEFILE);
-  if(fd < 0) {
-    perror_debug((char *) device);
-    return 0;
+    if((assemble4le((unsigned char *) sb->e2s.s_feature_incompat) & EXT4_FEATURE_INCOMPAT_EXTENTS)) return "ext4";
+
+    return "ext3";
   }
 
-  /*
-   * do seeks and reads in disk order, otherwise a very short
-   * partition may cause a failure because of read error
-   */
+  if(
+    minixmagic(sb->ms) == MINIX_SUPER_MAGIC ||
+    minixmagic(sb->ms) == MINIX_SUPER_MAGIC2 ||
+    minixmagic(sb->ms) == MINIX2_SUPER_MAGIC ||
+    minixmagic(sb->ms) == MINIX2_SUPER_MAGIC2
+  ) return "minix";
 
-  if(!type) {
-    union {
-      struct xiafs_super_block xiasb;
-      char romfs_magic[8];
-      char qnx4fs_magic[10];	/* ignore first 4 bytes */
-      long bfs_magic;
-      struct ntfs_super_block ntfssb;
-      struct fat_super_block fatsb;
-      struct xfs_super_block xfsb;
-      struct cramfs_super_block cramfssb;
-      unsigned char data[512];
-    } xsb;
-
-    /* block 0 */
-    if(
-      lseek(fd, 0, SEEK_SET) == 0 &&
-      read(fd, &xsb, sizeof xsb) == sizeof xsb
-    ) {
-      if(xiafsmagic(xsb.xiasb) == _XIAFS_SUPER_MAGIC) {
-        type = "xiafs";
-      }
-      else if(!strncmp(xsb.romfs_magic, "-rom1fs-", 8)) {
-        type = "romfs";
-      }
-      else if(!strncmp(xsb.xfsb.s_magic, XFS_SUPER_MAGIC, 4)) {
-        type = "xfs";
-      }
-      else if(!strncmp(xsb.qnx4fs_magic+4, "QNX4FS", 6)) {
-        type = "qnx4";
-      }
-      else if(xsb.bfs_magic == 0x1badface) {
-        type = "bfs";
-      }
-      else if(!strncmp(xsb.ntfssb.s_magic, NTFS_SUPER_MAGIC, sizeof xsb.ntfssb.s_magic)) {
-        type = "ntfs";
-      }
-      else if(
-        cramfsmagic(xsb.cramfssb) == CRAMFS_SUPER_MAGIC ||
-        cramfsmagic(xsb.cramfssb) == CRAMFS_SUPER_MAGIC_BIG
-      ) {
-        type = "cramfs";
-      }
-      else if(
-        xsb.data[0x1fe] == 0x55 &&
-        xsb.data[0x1ff] == 0xaa &&
-        xsb.data[0x0b] == 0 &&	/* bytes per sector, bits 0-7 */
-        (
-          (	/* FAT12/16 */
-            xsb.data[0x26] == 0x29 && (
-              !strncmp(xsb.fatsb.s_fs, "FAT12   ", 8) ||
-              !strncmp(xsb.fatsb.s_fs, "FAT16   ", 8)
-            )
-          ) ||
-          (	/* FAT32 */
-            xsb.data[0x42] == 0x29 &&
-            !strncmp(xsb.fatsb.s_fs2, "FAT32   ", 8)
-          )
-        )
-      ) {
-        type = "vfat";
-      }
-    }
-  }
+  if(extmagic(sb->es) == EXT_SUPER_MAGIC) return "ext";
 
-  if(!type) {
-    char buf[6];
+  if(vxfsmagic(sb->vs) == VXFS_SUPER_MAGIC) return "vxfs";
 
-    if(
-      lseek(fd, 0, SEEK_SET) == 0 &&
-      read(fd, buf, sizeof buf) == sizeof buf
-    ) {
-      if(!memcmp(buf, "070701", 6) || !memcmp(buf, "\xc7\x71", 2)) type = "cpio";
-      else if(!memcmp(buf, "hsqs", 4) || !memcmp(buf, "sqsh", 4)) type = "squashfs";
-      else if(!memcmp(buf, "\xed\xab\xee\xdb", 4) && buf[4] >= 3) type = "rpm";
-    }
-  }
+  return NULL;
+}
 
-  if(!type) {	/* sector 1 */
-    struct sysv_super_block svsb;
 
-    if(
-      lseek(fd, 512 , SEEK_SET) == 512 &&
-      read(fd, &svsb, sizeof svsb) == sizeof svsb &&
-      sysvmagic(svsb) == SYSV_SUPER_MAGIC
-    ) {
-      type = "sysv";
-    }
-  }
+/*
+ * also check if block size is equal to 512 bytes,
+ * since the hfs driver currently only has support
+ * for block sizes of 512 bytes long, and to be
+ * more accurate (sb magic is only a short int)
+ */
+static char *probe_hfs(const unsigned char *buf)
+{
+  const struct hfs_super_block *hfssb = (const void *) buf;
 
-  if(!type) {	/* block 1 */
-    union {
-      struct minix_super_block ms;
-      struct ext_super_block es;
-      struct ext2_super_block e2s;
-      struct vxfs_super_block vs;
-    } sb;
+  if(
+    (hfsmagic((*hfssb)) == HFS_SUPER_MAGIC && hfsblksize((*hfssb)) == 0x20000) ||
+    (swapped(hfsmagic((*hfssb))) == HFS_SUPER_MAGIC && hfsblksize((*hfssb)) == 0x200)
+  ) return "hfs";
 
-    if(
-      lseek(fd, 1024, SEEK_SET) == 1024 &&
-      read(fd, &sb, sizeof sb) == sizeof sb
-    ) {
-      /*
-       * ext2 has magic in little-endian on disk, so "swapped" is
-       * superfluous; however, there have existed strange byteswapped
-       * PPC ext2 systems
-       */
-      if(
-        ext2magic(sb.e2s) == EXT2_SUPER_MAGIC ||
-        ext2magic(sb.e2s) == EXT2_PRE_02B_MAGIC ||
-        ext2magic(sb.e2s) == swapped(EXT2_SUPER_MAGIC)
-      ) {
-        type = "ext2";
-
-        if(
-          (assemble4le(sb.e2s.s_feature_compat) & EXT3_FEATURE_COMPAT_HAS_JOURNAL) &&
-          assemble4le(sb.e2s.s_journal_inum) != 0
-        ) {
-          type = "ext3";
-
-          if((assemble4le(sb.e2s.s_feature_incompat) & EXT4_FEATURE_INCOMPAT_EXTENTS)) {
-            type = "ext4";
-          }
-        }
-      }
-      else if(
-        minixmagic(sb.ms) == MINIX_SUPER_MAGIC ||
-        minixmagic(sb.ms) == MINIX_SUPER_MAGIC2 ||
-        minixmagic(sb.ms) == MINIX2_SUPER_MAGIC ||
-        minixmagic(sb.ms) == MINIX2_SUPER_MAGIC2
-      ) {
-        type = "minix";
-      }
-      else if(extmagic(sb.es) == EXT_SUPER_MAGIC) {
-        type = "ext";
-      }
-      else if(vxfsmagic(sb.vs) == VXFS_SUPER_MAGIC) {
-        type = "vxfs";
-      }
-    }
-  }
+  return NULL;
+}
 
-  if(!type) {	/* block 1 */
-    struct hfs_super_block hfssb;
 
-    /*
-     * also check if block size is equal to 512 bytes,
-     * since the hfs driver currently only has support
-     * for block sizes of 512 bytes long, and to be
-     * more accurate (sb magic is only a short int)
-     */
-    if(
-      lseek(fd, 0x400, SEEK_SET) == 0x400 &&
-      read(fd, &hfssb, sizeof hfssb) == sizeof hfssb &&
-      (
-        (hfsmagic(hfssb) == HFS_SUPER_MAGIC && hfsblksize(hfssb) == 0x20000) ||
-        (swapped(hfsmagic(hfssb)) == HFS_SUPER_MAGIC && hfsblksize(hfssb) == 0x200)
-      )
-    ) {
-      type = "hfs";
-    }
-  }
+static char *probe_ufs(const unsigned char *buf)
+{
+  const struct ufs_super_block *ufssb = (const void *) buf;
 
-  if(!type) {	/* block 8 */
-    struct ufs_super_block ufssb;
+  /* also test swapped version? */
+  return ufsmagic((*ufssb)) == UFS_SUPER_MAGIC ? "ufs" : NULL;
+}
 
-    if(
-      lseek(fd, 8192, SEEK_SET) == 8192 &&
-      read(fd, &ufssb, sizeof ufssb) == sizeof ufssb &&
-      ufsmagic(ufssb) == UFS_SUPER_MAGIC	/* also test swapped version? */
-    ) {
-      type = "ufs";
-    }
-  }
 
-  if(!type) {	/* block 8 */
-    struct reiserfs_super_block reiserfssb;
+static char *probe_reiserfs(const unsigned char *buf)
+{
+  return is_reiserfs_magic_string((struct reiserfs_super_block *) buf) ? "reiserfs" : NULL;
+}
 
-    if(
-      lseek(fd, REISERFS_OLD_DISK_OFFSET_IN_BYTES, SEEK_SET) == REISERFS_OLD_DISK_OFFSET_IN_BYTES &&
-      read(fd, &reiserfssb, sizeof(reiserfssb)) == sizeof(reiserfssb) &&
-      is_reiserfs_magic_string(&reiserfssb)
-    ) {
-      type = "reiserfs";
-    }
-  }
 
-  if(!type) {	/* block 8 */
-    struct hpfs_super_block hpfssb;
+static char *probe_hpfs(const unsigned char *buf)
+{
+  const struct hpfs_super_block *hpfssb = (const void *) buf;
 
-    if(
-      lseek(fd, 0x2000, SEEK_SET) == 0x2000 &&
-      read(fd, &hpfssb, sizeof hpfssb) == sizeof hpfssb &&
-      hpfsmagic(hpfssb) == HPFS_SUPER_MAGIC
-    ) {
-      type = "hpfs";
-    }
-  }
+  return hpfsmagic((*hpfssb)) == HPFS_SUPER_MAGIC ? "hpfs" : NULL;
+}
 
-  if(!type) {	/* block 32 */
-    struct jfs_super_block jfssb;
 
-    if(
-      lseek(fd, JFS_SUPER1_OFF, SEEK_SET) == JFS_SUPER1_OFF &&
-      read(fd, &jfssb, sizeof jfssb) == sizeof jfssb &&
-      !strncmp(jfssb.s_magic, JFS_MAGIC, 4)
-    ) {
-      type = "jfs";
-    }
-  }
+static char *probe_jfs(const unsigned char *buf)
+{
+  const struct jfs_super_block *jfssb = (const void *) buf;
 
-  if(!type) {	/* block 32 */
-    union {
-      struct iso_volume_descriptor iso;
-      struct hs_volume_descriptor hs;
-    } isosb;
+  return strncmp(jfssb->s_magic, JFS_MAGIC, 4) ? NULL : "jfs";
+}
 
-    if(
-      lseek(fd, 0x8000, SEEK_SET) == 0x8000 &&
-      read(fd, &isosb, sizeof isosb) == sizeof isosb
-    ) {
-      if(
-        !strncmp(isosb.iso.id, ISO_STANDARD_ID, sizeof(isosb.iso.id)) ||
-        !strncmp(isosb.hs.id, HS_STANDARD_ID, sizeof(isosb.hs.id))
-      ) {
-        type = "iso9660";
-      }
-      else if(may_be_udf(isosb.iso.id)) {
-        type = "udf";
-      }
-    }
-  }
 
-  if(!type) {	/* block 64 */
-    struct reiserfs_super_block reiserfssb;
+static char *probe_iso(const unsigned char *buf)
+{
+  const iso_t *isosb = (const void *) buf;
 
-    if(
-      lseek(fd, REISERFS_DISK_OFFSET_IN_BYTES, SEEK_SET) == REISERFS_DISK_OFFSET_IN_BYTES &&
-      read(fd, &reiserfssb, sizeof reiserfssb) == sizeof reiserfssb &&
-      is_reiserfs_magic_string(&reiserfssb)
-    ) {
-      type = "reiserfs";
-    }
+  if(
+    !strncmp(isosb->iso.id, ISO_STANDARD_ID, sizeof(isosb->iso.id)) ||
+    !strncmp(isosb->hs.id, HS_STANDARD_ID, sizeof(isosb->hs.id))
+  ) return "iso9660";
+
+  if(may_be_udf(isosb->iso.id)) return "udf";
+
+  return NULL;
+}
+
+
+/*
+ * List of known file systems.
+ *
+ * Checked in this order; for entries without probe function the data
+ * at 'offset' must match 'magic'.
+ */
+static struct {
+  char *type;
+  unsigned offset;
+  unsigned size;		/* bytes needed at 'offset' */
+  char *magic;
+  char *(*probe)(const unsigned char *buf);
+} fstype_list[] = {
+  /* block 0 */
+  { NULL,       0,                                 sizeof (block0_t),                   NULL,       probe_block0   },
+  { NULL,       0,                                 6,                                   NULL,       probe_archive  },
+  /* sector 1 */
+  { NULL,       512,                               sizeof (struct sysv_super_block),    NULL,       probe_sysv     },
+  /* block 1 */
+  { NULL,       1024,                              sizeof (block1_t),                   NULL,       probe_block1   },
+  { NULL,       0x400,                             sizeof (struct hfs_super_block),     NULL,       probe_hfs      },
+  /* block 8 */
+  { NULL,       8192,                              sizeof (struct ufs_super_block),     NULL,       probe_ufs      },
+  { NULL,       REISERFS_OLD_DISK_OFFSET_IN_BYTES, sizeof (struct reiserfs_super_block), NULL,    probe_reiserfs },
+  { NULL,       0x2000,                            sizeof (struct hpfs_super_block),    NULL,       probe_hpfs     },
+  /* block 32 */
+  { NULL,       JFS_SUPER1_OFF,                    sizeof (struct jfs_super_block),     NULL,       probe_jfs      },
+  { NULL,       0x8000,                            sizeof (iso_t),                      NULL,       probe_iso      },
+  /* block 64 */
+  { NULL,       REISERFS_DISK_OFFSET_IN_BYTES,     sizeof (struct reiserfs_super_block), NULL,    probe_reiserfs },
+  { "btrfs",    0x10040,                           8,                                   "_BHRfS_M", NULL           },
+  { "f2fs",     0x400,                             4,                                   "\x10\x20\xf5\xf2", NULL   },
+  { "erofs",    0x400,                             4,                                   "\xe2\xe1\xf5\xe0", NULL   },
+  { "tar",      0x101,                             6,                                   "ustar",    NULL           },
+};
+
+
+char *fstype(const char *device)
+{
+  int fd, i;
+  char *type = NULL;
+  struct stat64 statbuf;
+  unsigned char *buf;
+  size_t buf_size, len;
+  ssize_t rd;
+
+  /*
+   * opening and reading an arbitrary unknown path can have
+   * undesired side effects - first check that `device' refers
+   * to a block device
+   */
+  if(
+    stat64(device, &statbuf) ||
+    !(S_ISBLK(statbuf.st_mode) || S_ISREG(statbuf.st_mode))
+  ) {
+    return 0;
   }
 
-  if(!type) {
-    char buf[8];
+  fd = open(device, O_RDONLY | O_LARGEFILE);
+  /* try harder */
+  if(fd < 0 && errno == ENOMEDIUM) fd = open(device, O_RDONLY | O_LARGEFILE);
+  if(fd < 0) {
+    perror_debug((char *) device);
+    return 0;
+  }
 
-    if(
-      lseek(fd, 0x10040, SEEK_SET) == 0x10040 &&
-      read(fd, buf, sizeof buf) == sizeof buf &&
-      !memcmp(buf, "_BHRfS_M", sizeof buf)
-    ) {
-      type = "btrfs";
-    }
+  /*
+   * Read everything we need in one go.
+   *
+   * A very short partition may cause a read error; then just use what
+   * we got and skip all checks that need more.
+   */
+  buf_size = FSTYPE_HEAD_SIZE;
+  if(buf_size < getpagesize() + 0x1000) buf_size = getpagesize() + 0x1000;
+
+  if(posix_memalign((void **) &buf, 0x1000, buf_size)) {
+    close(fd);
+    return 0;
   }
 
-  if(!type) {
-    char buf[6];
+  for(len = 0; len < buf_size; len += rd) {
+    if((rd = pread(fd, buf + len, buf_size - len, len)) <= 0) break;
+  }
 
-    if(
-      lseek(fd, 0x101, SEEK_SET) == 0x101 &&
-      read(fd, buf, sizeof buf) == sizeof buf &&
-      !memcmp(buf, "ustar", 6 /* with \0 */)
-    ) {
-      type = "tar";
+  close(fd);
+
+  for(i = 0; i < sizeof fstype_list / sizeof *fstype_list && !type; i++) {
+    if(fstype_list[i].offset + fstype_list[i].size > len) continue;
+    if(fstype_list[i].probe) {
+      type = fstype_list[i].probe(buf + fstype_list[i].offset);
+    }
+    else if(!memcmp(buf + fstype_list[i].offset, fstype_list[i].magic, fstype_list[i].size)) {
+      type = fstype_list[i].type;
     }
   }
 
@@ -429,27 +430,22 @@ char *fstype(const char *device)
      * on a new disk; warn her before she does mke2fs on it
      */
     int pagesize = getpagesize();
-    int rd;
-    char buf[pagesize + 32768];
 
     rd = pagesize;
     if(rd < 8192) rd = 8192;
-    if(rd > sizeof buf) rd = sizeof buf;
     if(
-      lseek(fd, 0, SEEK_SET) == 0 &&
-      read(fd, buf, rd) == rd &&
+      len >= rd &&
       (
-        may_be_swap(buf + pagesize) ||
-        may_be_swap(buf + 4096) ||
-        may_be_swap(buf + 8192)
+        may_be_swap((char *) buf + pagesize) ||
+        may_be_swap((char *) buf + 4096) ||
+        may_be_swap((char *) buf + 8192)
       )
     ) {
       type = "swap";
     }
   }
 
-  close(fd);
+  free(buf);
 
   return type;
 }
-
@@ -409,7 +409,7 @@ typedef struct {
   unsigned startshell:1;	/* start shell before & after yast */
   unsigned listen:1;		/* listen on port */
   unsigned zombies:1;		/* keep zombies around */
-  unsigned mediacheck:1;	/* check media */
+  unsigned mediacheck:2;	/* check media (2: continue after read errors) */
   unsigned installfilesread:1;	/* already got install files */
   unsigned zen;			/* zenworks mode */
   char *zenconfig;		/* zenworks config file */
@@ -585,6 +585,8 @@ typedef struct {
     slist_t *initrd;		/* extra modules for initrd */
     unsigned keep_usb_storage:1;	/* don't unload usb-storage */
     int delay;			/* wait this much after insmod */
+    unsigned parallel;		/* max number of modules loaded concurrently */
+    int settle;			/* wait up to this much for devices to settle after insmod */
     driver_t *drivers;		/* list of extra drive info */
     unsigned disks:1;		/* automatically ask for module disks */
     slist_t *options;		/* potential module parameters */
@@ -616,6 +618,9 @@ typedef struct {
     unsigned cnt;		/* download counter */
     unsigned instsys:1;		/* download instsys */
     unsigned instsys_set:1;	/* the above was explicitly set */
+    unsigned parallel;		/* max number of concurrent downloads */
+    unsigned segments;		/* max number of parallel range requests per file */
+    unsigned digest_thread:1;	/* compute digests in a separate thread */
     char *base;			/* base dir for downloads */
   } download;
 
@@ -629,11 +634,11 @@ typedef struct {
     unsigned ipv6:1;		/* do ipv6 config */
     unsigned dhcp_timeout_set:1;	/* dhcp_timeout was set explicitly */
     unsigned sethostname:1;	/* wicked should set hostname */
+    unsigned race:1;		/* try dhcp on all interfaces with link at once */
     unsigned do_setup;		/* do network setup */
     unsigned setup;		/* bitmask: do these network setup things */
     char *device;		/* currently used device */
     slist_t *devices;		/* list of active network devs */
-    slist_t *dns_cache;		/* cache dns lookups here */
     int file_length;		/* length of currently retrieved file */
     char *nisdomain;		/* NIS domain name */
     int dhcp_timeout;
@@ -469,6 +469,9 @@ void lxrc_end()
 
   util_plymouth_off();
 
+  // close cached download connections
+  url_cleanup();
+
   if(netstop || config.restarting) {
     LXRC_WAIT
 
@@ -790,6 +793,10 @@ void lxrc_init()
   config.secure = 1;
   config.sslcerts = 1;
   config.squash = 1;
+  config.download.parallel = 4;
+  config.download.segments = 4;
+  config.download.digest_thread = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? 1 : 0;
+  config.module.parallel = 4;
   config.kexec_reboot = 1;
   config.efi = -1;
   config.udev_mods = 1;
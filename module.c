@@ -17,6 +17,9 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/syscall.h>
 
 #include <hd.h>
 
@@ -38,12 +41,48 @@
 #define MENU_WIDTH		55
 #define MODULE_CONFIG		"module.config"
 #define CARDMGR_PIDFILE		"/run/cardmgr.pid"
+#define MOD_LOADED_HASH_SIZE	256
+
+#ifndef MODULE_INIT_IGNORE_MODVERSIONS
+#define MODULE_INIT_IGNORE_MODVERSIONS	1
+#define MODULE_INIT_IGNORE_VERMAGIC	2
+#endif
+
+/*
+ * A chain of modules that must be loaded in order.
+ */
+typedef struct {
+  slist_t *modules;	/* key: module name, value: module params */
+  unsigned loaded;	/* number of modules successfully loaded */
+  int err;		/* error code of the module that failed */
+} mod_job_t;
+
+typedef struct {
+  mod_job_t *jobs;
+  unsigned count;
+  unsigned next;	/* next job to be picked up */
+  pthread_mutex_t mutex;
+} mod_queue_t;
 
 static int mod_types = 0;
 static int mod_type[MAX_MODULE_TYPES] = {};
 static int mod_menu_last = 0;
 static int mod_show_kernel_messages = 0;
 
+/*
+ * Cache of loaded modules (module names with '-' replaced by '_').
+ *
+ * Filled from /proc/modules once and then kept up to date by our own
+ * insmod/rmmod calls. Modules loaded behind our back (udev, modprobe) are
+ * picked up on a cache miss via /sys/module. For modules that might have
+ * been removed behind our back, call mod_loaded_reset().
+ */
+static struct {
+  slist_t *hash[MOD_LOADED_HASH_SIZE];
+  unsigned valid:1;		// cache has been filled
+  unsigned saved;		// /proc/modules reads saved
+} mod_loaded;
+
 static void mod_update_list(void);
 static int mod_show_type(int type);
 static int mod_build_list(int type, char ***list, module_t ***mod_list);
@@ -55,6 +94,14 @@ static void mod_load_module_manual(char *module, int show);
 static int mod_list_loaded_modules(char ***list, module_t ***mod_list, dia_align_t align);
 static void mod_delete_module(void);
 static void mod_auto_detect(void);
+static unsigned mod_loaded_hash(char *module);
+static slist_t **mod_loaded_find(char *module);
+static void mod_loaded_add(char *module);
+static void mod_loaded_del(char *module);
+static void mod_loaded_read(void);
+static int mod_finit(char *module, char *param);
+static int mod_job_add(slist_t **modules, char *module, int modprobe, int deps);
+static void *mod_load_thread(void *arg);
 
 /*
  * return:
@@ -358,6 +405,9 @@ void mod_menu()
 
   net_stop();
 
+  /* modules might have been removed from a shell */
+  mod_loaded_reset();
+
   do {
     mod_update_list();
 
@@ -476,6 +526,7 @@ void mod_unload_module(char *module)
   util_update_kernellog();
 
   if(!err) {
+    mod_loaded_del(module);
     util_update_netdevice_list(module, 0);
     util_update_disk_list(module, 0);
     util_update_cdrom_list();
@@ -484,18 +535,121 @@ void mod_unload_module(char *module)
 
 
 int mod_is_loaded(char *module)
+{
+  char buf[256], *s;
+
+  if(!module) return 0;
+
+  if(!mod_loaded.valid) {
+    mod_loaded_read();
+  }
+  else {
+    if(!(++mod_loaded.saved % 100)) {
+      log_debug("mod_is_loaded: %u /proc/modules reads saved\n", mod_loaded.saved);
+    }
+  }
+
+  if(*mod_loaded_find(module)) return 1;
+
+  /* not in cache - maybe it has been loaded by someone else */
+  if(!strchr(module, '/') && strlen(module) < sizeof buf - 32) {
+    sprintf(buf, "/sys/module/%s/initstate", module);
+    for(s = buf + sizeof "/sys/module/" - 1; *s; s++) if(*s == '-') *s = '_';
+    if(util_check_exist(buf)) {
+      mod_loaded_add(module);
+
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+
+/*
+ * Hash module name; '-' and '_' are treated as equal (cf. mod_cmp()).
+ */
+unsigned mod_loaded_hash(char *module)
+{
+  unsigned h = 2166136261u;
+
+  for(; *module; module++) {
+    h ^= (unsigned char) (*module == '-' ? '_' : *module);
+    h *= 16777619u;
+  }
+
+  return h % MOD_LOADED_HASH_SIZE;
+}
+
+
+/*
+ * Find module in loaded-module cache.
+ *
+ * Returns pointer to the link pointing to the entry (*link is NULL if
+ * the module is not in the cache).
+ */
+slist_t **mod_loaded_find(char *module)
+{
+  slist_t **sl;
+
+  for(sl = &mod_loaded.hash[mod_loaded_hash(module)]; *sl; sl = &(*sl)->next) {
+    if(!mod_cmp((*sl)->key, module)) break;
+  }
+
+  return sl;
+}
+
+
+void mod_loaded_add(char *module)
+{
+  slist_t **sl = mod_loaded_find(module);
+
+  if(*sl) return;
+
+  *sl = slist_new();
+  (*sl)->key = strdup(module);
+}
+
+
+void mod_loaded_del(char *module)
+{
+  slist_t **sl = mod_loaded_find(module), *next;
+
+  if(!*sl) return;
+
+  next = (*sl)->next;
+  (*sl)->next = NULL;
+  slist_free(*sl);
+  *sl = next;
+}
+
+
+/*
+ * Drop loaded-module cache; it is re-read on the next mod_is_loaded() call.
+ */
+void mod_loaded_reset()
+{
+  mod_loaded.valid = 0;
+}
+
+
+/*
+ * (Re-)read loaded-module cache from /proc/modules.
+ */
+void mod_loaded_read()
 {
   file_t *f0, *f;
+  int i;
+
+  for(i = 0; i < MOD_LOADED_HASH_SIZE; i++) mod_loaded.hash[i] = slist_free(mod_loaded.hash[i]);
 
   f0 = file_read_file("/proc/modules", kf_none);
 
-  for(f = f0; f; f = f->next) {
-    if(!mod_cmp(f->key_str, module)) break;
-  }
+  for(f = f0; f; f = f->next) mod_loaded_add(f->key_str);
 
   file_free_file(f0);
 
-  return f ? 1 : 0;
+  mod_loaded.valid = 1;
 }
 
 
@@ -632,7 +786,7 @@ void mod_load_module_manual(char *module, int show)
 int mod_insmod(char *module, char *param)
 {
   char buf[512];
-  int err, cnt;
+  int err, cnt, settle_fd;
   char *force = config.forceinsmod ? "-f " : "";
   slist_t *sl;
   driver_t *drv;
@@ -671,13 +825,21 @@ int mod_insmod(char *module, char *param)
     if(mod_show_kernel_messages) kbd_switch_tty(4);
   }
 
-  err = lxrc_run(buf);
+  // listen before loading, the module's first events come at once
+  settle_fd = config.module.settle > 0 ? util_wait_settle_start() : -1;
+
+  err = mod_finit(module, param);
+
+  if(err == ENOSYS) err = lxrc_run(buf);
 
   if(config.module.delay > 0) sleep(config.module.delay);
 
+  if(config.module.settle > 0) util_wait_settle(settle_fd, module, NULL, err ? 0 : config.module.settle * 1000, 500);
+
   cnt = 0;
 
   if(!err) {
+    mod_loaded_add(module);
     for(drv = config.module.drivers; drv; drv = drv->next) {
       if(drv->name && !strcmp(drv->name, module)) {
         cnt += apply_driverid(drv);
@@ -717,6 +879,237 @@ int mod_insmod(char *module, char *param)
 }
 
 
+/*
+ * Load module via finit_module().
+ *
+ * Parameters are the same as for mod_insmod(), but nothing except the
+ * actual loading is done. This function may be called from several
+ * threads at the same time.
+ *
+ * return:
+ *   0: ok (or module was already loaded)
+ *   ENOSYS: not supported, use insmod
+ *   else: errno
+ */
+int mod_finit(char *module, char *param)
+{
+#ifdef SYS_finit_module
+  char buf[512];
+  int fd, err = 0, flags = 0;
+
+  snprintf(buf, sizeof buf, "%s/%s" MODULE_SUFFIX, config.module.dir, module);
+
+  if((fd = open(buf, O_RDONLY | O_CLOEXEC)) == -1) return errno;
+
+  if(config.forceinsmod) flags = MODULE_INIT_IGNORE_MODVERSIONS | MODULE_INIT_IGNORE_VERMAGIC;
+
+  if(syscall(SYS_finit_module, fd, param ?: "", flags)) err = errno;
+
+  close(fd);
+
+  if(err == EEXIST) err = 0;
+
+  log_info_maybe(config.debug, "finit_module: %s = %d\n", buf, err);
+
+  return err;
+#else
+  return ENOSYS;
+#endif
+}
+
+
+/*
+ * Add 'module' to a load chain.
+ *
+ * If 'modprobe' is set, include dependencies from module.config (see
+ * mod_modprobe()). If 'deps' is set, 'module' is itself a dependency
+ * and gets its default params (see mod_load_module_manual()).
+ *
+ * Return 1 if the chain can't be loaded (a module is tagged as broken).
+ */
+int mod_job_add(slist_t **modules, char *module, int modprobe, int deps)
+{
+  module_t *ml;
+  slist_t *sl0, *sl;
+  char *param = NULL;
+  int err = 0;
+
+  if(slist_getentry(config.module.broken, module)) return 1;
+
+  ml = modprobe || deps ? mod_get_entry(module) : NULL;
+
+  if(ml && modprobe && ml->pre_inst) {
+    sl0 = slist_split(' ', ml->pre_inst);
+    for(sl = sl0; sl && !err; sl = sl->next) err = mod_job_add(modules, sl->key, 0, 1);
+    slist_free(sl0);
+  }
+
+  if(ml) module = ml->name;
+
+  if(!err && !mod_is_loaded(module) && !slist_getentry(*modules, module)) {
+    if(ml && deps && ml->param && (ml->autoload || ml->dontask)) param = ml->param;
+    if((sl = slist_getentry(config.module.options, module))) param = sl->value;
+    sl = slist_append_str(modules, module);
+    str_copy(&sl->value, param);
+  }
+
+  if(ml && modprobe && ml->post_inst && !err) {
+    sl0 = slist_split(' ', ml->post_inst);
+    for(sl = sl0; sl && !err; sl = sl->next) err = mod_job_add(modules, sl->key, 0, 1);
+    slist_free(sl0);
+  }
+
+  return err;
+}
+
+
+/*
+ * Worker thread for mod_load_parallel().
+ */
+void *mod_load_thread(void *arg)
+{
+  mod_queue_t *queue = arg;
+  mod_job_t *job;
+  slist_t *sl;
+
+  for(;;) {
+    pthread_mutex_lock(&queue->mutex);
+    job = queue->next < queue->count ? queue->jobs + queue->next++ : NULL;
+    pthread_mutex_unlock(&queue->mutex);
+
+    if(!job) break;
+
+    for(sl = job->modules; sl; sl = sl->next, job->loaded++) {
+      if((job->err = mod_finit(sl->key, sl->value))) break;
+    }
+  }
+
+  return NULL;
+}
+
+
+/*
+ * Load several chains of modules concurrently.
+ *
+ * Each entry in 'chains' is a space-separated list of modules (key)
+ * that are loaded one after another. If value is set, dependencies from
+ * module.config are added like mod_modprobe() does.
+ *
+ * Independent chains are loaded in up to config.module.parallel threads.
+ * Chains sharing a module are fine: the kernel lets the second loader
+ * wait until the module is ready.
+ *
+ * This is just a speedup: modules that failed to load are left for the
+ * regular (serial) code path to deal with.
+ */
+void mod_load_parallel(slist_t *chains)
+{
+  mod_queue_t queue = { };
+  mod_job_t *job;
+  pthread_t *threads;
+  slist_t *sl, *sl0, *sl1;
+  driver_t *drv;
+  unsigned u, threads_cnt, loaded = 0, cnt = 0;
+  int i, err, settle_fd;
+
+  if(config.test || config.module.parallel < 2) return;
+
+  for(sl = chains; sl; sl = sl->next) queue.count++;
+
+  if(queue.count < 2) return;
+
+  queue.jobs = calloc(queue.count, sizeof *queue.jobs);
+
+  for(queue.count = 0, sl = chains; sl; sl = sl->next) {
+    job = queue.jobs + queue.count;
+    sl0 = slist_split(' ', sl->key);
+    for(err = 0, sl1 = sl0; sl1 && !err; sl1 = sl1->next) {
+      err = mod_job_add(&job->modules, sl1->key, sl->value ? 1 : 0, 0);
+    }
+    slist_free(sl0);
+    if(err || !job->modules) {
+      job->modules = slist_free(job->modules);
+    }
+    else {
+      queue.count++;
+    }
+  }
+
+  if(queue.count >= 2) {
+    if(config.run_as_linuxrc) {
+      util_update_netdevice_list(NULL, 1);
+      util_update_disk_list(NULL, 1);
+      util_update_cdrom_list();
+    }
+
+    settle_fd = config.module.settle > 0 ? util_wait_settle_start() : -1;
+
+    threads_cnt = queue.count < config.module.parallel ? queue.count : config.module.parallel;
+    threads = calloc(threads_cnt, sizeof *threads);
+
+    pthread_mutex_init(&queue.mutex, NULL);
+
+    for(u = 0; u < threads_cnt; u++) {
+      if(pthread_create(threads + u, NULL, mod_load_thread, &queue)) break;
+    }
+    threads_cnt = u;
+
+    // no threads at all: do it ourselves
+    if(!threads_cnt) mod_load_thread(&queue);
+
+    for(u = 0; u < threads_cnt; u++) pthread_join(threads[u], NULL);
+
+    pthread_mutex_destroy(&queue.mutex);
+    free(threads);
+
+    for(job = queue.jobs; job < queue.jobs + queue.count; job++) {
+      for(u = 0, sl = job->modules; sl; sl = sl->next, u++) {
+        if(u >= job->loaded) {
+          log_debug("%s: finit_module failed: %s\n", sl->key, strerror(job->err));
+          break;
+        }
+
+        loaded++;
+        mod_loaded_add(sl->key);
+
+        for(drv = config.module.drivers; drv; drv = drv->next) {
+          if(drv->name && !strcmp(drv->name, sl->key)) cnt += apply_driverid(drv);
+        }
+
+        if(sl->value) {
+          for(i = 0; isspace(sl->value[i]); i++);
+          if(sl->value[i]) {
+            sl1 = slist_add(&config.module.used_params, slist_new());
+            sl1->key = strdup(sl->key);
+            sl1->value = strdup(sl->value + i);
+          }
+        }
+      }
+    }
+
+    log_info("%u modules loaded in %u threads\n", loaded, threads_cnt ?: 1);
+
+    if(loaded && config.module.delay > 0) sleep(config.module.delay);
+    if(config.module.settle > 0) util_wait_settle(settle_fd, "modules", NULL, loaded ? config.module.settle * 1000 : 0, 500);
+    if(cnt) sleep(config.module.delay + 1);
+
+    if(config.run_as_linuxrc) {
+      scsi_rename();
+      util_update_kernellog();
+
+      if(loaded) {
+        util_update_netdevice_list(NULL, 1);
+        util_update_disk_list(NULL, 1);
+        util_update_cdrom_list();
+      }
+    }
+  }
+
+  for(job = queue.jobs; job < queue.jobs + queue.count; job++) slist_free(job->modules);
+  free(queue.jobs);
+}
+
+
 int mod_modprobe(char *module, char *param)
 {
   int err;
@@ -14,9 +14,11 @@ void       mod_menu(void);
 void       mod_unload_module(char *module);
 int        mod_unload_modules(char *modules);
 int        mod_is_loaded(char *module);
+void       mod_loaded_reset(void);
 int        mod_load_modules(char *modules, int show);
 int        mod_insmod(char *module, char *param);
 int        mod_modprobe(char *module, char *param);
+void       mod_load_parallel(slist_t *chains);
 void       mod_show_modules(void);
 void       mod_disk_text(char *buf, int type);
 int        mod_copy_modules(char *src_dir, int doit);
@@ -35,6 +35,10 @@
 #include <netinet/in.h>
 #include <netinet/ether.h>
 #include <sys/wait.h>
+#include <poll.h>
+#include <time.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
 
 #include <hd.h>
 
@@ -68,6 +72,8 @@ static int wlan_auth_cb(dia_item_t di);
 static dia_item_t di_wlan_auth_last = di_none;
 static void parse_leaseinfo(char *file);
 static void net_wicked_dhcp(void);
+static char *net_dhcp_ifcfg(void);
+static void net_read_leaseinfo(char *ifname);
 
 static void net_cifs_build_options(char **options, char *user, char *password, char *workgroup);
 static int ifcfg_write(char *device, ifcfg_t *ifcfg, int flags);
@@ -78,6 +84,50 @@ static int net_check_ip(char *buf, int multi, int with_prefix);
 static int compare_subnet(char *ip1, char *ip2, unsigned prefix);
 static void get_and_copy_ifcfg_flags(ifcfg_t *ifcfg, char *device);
 
+/*
+ * Network interface state as reported by rtnetlink.
+ */
+typedef struct {
+  int index;
+  char name[IF_NAMESIZE];
+  unsigned flags;		// IFF_*
+  unsigned has_addr:1;		// has an ipv4 or global ipv6 address
+} net_link_t;
+
+// rtnetlink socket, subscribed to link and address changes
+static int rtnl_fd = -1;
+
+/*
+ * DNS lookup results.
+ *
+ * Note: getaddrinfo() doesn't tell us the record TTLs, so use a fixed
+ * lifetime.
+ */
+#define DNS_CACHE_SIZE		64
+#define DNS_CACHE_TTL		300	/* s */
+#define DNS_CACHE_NEG_TTL	10	/* s, for failed lookups */
+
+typedef struct dns_cache_s {
+  struct dns_cache_s *next;
+  char *name;
+  struct in_addr ip;		// first IPv4 address
+  struct in6_addr ip6;		// first IPv6 address
+  slist_t *addrs;		// all addresses, in getaddrinfo() order
+  time_t expires;		// CLOCK_MONOTONIC
+  unsigned ipv4:1;
+  unsigned ipv6:1;
+} dns_cache_t;
+
+static dns_cache_t *dns_cache[DNS_CACHE_SIZE];
+
+static dns_cache_t *dns_cache_lookup(char *name);
+static unsigned dns_cache_hash(char *name);
+
+static int rtnl_open(unsigned groups);
+static int rtnl_dump(int fd, int type, net_link_t **links, unsigned *links_len);
+static int net_wait_state(char *ifnames, int up, unsigned timeout);
+static int net_state_reached(char *ifnames, int up);
+
 
 /*
  * Ask for VNC & SSH password, unless they have already been set.
@@ -280,8 +330,7 @@ int net_static()
  */
 int net_check_address(inet_t *inet, int do_dns)
 {
-  struct hostent *he = NULL;
-  slist_t *sl;
+  dns_cache_t *dc;
   char *s, buf[INET6_ADDRSTRLEN];
   int net_bits = 0;
 
@@ -352,82 +401,157 @@ int net_check_address(inet_t *inet, int do_dns)
   }
 
   if(!inet->ipv6 && !inet->ipv4) {
-    for(sl = config.net.dns_cache; sl; sl = sl->next) {
-      if(sl->key && sl->value && !strcasecmp(sl->key, inet->name)) {
-        if(!inet->ipv6 && config.net.ipv6 && strchr(sl->value, ':')) {
-          if(inet_pton(AF_INET6, sl->value, &inet->ip6) > 0) {
-            inet->ipv6 = 1;
-          }
-        }
+    dc = dns_cache_lookup(inet->name);
 
-        if(!inet->ipv4 && config.net.ipv4 && !strchr(sl->value, ':')) {
-          if(inet_pton(AF_INET, sl->value, &inet->ip) > 0) {
-            inet->ipv4 = 1;
-          }
-        }
-      }
+    if(dc->ipv6 && config.net.ipv6) {
+      inet->ipv6 = 1;
+      inet->ip6 = dc->ip6;
+    }
+
+    if(dc->ipv4 && config.net.ipv4) {
+      inet->ipv4 = 1;
+      inet->ip = dc->ip;
     }
   }
 
   if(inet->ipv6 || inet->ipv4) inet->ok = 1;
 
-  if(!inet->ok) {
-    if(config.net.ipv6) {
-      he = gethostbyname2(inet->name, AF_INET6);
-      if(!he) { sleep(1); he = gethostbyname2(inet->name, AF_INET6); }
-      if(!he) {
-        if(config.run_as_linuxrc) {
-          log_info("dns6: what is \"%s\"?\n", inet->name);
-        }
-      }
-      else {
-        inet->ok = 1;
-        inet->ipv6 = 1;
-        memcpy(&inet->ip6, *he->h_addr_list, he->h_length);
+  inet->ok = inet->ok && ((config.net.ipv6 && inet->ipv6) || (config.net.ipv4 && inet->ipv4));
 
-        s = (char *) inet_ntop(AF_INET6, &inet->ip6, buf, sizeof buf);
-        if(s) {
-          sl = slist_add(&config.net.dns_cache, slist_new());
-          str_copy(&sl->key, inet->name);
-          str_copy(&sl->value, s);
+  return inet->ok ? 0 : 1;
+}
 
-          if(config.run_as_linuxrc) {
-            log_info("dns6: %s is %s\n", inet->name, s);
-          }
-        }
+
+/*
+ * Look up 'name' in dns cache; resolve it if it's not there or the entry
+ * has expired.
+ *
+ * Both address families are queried at the same time.
+ *
+ * Return cache entry; check its ipv4 and ipv6 flags.
+ */
+dns_cache_t *dns_cache_lookup(char *name)
+{
+  dns_cache_t **dc0, *dc;
+  struct addrinfo hints = { .ai_socktype = SOCK_STREAM }, *res = NULL, *ai;
+  struct timespec ts;
+  char buf[INET6_ADDRSTRLEN];
+  int i;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  dc0 = dns_cache + dns_cache_hash(name) % DNS_CACHE_SIZE;
+
+  for(dc = *dc0; dc; dc = dc->next) {
+    if(!strcasecmp(dc->name, name)) break;
+  }
+
+  if(dc && dc->expires > ts.tv_sec) return dc;
+
+  if(!dc) {
+    dc = calloc(1, sizeof *dc);
+    dc->name = strdup(name);
+    dc->next = *dc0;
+    *dc0 = dc;
+  }
+
+  dc->ipv4 = dc->ipv6 = 0;
+  dc->addrs = slist_free(dc->addrs);
+
+  // AF_UNSPEC: glibc sends A and AAAA queries in parallel
+  hints.ai_family = config.net.ipv4 && config.net.ipv6 ? AF_UNSPEC : config.net.ipv6 ? AF_INET6 : AF_INET;
+
+  i = getaddrinfo(name, NULL, &hints, &res);
+  if(i) {
+    sleep(1);
+    i = getaddrinfo(name, NULL, &hints, &res);
+  }
+
+  for(ai = i ? NULL : res; ai; ai = ai->ai_next) {
+    if(ai->ai_family == AF_INET6) {
+      if(inet_ntop(AF_INET6, &((struct sockaddr_in6 *) ai->ai_addr)->sin6_addr, buf, sizeof buf)) {
+        if(!slist_getentry(dc->addrs, buf)) slist_append_str(&dc->addrs, buf);
       }
     }
-
-    if(config.net.ipv4) {
-      he = gethostbyname2(inet->name, AF_INET);
-      if(!he) { sleep(1); gethostbyname2(inet->name, AF_INET); }
-      if(!he) {
-        if(config.run_as_linuxrc) {
-          log_info("dns: what is \"%s\"?\n", inet->name);
-        }
+    if(ai->ai_family == AF_INET) {
+      if(inet_ntop(AF_INET, &((struct sockaddr_in *) ai->ai_addr)->sin_addr, buf, sizeof buf)) {
+        if(!slist_getentry(dc->addrs, buf)) slist_append_str(&dc->addrs, buf);
       }
-      else {
-        inet->ok = 1;
-        inet->ipv4 = 1;
-        memcpy(&inet->ip, *he->h_addr_list, he->h_length);
+    }
+    if(ai->ai_family == AF_INET6 && !dc->ipv6) {
+      dc->ipv6 = 1;
+      dc->ip6 = ((struct sockaddr_in6 *) ai->ai_addr)->sin6_addr;
+      if(config.run_as_linuxrc) {
+        log_info("dns6: %s is %s\n", name, inet_ntop(AF_INET6, &dc->ip6, buf, sizeof buf) ?: "");
+      }
+    }
+    if(ai->ai_family == AF_INET && !dc->ipv4) {
+      dc->ipv4 = 1;
+      dc->ip = ((struct sockaddr_in *) ai->ai_addr)->sin_addr;
+      if(config.run_as_linuxrc) {
+        log_info("dns: %s is %s\n", name, inet_ntop(AF_INET, &dc->ip, buf, sizeof buf) ?: "");
+      }
+    }
+  }
 
-        s = (char *) inet_ntop(AF_INET, &inet->ip, buf, sizeof buf);
-        if(s) {
-          sl = slist_add(&config.net.dns_cache, slist_new());
-          str_copy(&sl->key, inet->name);
-          str_copy(&sl->value, s);
+  if(!i) freeaddrinfo(res);
 
-          if(config.run_as_linuxrc) {
-            log_info("dns: %s is %s\n", inet->name, s);
-          }
-        }
-      }
+  if(!dc->ipv4 && !dc->ipv6 && config.run_as_linuxrc) {
+    log_info("dns: what is \"%s\"? (%s)\n", name, gai_strerror(i));
+  }
+
+  dc->expires = ts.tv_sec + (dc->ipv4 || dc->ipv6 ? DNS_CACHE_TTL : DNS_CACHE_NEG_TTL);
+
+  return dc;
+}
+
+
+/*
+ * Case-insensitive FNV-1a hash.
+ */
+unsigned dns_cache_hash(char *name)
+{
+  unsigned hash = 2166136261u;
+
+  while(*name) hash = (hash ^ tolower((unsigned char) *name++)) * 16777619u;
+
+  return hash;
+}
+
+
+/*
+ * Resolve 'name' (using our dns cache).
+ *
+ * Return comma-separated list of all addresses suitable for CURLOPT_RESOLVE
+ * or NULL if that didn't work or 'name' is already an address.
+ *
+ * Note: returns a static buffer.
+ */
+char *net_resolve(char *name)
+{
+  static char *buf = NULL;
+  inet_t inet = { };
+  slist_t *sl;
+  int ipv6;
+
+  str_copy(&buf, NULL);
+
+  if(!name || inet_pton(AF_INET6, name, &inet.ip6) > 0 || inet_pton(AF_INET, name, &inet.ip) > 0) return NULL;
+
+  name2inet(&inet, name);
+
+  // net_check_address() has just filled the cache entry
+  if(!net_check_address(&inet, 1)) {
+    for(sl = dns_cache_lookup(name)->addrs; sl; sl = sl->next) {
+      ipv6 = strchr(sl->key, ':') ? 1 : 0;
+      if(!(ipv6 ? config.net.ipv6 : config.net.ipv4)) continue;
+      strprintf(&buf, "%s%s%s%s%s", buf ?: "", buf ? "," : "", ipv6 ? "[" : "", sl->key, ipv6 ? "]" : "");
     }
   }
 
-  inet->ok = inet->ok && ((config.net.ipv6 && inet->ipv6) || (config.net.ipv4 && inet->ipv4));
+  free(inet.name);
 
-  return inet->ok ? 0 : 1;
+  return buf;
 }
 
 
@@ -1155,10 +1279,9 @@ int net_dhcp()
  */
 void net_wicked_dhcp()
 {
-  char file[256], *buf = NULL;
+  char *buf = NULL;
   window_t win;
-  int got_ip = 0, cfg_ok;
-  ifcfg_t *ifcfg = NULL;
+  int got_ip = 0;
   char *type;
 
   if(config.test) {
@@ -1167,30 +1290,7 @@ void net_wicked_dhcp()
     return;
   }
 
-  type = net_dhcp_type();
-
-  // override the default by an explicit ifcfg=dhcp{4,6}
-  if(!*type && config.ifcfg.manual->type) {
-    if(!strcmp(config.ifcfg.manual->type, "dhcp4")) type = "4";
-    if(!strcmp(config.ifcfg.manual->type, "dhcp6")) type = "6";
-  }
-
-  ifcfg = calloc(1, sizeof *ifcfg);
-  ifcfg->dhcp = 1;
-
-  strprintf(&ifcfg->type, "dhcp%s", type);
-
-  ifcfg->flags = config.ifcfg.manual->flags;
-  str_copy(&ifcfg->vlan, config.ifcfg.manual->vlan);
-
-  cfg_ok = ifcfg_write(config.ifcfg.manual->device, ifcfg, 0);
-
-  free(ifcfg->type);
-  free(ifcfg->vlan);
-  free(ifcfg);
-  ifcfg = NULL;
-
-  if(!cfg_ok) return;
+  if(!(type = net_dhcp_ifcfg())) return;
 
   char *ifname = NULL;
 
@@ -1207,15 +1307,7 @@ void net_wicked_dhcp()
 
   net_wicked_up(ifname);
 
-  if(config.net.ipv4) {
-    snprintf(file, sizeof file, "/run/wicked/leaseinfo.%s.dhcp.ipv4", ifname);
-    parse_leaseinfo(file);
-  }
-
-  if(!got_ip && config.net.ipv6) {
-    snprintf(file, sizeof file, "/run/wicked/leaseinfo.%s.dhcp.ipv6", ifname);
-    parse_leaseinfo(file);
-  }
+  net_read_leaseinfo(ifname);
 
   if(slist_getentry(config.ifcfg.if_up, ifname)) got_ip = 1;
 
@@ -1257,6 +1349,163 @@ void net_wicked_dhcp()
 }
 
 
+/*
+ * Write dhcp config for config.ifcfg.manual->device.
+ *
+ * Return dhcp type ("", "4", or "6") or NULL if that failed.
+ */
+char *net_dhcp_ifcfg()
+{
+  ifcfg_t *ifcfg;
+  char *type;
+  int cfg_ok;
+
+  type = net_dhcp_type();
+
+  // override the default by an explicit ifcfg=dhcp{4,6}
+  if(!*type && config.ifcfg.manual->type) {
+    if(!strcmp(config.ifcfg.manual->type, "dhcp4")) type = "4";
+    if(!strcmp(config.ifcfg.manual->type, "dhcp6")) type = "6";
+  }
+
+  ifcfg = calloc(1, sizeof *ifcfg);
+  ifcfg->dhcp = 1;
+
+  strprintf(&ifcfg->type, "dhcp%s", type);
+
+  ifcfg->flags = config.ifcfg.manual->flags;
+  str_copy(&ifcfg->vlan, config.ifcfg.manual->vlan);
+
+  cfg_ok = ifcfg_write(config.ifcfg.manual->device, ifcfg, 0);
+
+  free(ifcfg->type);
+  free(ifcfg->vlan);
+  free(ifcfg);
+
+  return cfg_ok ? type : NULL;
+}
+
+
+void net_read_leaseinfo(char *ifname)
+{
+  char file[256];
+
+  if(config.net.ipv4) {
+    snprintf(file, sizeof file, "/run/wicked/leaseinfo.%s.dhcp.ipv4", ifname);
+    parse_leaseinfo(file);
+  }
+
+  if(config.net.ipv6) {
+    snprintf(file, sizeof file, "/run/wicked/leaseinfo.%s.dhcp.ipv6", ifname);
+    parse_leaseinfo(file);
+  }
+}
+
+
+/*
+ * Send dhcp requests on all interfaces in 'devices' at the same time.
+ *
+ * Interfaces that don't get an address are shut down again.
+ *
+ * Return list of interfaces that are up. Use net_dhcp_race_use() to pick
+ * one and net_dhcp_race_end() to shut down the others.
+ */
+slist_t *net_dhcp_race(slist_t *devices)
+{
+  slist_t *sl, *up = NULL, *failed = NULL;
+  char *ifnames = NULL, *type = NULL;
+
+  if(config.test) return NULL;
+
+  for(sl = devices; sl; sl = sl->next) {
+    str_copy(&config.ifcfg.manual->device, sl->key);
+    get_and_copy_ifcfg_flags(config.ifcfg.manual, sl->key);
+    if(!(type = net_dhcp_ifcfg())) continue;
+    net_apply_ethtool(sl->key, NULL);
+    strprintf(&ifnames, "%s%s%s", ifnames ?: "", ifnames ? " " : "", sl->key);
+  }
+
+  // each interface is made current when it's used
+  str_copy(&config.ifcfg.current, NULL);
+
+  if(!ifnames) return NULL;
+
+  log_show_maybe(!config.win, "Sending DHCP%s requests to %s...\n", type, ifnames);
+
+  net_wicked_up(ifnames);
+
+  for(sl = devices; sl; sl = sl->next) {
+    slist_append_str(slist_getentry(config.ifcfg.if_up, sl->key) ? &up : &failed, sl->key);
+  }
+
+  str_copy(&ifnames, NULL);
+  for(sl = up; sl; sl = sl->next) {
+    strprintf(&ifnames, "%s%s%s", ifnames ?: "", ifnames ? " " : "", sl->key);
+  }
+  log_show_maybe(!config.win, "dhcp ok: %s\n", ifnames ?: "none");
+
+  net_dhcp_race_end(failed, NULL);
+
+  slist_free(failed);
+  str_copy(&ifnames, NULL);
+
+  return up;
+}
+
+
+/*
+ * Make 'ifname' (brought up by net_dhcp_race()) the current interface.
+ */
+void net_dhcp_race_use(char *ifname)
+{
+  log_info("%s: using dhcp config\n", ifname);
+
+  str_copy(&config.ifcfg.manual->device, ifname);
+  get_and_copy_ifcfg_flags(config.ifcfg.manual, ifname);
+  str_copy(&config.ifcfg.current, ifname);
+  check_ptp(ifname);
+
+  net_read_leaseinfo(ifname);
+
+  config.net.dhcp_active = 1;
+}
+
+
+/*
+ * Shut down all interfaces in 'devices' except 'keep' and remove their
+ * config.
+ */
+void net_dhcp_race_end(slist_t *devices, char *keep)
+{
+  slist_t *sl;
+  char *ifnames = NULL, *buf = NULL;
+
+  for(sl = devices; sl; sl = sl->next) {
+    if(keep && !strcmp(sl->key, keep)) continue;
+
+    strprintf(&ifnames, "%s%s%s", ifnames ?: "", ifnames ? " " : "", sl->key);
+
+    strprintf(&buf, "/etc/sysconfig/network/ifcfg-%s", sl->key);
+    unlink(buf);
+    strprintf(&buf, "/etc/sysconfig/network/ifroute-%s", sl->key);
+    unlink(buf);
+
+    if(config.ifcfg.current && !strcmp(config.ifcfg.current, sl->key)) {
+      str_copy(&config.ifcfg.current, NULL);
+      config.net.dhcp_active = 0;
+    }
+  }
+
+  if(ifnames) {
+    log_info("dhcp: shutting down %s\n", ifnames);
+    net_wicked_down(ifnames);
+  }
+
+  str_copy(&ifnames, NULL);
+  str_copy(&buf, NULL);
+}
+
+
 /*
  * Return current network config state as bitmask.
  */
@@ -2497,41 +2746,53 @@ char *ifcfg_print(ifcfg_t *ifcfg)
 
 
 /*
- * Run wicked to collect all interface states.
+ * Get all interface states via rtnetlink.
  *
- * config.ifcfg.if_state
+ * config.ifcfg.if_state: interface state (in wicked terms)
+ * config.ifcfg.if_up: interfaces that are up and have an address
  */
 void net_update_state()
 {
-  FILE *f;
-  char buf[256], *s1, *s2,*s3;
+  net_link_t *links = NULL;
+  unsigned u, links_len = 0;
+  int fd;
   slist_t *sl;
+  char *state;
 
   config.ifcfg.if_state = slist_free(config.ifcfg.if_state);
+  config.ifcfg.if_up = slist_free(config.ifcfg.if_up);
 
-  if((f = popen("wicked show all 2>/dev/null", "r"))) {
-    while(fgets(buf, sizeof buf, f)) {
-      if(!isspace(*buf)) {
-        for(s1 = buf; *s1 && !isspace(*s1); s1++);
-        for(s2 = s1; *s2 && isspace(*s2); s2++);
-        for(s3 = s2; *s3 && !isspace(*s3); s3++);
-        *s1 = *s3 = 0;
-        if(*buf && *s2 && s2 != buf) {
-          sl = slist_append(&config.ifcfg.if_state, slist_new());
-          str_copy(&sl->key, buf);
-          str_copy(&sl->value, s2);
-        }
-      }
+  if((fd = rtnl_open(0)) != -1) {
+    if(!rtnl_dump(fd, RTM_GETLINK, &links, &links_len)) {
+      rtnl_dump(fd, RTM_GETADDR, &links, &links_len);
     }
-    pclose(f);
+    close(fd);
   }
 
-  config.ifcfg.if_up = slist_free(config.ifcfg.if_up);
-  for(sl = config.ifcfg.if_state; sl; sl = sl->next) {
+  for(u = 0; u < links_len; u++) {
+    if(!(links[u].flags & IFF_UP)) {
+      state = "device-down";
+    }
+    else if(!(links[u].flags & IFF_RUNNING)) {
+      state = "device-up";
+    }
+    else if(!links[u].has_addr) {
+      state = "link-up";
+    }
+    else {
+      state = "up";
+    }
+
+    sl = slist_append(&config.ifcfg.if_state, slist_new());
+    str_copy(&sl->key, links[u].name);
+    str_copy(&sl->value, state);
+
     // interfaces != lo that are 'up'
     if(strcmp(sl->key, "lo") && !strcmp(sl->value, "up")) slist_append_str(&config.ifcfg.if_up, sl->key);
   }
 
+  free(links);
+
   log_debug("net_update_state: ");
   for(sl = config.ifcfg.if_state; sl; sl = sl->next) {
     log_debug("%s: %s%s", sl->key, sl->value, sl->next ? ", " : "");
@@ -2540,12 +2801,180 @@ void net_update_state()
 }
 
 
+/*
+ * Open rtnetlink socket and subscribe to 'groups' (RTMGRP_*).
+ *
+ * Return socket or -1.
+ */
+int rtnl_open(unsigned groups)
+{
+  struct sockaddr_nl sa = { .nl_family = AF_NETLINK, .nl_groups = groups };
+  int fd;
+
+  fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+
+  if(fd != -1 && bind(fd, (struct sockaddr *) &sa, sizeof sa)) {
+    close(fd);
+    fd = -1;
+  }
+
+  if(fd == -1) perror_debug("rtnetlink socket");
+
+  return fd;
+}
+
+
+/*
+ * Dump all links (RTM_GETLINK) or addresses (RTM_GETADDR).
+ *
+ * Links are added to 'links'; addresses update the 'has_addr' flag of
+ * the respective link.
+ *
+ * Return 0 if ok.
+ */
+int rtnl_dump(int fd, int type, net_link_t **links, unsigned *links_len)
+{
+  struct {
+    struct nlmsghdr nh;
+    struct rtgenmsg g;
+  } req = {
+    .nh = {
+      .nlmsg_len = sizeof req,
+      .nlmsg_type = type,
+      .nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP,
+      .nlmsg_seq = type
+    },
+    .g = { .rtgen_family = AF_UNSPEC }
+  };
+  static char buf[32 << 10] __attribute__ ((aligned (NLMSG_ALIGNTO)));
+  struct nlmsghdr *nh;
+  struct ifinfomsg *ifi;
+  struct ifaddrmsg *ifa;
+  struct rtattr *rta;
+  unsigned u, len;
+  ssize_t n;
+
+  if(send(fd, &req, sizeof req, 0) != sizeof req) return 1;
+
+  for(;;) {
+    n = recv(fd, buf, sizeof buf, 0);
+    if(n == -1 && errno == EINTR) continue;
+    if(n <= 0) return 1;
+
+    for(nh = (struct nlmsghdr *) buf; NLMSG_OK(nh, n); nh = NLMSG_NEXT(nh, n)) {
+      if(nh->nlmsg_type == NLMSG_DONE) return 0;
+      if(nh->nlmsg_type == NLMSG_ERROR) return 1;
+
+      if(nh->nlmsg_type == RTM_NEWLINK) {
+        ifi = NLMSG_DATA(nh);
+        len = IFLA_PAYLOAD(nh);
+        for(rta = IFLA_RTA(ifi); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+          if(rta->rta_type != IFLA_IFNAME) continue;
+          if(!(*links_len & 15)) *links = realloc(*links, (*links_len + 16) * sizeof **links);
+          memset(*links + *links_len, 0, sizeof **links);
+          (*links)[*links_len].index = ifi->ifi_index;
+          (*links)[*links_len].flags = ifi->ifi_flags;
+          snprintf((*links)[*links_len].name, IF_NAMESIZE, "%s", (char *) RTA_DATA(rta));
+          (*links_len)++;
+          break;
+        }
+      }
+
+      if(nh->nlmsg_type == RTM_NEWADDR) {
+        ifa = NLMSG_DATA(nh);
+        // ipv6: only global addresses that passed duplicate address detection
+        if(
+          ifa->ifa_family == AF_INET6 &&
+          (ifa->ifa_scope != RT_SCOPE_UNIVERSE || (ifa->ifa_flags & (IFA_F_TENTATIVE | IFA_F_DADFAILED)))
+        ) continue;
+        if(ifa->ifa_scope == RT_SCOPE_HOST) continue;
+        for(u = 0; u < *links_len; u++) {
+          if((*links)[u].index == (int) ifa->ifa_index) (*links)[u].has_addr = 1;
+        }
+      }
+    }
+  }
+}
+
+
+/*
+ * Wait until interfaces 'ifnames' are up (or down, if 'up' is 0).
+ *
+ * 'ifnames' is a space-separated list of interfaces or 'all' (meaning any
+ * interface for 'up' and every interface otherwise). Wait at most
+ * 'timeout' ms.
+ *
+ * Updates config.ifcfg.if_state and config.ifcfg.if_up.
+ *
+ * Return 1 if the state has been reached.
+ */
+int net_wait_state(char *ifnames, int up, unsigned timeout)
+{
+  struct pollfd pfd = { .events = POLLIN };
+  struct timespec ts0, ts1;
+  char buf[8 << 10];
+  int ok, ms = 0;
+
+  if(rtnl_fd == -1) rtnl_fd = rtnl_open(RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR);
+
+  pfd.fd = rtnl_fd;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts0);
+
+  for(;;) {
+    // drop queued events; we are going to read the current state anyway
+    while(rtnl_fd != -1 && recv(rtnl_fd, buf, sizeof buf, MSG_DONTWAIT) != -1);
+
+    net_update_state();
+
+    ok = config.test || net_state_reached(ifnames, up);
+
+    clock_gettime(CLOCK_MONOTONIC, &ts1);
+    ms = (ts1.tv_sec - ts0.tv_sec) * 1000 + (ts1.tv_nsec - ts0.tv_nsec) / 1000000;
+
+    if(ok || ms >= (int) timeout) break;
+
+    // no socket: just wait
+    if(rtnl_fd == -1) {
+      usleep((timeout - ms) * 1000);
+      continue;
+    }
+
+    poll(&pfd, 1, timeout - ms);
+  }
+
+  log_info("%s: %s%s after %d ms\n", ifnames, ok ? "" : "not ", up ? "up" : "down", ms);
+
+  return ok;
+}
+
+
+int net_state_reached(char *ifnames, int up)
+{
+  slist_t *sl, *sl0;
+  int ok = 1;
+
+  if(!strcmp(ifnames, "all")) return up ? config.ifcfg.if_up != NULL : config.ifcfg.if_up == NULL;
+
+  sl0 = slist_split(' ', ifnames);
+  for(sl = sl0; sl && ok; sl = sl->next) {
+    if(!*sl->key) continue;
+    if((slist_getentry(config.ifcfg.if_up, sl->key) ? 1 : 0) != up) ok = 0;
+  }
+  slist_free(sl0);
+
+  return ok;
+}
+
+
 /*
  * Set up interface; ifname may be NULL, an interface or 'all'.
  */
 void net_wicked_up(char *ifname)
 {
+  struct timespec ts0, ts1;
   char *buf = NULL;
+  int ms;
 
   if(!ifname) return;
 
@@ -2560,11 +2989,18 @@ void net_wicked_up(char *ifname)
 
   if(!config.test) lxrc_run(buf);
 
-  sleep(config.net.ifup_wait + 1);
+  clock_gettime(CLOCK_MONOTONIC, &ts0);
 
-  LXRC_WAIT
+  net_wait_state(ifname, 1, (config.net.ifup_wait + 1) * 1000);
 
-  net_update_state();
+  // wicked ifup waits for the interface anyway; NetWait is for cards that need more time
+  if(config.net.ifup_wait) {
+    clock_gettime(CLOCK_MONOTONIC, &ts1);
+    ms = (ts1.tv_sec - ts0.tv_sec) * 1000 + (ts1.tv_nsec - ts0.tv_nsec) / 1000000;
+    if(ms < config.net.ifup_wait * 1000) usleep((config.net.ifup_wait * 1000 - ms) * 1000);
+  }
+
+  LXRC_WAIT
 
   str_copy(&buf, NULL);
 }
@@ -2585,12 +3021,10 @@ void net_wicked_down(char *ifname)
 
   if(!config.test) lxrc_run(buf);
 
-  sleep(1);
+  net_wait_state(ifname, 0, 1000);
 
   LXRC_WAIT
 
-  net_update_state();
-
   str_copy(&buf, ifname);
 
   /*
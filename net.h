@@ -17,9 +17,13 @@ int net_mount_nfs(char *mountpoint, char *server, char *hostdir, unsigned port,
 int net_mount_cifs(char *mountpoint, char *server, char *hostdir, char *user, char *password, char *workgroup, char *options);
 void net_stop(void);
 int net_check_address(inet_t *inet, int do_dns);
+char *net_resolve(char *name);
 int net_static(void);
 int net_activate_s390_devs(void);
 int net_dhcp(void);
+slist_t *net_dhcp_race(slist_t *devices);
+void net_dhcp_race_use(char *ifname);
+void net_dhcp_race_end(slist_t *devices, char *keep);
 unsigned net_config_mask(void);
 int net_get_address(char *text, inet_t *inet, int do_dns);
 int net_get_address2(char *text, inet_t *inet, int do_dns, char **user, char **password, unsigned *port);
@@ -25,6 +25,7 @@
 */
 
 #include "sha1.h"
+#include "sha_hw.h"
 
 #include <stddef.h>
 #include <stdlib.h>
@@ -320,6 +321,10 @@ sha1_process_block (const void *buffer, size_t len, struct sha1_ctx *ctx)
   if (ctx->total[0] < len)
     ++ctx->total[1];
 
+  /* Use CPU SHA instructions if available.  */
+  if (sha1_hw_process_block (buffer, len, ctx))
+    return;
+
 #define rol(x, n) (((x) << (n)) | ((uint32_t) (x) >> (32 - (n))))
 
 #define M(I) ( tm =   x[I&0x0f] ^ x[(I-14)&0x0f] \
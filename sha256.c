@@ -21,6 +21,7 @@
 */
 
 #include "sha256.h"
+#include "sha_hw.h"
 
 #include <stddef.h>
 #include <stdlib.h>
@@ -465,6 +466,10 @@ sha256_process_block (const void *buffer, size_t len, struct sha256_ctx *ctx)
   if (ctx->total[0] < len)
     ++ctx->total[1];
 
+  /* Use CPU SHA instructions if available.  */
+  if (sha256_hw_process_block (buffer, len, ctx))
+    return;
+
 #define rol(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
 #define S0(x) (rol(x,25)^rol(x,14)^(x>>3))
 #define S1(x) (rol(x,15)^rol(x,13)^(x>>10))
@@ -0,0 +1,824 @@
+/*
+ * Hardware accelerated SHA-1 and SHA-256 block functions.
+ *
+ * Uses the SHA extensions on x86 (SHA-NI) and the ARMv8 crypto
+ * extensions, if the CPU supports them. sha1_process_block() and
+ * sha256_process_block() call these first and fall back to the portable
+ * code if they return 0.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "sha1.h"
+#include "sha256.h"
+#include "sha_hw.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+#define SHA_HW_X86	1
+#define SHA_HW_TARGET	__attribute__((target("sha,sse4.1,ssse3")))
+
+#elif defined(__aarch64__)
+
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#include <arm_neon.h>
+
+#define SHA_HW_ARM	1
+#define SHA_HW_TARGET	__attribute__((target("+crypto")))
+
+#endif
+
+#if defined(SHA_HW_X86) || defined(SHA_HW_ARM)
+
+static int sha_hw_detect(void);
+static void sha1_hw_blocks(uint32_t *state, const unsigned char *data, size_t len);
+static void sha256_hw_blocks(uint32_t *state, const unsigned char *data, size_t len);
+
+#if defined(SHA_HW_ARM)
+static const uint32_t sha1_k[4] = { 0x5a827999, 0x6ed9eba1, 0x8f1bbcdc, 0xca62c1d6 };
+#endif
+
+static const uint32_t sha256_k[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+// -1: not checked yet, 0: not supported, 1: supported
+static int sha_hw = -1;
+
+
+/*
+ * Return name of the accelerated implementation or NULL if there is none.
+ */
+char *sha_hw_name()
+{
+  if(sha_hw < 0) sha_hw = sha_hw_detect();
+
+#if defined(SHA_HW_X86)
+  return sha_hw ? "sha-ni" : NULL;
+#else
+  return sha_hw ? "armv8-ce" : NULL;
+#endif
+}
+
+
+/*
+ * Process 'len' bytes (a multiple of 64) from 'buffer'.
+ *
+ * Note: ctx->total is not updated.
+ *
+ * Return 1 if done, 0 if not supported.
+ */
+int sha1_hw_process_block(const void *buffer, size_t len, struct sha1_ctx *ctx)
+{
+  uint32_t state[5];
+
+  if(sha_hw < 0) sha_hw = sha_hw_detect();
+
+  if(!sha_hw) return 0;
+
+  state[0] = ctx->A;
+  state[1] = ctx->B;
+  state[2] = ctx->C;
+  state[3] = ctx->D;
+  state[4] = ctx->E;
+
+  sha1_hw_blocks(state, buffer, len);
+
+  ctx->A = state[0];
+  ctx->B = state[1];
+  ctx->C = state[2];
+  ctx->D = state[3];
+  ctx->E = state[4];
+
+  return 1;
+}
+
+
+/*
+ * Process 'len' bytes (a multiple of 64) from 'buffer'.
+ *
+ * Note: ctx->total is not updated.
+ *
+ * Return 1 if done, 0 if not supported.
+ */
+int sha256_hw_process_block(const void *buffer, size_t len, struct sha256_ctx *ctx)
+{
+  if(sha_hw < 0) sha_hw = sha_hw_detect();
+
+  if(!sha_hw) return 0;
+
+  sha256_hw_blocks(ctx->state, buffer, len);
+
+  return 1;
+}
+
+#endif
+
+
+#if defined(SHA_HW_X86)
+
+int sha_hw_detect()
+{
+  unsigned eax, ebx, ecx, edx;
+
+  // ssse3 + sse4.1
+  if(!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || (ecx & ((1 << 9) | (1 << 19))) != ((1 << 9) | (1 << 19))) return 0;
+
+  // sha
+  if(!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) || !(ebx & (1 << 29))) return 0;
+
+  return 1;
+}
+
+
+SHA_HW_TARGET void sha1_hw_blocks(uint32_t *state, const unsigned char *data, size_t len)
+{
+  __m128i abcd, abcd_save, e0, e0_save, e1, m0, m1, m2, m3;
+  const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+
+  abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) state), 0x1b);
+  e0 = _mm_set_epi32(state[4], 0, 0, 0);
+
+  for(; len >= 64; len -= 64, data += 64) {
+    abcd_save = abcd;
+    e0_save = e0;
+
+    /* rounds 0-3 */
+    m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 0)), mask);
+    e0 = _mm_add_epi32(e0, m0);
+    e1 = abcd;
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+    /* rounds 4-7 */
+    m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 16)), mask);
+    e1 = _mm_sha1nexte_epu32(e1, m1);
+    e0 = abcd;
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+    m0 = _mm_sha1msg1_epu32(m0, m1);
+
+    /* rounds 8-11 */
+    m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 32)), mask);
+    e0 = _mm_sha1nexte_epu32(e0, m2);
+    e1 = abcd;
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+    m1 = _mm_sha1msg1_epu32(m1, m2);
+    m0 = _mm_xor_si128(m0, m2);
+
+    /* rounds 12-15 */
+    m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 48)), mask);
+    e1 = _mm_sha1nexte_epu32(e1, m3);
+    e0 = abcd;
+    m0 = _mm_sha1msg2_epu32(m0, m3);
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+    m2 = _mm_sha1msg1_epu32(m2, m3);
+    m1 = _mm_xor_si128(m1, m3);
+
+    /* rounds 16-19 */
+    e0 = _mm_sha1nexte_epu32(e0, m0);
+    e1 = abcd;
+    m1 = _mm_sha1msg2_epu32(m1, m0);
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+    m3 = _mm_sha1msg1_epu32(m3, m0);
+    m2 = _mm_xor_si128(m2, m0);
+
+    /* rounds 20-23 */
+    e1 = _mm_sha1nexte_epu32(e1, m1);
+    e0 = abcd;
+    m2 = _mm_sha1msg2_epu32(m2, m1);
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 1);
+    m0 = _mm_sha1msg1_epu32(m0, m1);
+    m3 = _mm_xor_si128(m3, m1);
+
+    /* rounds 24-27 */
+    e0 = _mm_sha1nexte_epu32(e0, m2);
+    e1 = abcd;
+    m3 = _mm_sha1msg2_epu32(m3, m2);
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 1);
+    m1 = _mm_sha1msg1_epu32(m1, m2);
+    m0 = _mm_xor_si128(m0, m2);
+
+    /* rounds 28-31 */
+    e1 = _mm_sha1nexte_epu32(e1, m3);
+    e0 = abcd;
+    m0 = _mm_sha1msg2_epu32(m0, m3);
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 1);
+    m2 = _mm_sha1msg1_epu32(m2, m3);
+    m1 = _mm_xor_si128(m1, m3);
+
+    /* rounds 32-35 */
+    e0 = _mm_sha1nexte_epu32(e0, m0);
+    e1 = abcd;
+    m1 = _mm_sha1msg2_epu32(m1, m0);
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 1);
+    m3 = _mm_sha1msg1_epu32(m3, m0);
+    m2 = _mm_xor_si128(m2, m0);
+
+    /* rounds 36-39 */
+    e1 = _mm_sha1nexte_epu32(e1, m1);
+    e0 = abcd;
+    m2 = _mm_sha1msg2_epu32(m2, m1);
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 1);
+    m0 = _mm_sha1msg1_epu32(m0, m1);
+    m3 = _mm_xor_si128(m3, m1);
+
+    /* rounds 40-43 */
+    e0 = _mm_sha1nexte_epu32(e0, m2);
+    e1 = abcd;
+    m3 = _mm_sha1msg2_epu32(m3, m2);
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 2);
+    m1 = _mm_sha1msg1_epu32(m1, m2);
+    m0 = _mm_xor_si128(m0, m2);
+
+    /* rounds 44-47 */
+    e1 = _mm_sha1nexte_epu32(e1, m3);
+    e0 = abcd;
+    m0 = _mm_sha1msg2_epu32(m0, m3);
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 2);
+    m2 = _mm_sha1msg1_epu32(m2, m3);
+    m1 = _mm_xor_si128(m1, m3);
+
+    /* rounds 48-51 */
+    e0 = _mm_sha1nexte_epu32(e0, m0);
+    e1 = abcd;
+    m1 = _mm_sha1msg2_epu32(m1, m0);
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 2);
+    m3 = _mm_sha1msg1_epu32(m3, m0);
+    m2 = _mm_xor_si128(m2, m0);
+
+    /* rounds 52-55 */
+    e1 = _mm_sha1nexte_epu32(e1, m1);
+    e0 = abcd;
+    m2 = _mm_sha1msg2_epu32(m2, m1);
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 2);
+    m0 = _mm_sha1msg1_epu32(m0, m1);
+    m3 = _mm_xor_si128(m3, m1);
+
+    /* rounds 56-59 */
+    e0 = _mm_sha1nexte_epu32(e0, m2);
+    e1 = abcd;
+    m3 = _mm_sha1msg2_epu32(m3, m2);
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 2);
+    m1 = _mm_sha1msg1_epu32(m1, m2);
+    m0 = _mm_xor_si128(m0, m2);
+
+    /* rounds 60-63 */
+    e1 = _mm_sha1nexte_epu32(e1, m3);
+    e0 = abcd;
+    m0 = _mm_sha1msg2_epu32(m0, m3);
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+    m2 = _mm_sha1msg1_epu32(m2, m3);
+    m1 = _mm_xor_si128(m1, m3);
+
+    /* rounds 64-67 */
+    e0 = _mm_sha1nexte_epu32(e0, m0);
+    e1 = abcd;
+    m1 = _mm_sha1msg2_epu32(m1, m0);
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 3);
+    m3 = _mm_sha1msg1_epu32(m3, m0);
+    m2 = _mm_xor_si128(m2, m0);
+
+    /* rounds 68-71 */
+    e1 = _mm_sha1nexte_epu32(e1, m1);
+    e0 = abcd;
+    m2 = _mm_sha1msg2_epu32(m2, m1);
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+    m3 = _mm_xor_si128(m3, m1);
+
+    /* rounds 72-75 */
+    e0 = _mm_sha1nexte_epu32(e0, m2);
+    e1 = abcd;
+    m3 = _mm_sha1msg2_epu32(m3, m2);
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 3);
+
+    /* rounds 76-79 */
+    e1 = _mm_sha1nexte_epu32(e1, m3);
+    e0 = abcd;
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+
+    e0 = _mm_sha1nexte_epu32(e0, e0_save);
+    abcd = _mm_add_epi32(abcd, abcd_save);
+  }
+
+  _mm_storeu_si128((__m128i *) state, _mm_shuffle_epi32(abcd, 0x1b));
+  state[4] = _mm_extract_epi32(e0, 3);
+}
+
+
+SHA_HW_TARGET void sha256_hw_blocks(uint32_t *state, const unsigned char *data, size_t len)
+{
+  __m128i state0, state1, abef_save, cdgh_save, msg, tmp, m0, m1, m2, m3;
+  const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+  tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) state), 0xb1);		// cdab
+  state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) (state + 4)), 0x1b);	// efgh
+  state0 = _mm_alignr_epi8(tmp, state1, 8);		// abef
+  state1 = _mm_blend_epi16(state1, tmp, 0xf0);		// cdgh
+
+  for(; len >= 64; len -= 64, data += 64) {
+    abef_save = state0;
+    cdgh_save = state1;
+
+    /* rounds 0-3 */
+    m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 0)), mask);
+    msg = _mm_add_epi32(m0, _mm_loadu_si128((const __m128i *) (sha256_k + 0)));
+    state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+    msg = _mm_shuffle_epi32(msg, 0x0e);
+    state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+
+    /* rounds 4-7 */
+    m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 16)), mask);
+    msg = _mm_add_epi32(m1, _mm_loadu_si128((const __m128i *) (sha256_k + 4)));
+    state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+    msg = _mm_shuffle_epi32(msg, 0x0e);
+    state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+    m0 = _mm_sha256msg1_epu32(m0, m1);
+
+    /* rounds 8-11 */
+    m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 32)), mask);
+    msg = _mm_add_epi32(m2, _mm_loadu_si128((const __m128i *) (sha256_k + 8)));
+    state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+    msg = _mm_shuffle_epi32(msg, 0x0e);
+    state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+    m1 = _mm_sha256msg1_epu32(m1, m2);
+
+    /* rounds 12-15 */
+    m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 48)), mask);
+    msg = _mm_add_epi32(m3, _mm_loadu_si128((const __m128i *) (sha256_k + 12)));
+    state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+    tmp = _mm_alignr_epi8(m3, m2, 4);
+    m0 = _mm_add_epi32(m0, tmp);
+    m0 = _mm_sha256msg2_epu32(m0, m3);
+    msg = _mm_shuffle_epi32(msg, 0x0e);
+    state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+    m2 = _mm_sha256msg1_epu32(m2, m3);
+
+    /* rounds 16-19 */
+    msg = _mm_add_epi32(m0, _mm_loadu_si128((const __m128i *) (sha256_k + 16)));
+    state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+    tmp = _mm_alignr_epi8(m0, m3, 4);
+    m1 = _mm_add_epi32(m1, tmp);
+    m1 = _mm_sha256msg2_epu32(m1, m0);
+    msg = _mm_shuffle_epi32(msg, 0x0e);
+    state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+    m3 = _mm_sha256msg1_epu32(m3, m0);
+
+    /* rounds 20-23 */
+    msg = _mm_add_epi32(m1, _mm_loadu_si128((const __m128i *) (sha256_k + 20)));
+    state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+    tmp = _mm_alignr_epi8(m1, m0, 4);
+    m2 = _mm_add_epi32(m2, tmp);
+    m2 = _mm_sha256msg2_epu32(m2, m1);
+    msg = _mm_shuffle_epi32(msg, 0x0e);
+    state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+    m0 = _mm_sha256msg1_epu32(m0, m1);
+
+    /* rounds 24-27 */
+    msg = _mm_add_epi32(m2, _mm_loadu_si128((const __m128i *) (sha256_k + 24)));
+    state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+    tmp = _mm_alignr_epi8(m2, m1, 4);
+    m3 = _mm_add_epi32(m3, tmp);
+    m3 = _mm_sha256msg2_epu32(m3, m2);
+    msg = _mm_shuffle_epi32(msg, 0x0e);
+    state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+    m1 = _mm_sha256msg1_epu32(m1, m2);
+
+    /* rounds 28-31 */
+    msg = _mm_add_epi32(m3, _mm_loadu_si128((const __m128i *) (sha256_k + 28)));
+    state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+    tmp = _mm_alignr_epi8(m3, m2, 4);
+    m0 = _mm_add_epi32(m0, tmp);
+    m0 = _mm_sha256msg2_epu32(m0, m3);
+    msg = _mm_shuffle_epi32(msg, 0x0e);
+    state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+    m2 = _mm_sha256msg1_epu32(m2, m3);
+
+    /* rounds 32-35 */
+    msg = _mm_add_epi32(m0, _mm_loadu_si128((const __m128i *) (sha256_k + 32)));
+    state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+    tmp = _mm_alignr_epi8(m0, m3, 4);
+    m1 = _mm_add_epi32(m1, tmp);
+    m1 = _mm_sha256msg2_epu32(m1, m0);
+    msg = _mm_shuffle_epi32(msg, 0x0e);
+    state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+    m3 = _mm_sha256msg1_epu32(m3, m0);
+
+    /* rounds 36-39 */
+    msg = _mm_add_epi32(m1, _mm_loadu_si128((const __m128i *) (sha256_k + 36)));
+    state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+    tmp = _mm_alignr_epi8(m1, m0, 4);
+    m2 = _mm_add_epi32(m2, tmp);
+    m2 = _mm_sha256msg2_epu32(m2, m1);
+    msg = _mm_shuffle_epi32(msg, 0x0e);
+    state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+    m0 = _mm_sha256msg1_epu32(m0, m1);
+
+    /* rounds 40-43 */
+    msg = _mm_add_epi32(m2, _mm_loadu_si128((const __m128i *) (sha256_k + 40)));
+    state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+    tmp = _mm_alignr_epi8(m2, m1, 4);
+    m3 = _mm_add_epi32(m3, tmp);
+    m3 = _mm_sha256msg2_epu32(m3, m2);
+    msg = _mm_shuffle_epi32(msg, 0x0e);
+    state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+    m1 = _mm_sha256msg1_epu32(m1, m2);
+
+    /* rounds 44-47 */
+    msg = _mm_add_epi32(m3, _mm_loadu_si128((const __m128i *) (sha256_k + 44)));
+    state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+    tmp = _mm_alignr_epi8(m3, m2, 4);
+    m0 = _mm_add_epi32(m0, tmp);
+    m0 = _mm_sha256msg2_epu32(m0, m3);
+    msg = _mm_shuffle_epi32(msg, 0x0e);
+    state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+    m2 = _mm_sha256msg1_epu32(m2, m3);
+
+    /* rounds 48-51 */
+    msg = _mm_add_epi32(m0, _mm_loadu_si128((const __m128i *) (sha256_k + 48)));
+    state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+    tmp = _mm_alignr_epi8(m0, m3, 4);
+    m1 = _mm_add_epi32(m1, tmp);
+    m1 = _mm_sha256msg2_epu32(m1, m0);
+    msg = _mm_shuffle_epi32(msg, 0x0e);
+    state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+    m3 = _mm_sha256msg1_epu32(m3, m0);
+
+    /* rounds 52-55 */
+    msg = _mm_add_epi32(m1, _mm_loadu_si128((const __m128i *) (sha256_k + 52)));
+    state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+    tmp = _mm_alignr_epi8(m1, m0, 4);
+    m2 = _mm_add_epi32(m2, tmp);
+    m2 = _mm_sha256msg2_epu32(m2, m1);
+    msg = _mm_shuffle_epi32(msg, 0x0e);
+    state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+
+    /* rounds 56-59 */
+    msg = _mm_add_epi32(m2, _mm_loadu_si128((const __m128i *) (sha256_k + 56)));
+    state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+    tmp = _mm_alignr_epi8(m2, m1, 4);
+    m3 = _mm_add_epi32(m3, tmp);
+    m3 = _mm_sha256msg2_epu32(m3, m2);
+    msg = _mm_shuffle_epi32(msg, 0x0e);
+    state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+
+    /* rounds 60-63 */
+    msg = _mm_add_epi32(m3, _mm_loadu_si128((const __m128i *) (sha256_k + 60)));
+    state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+    msg = _mm_shuffle_epi32(msg, 0x0e);
+    state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+
+    state0 = _mm_add_epi32(state0, abef_save);
+    state1 = _mm_add_epi32(state1, cdgh_save);
+  }
+
+  tmp = _mm_shuffle_epi32(state0, 0x1b);		// feba
+  state1 = _mm_shuffle_epi32(state1, 0xb1);		// dchg
+  _mm_storeu_si128((__m128i *) state, _mm_blend_epi16(tmp, state1, 0xf0));
+  _mm_storeu_si128((__m128i *) (state + 4), _mm_alignr_epi8(state1, tmp, 8));
+}
+
+#elif defined(SHA_HW_ARM)
+
+int sha_hw_detect()
+{
+  unsigned long hwcap = getauxval(AT_HWCAP);
+
+  return (hwcap & HWCAP_SHA1) && (hwcap & HWCAP_SHA2) ? 1 : 0;
+}
+
+
+SHA_HW_TARGET void sha1_hw_blocks(uint32_t *state, const unsigned char *data, size_t len)
+{
+  uint32x4_t abcd, abcd_save, m0, m1, m2, m3, t0, t1;
+  uint32_t e0, e0_save, e1;
+
+  abcd = vld1q_u32(state);
+  e0 = state[4];
+
+  for(; len >= 64; len -= 64, data += 64) {
+    abcd_save = abcd;
+    e0_save = e0;
+
+    m0 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data)));
+    m1 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 16)));
+    m2 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 32)));
+    m3 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 48)));
+
+    t0 = vaddq_u32(m0, vdupq_n_u32(sha1_k[0]));
+    t1 = vaddq_u32(m1, vdupq_n_u32(sha1_k[0]));
+
+    /* rounds 0-3 */
+    e1 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+    abcd = vsha1cq_u32(abcd, e0, t0);
+    t0 = vaddq_u32(m2, vdupq_n_u32(sha1_k[0]));
+    m0 = vsha1su0q_u32(m0, m1, m2);
+
+    /* rounds 4-7 */
+    e0 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+    abcd = vsha1cq_u32(abcd, e1, t1);
+    t1 = vaddq_u32(m3, vdupq_n_u32(sha1_k[0]));
+    m0 = vsha1su1q_u32(m0, m3);
+    m1 = vsha1su0q_u32(m1, m2, m3);
+
+    /* rounds 8-11 */
+    e1 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+    abcd = vsha1cq_u32(abcd, e0, t0);
+    t0 = vaddq_u32(m0, vdupq_n_u32(sha1_k[0]));
+    m1 = vsha1su1q_u32(m1, m0);
+    m2 = vsha1su0q_u32(m2, m3, m0);
+
+    /* rounds 12-15 */
+    e0 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+    abcd = vsha1cq_u32(abcd, e1, t1);
+    t1 = vaddq_u32(m1, vdupq_n_u32(sha1_k[1]));
+    m2 = vsha1su1q_u32(m2, m1);
+    m3 = vsha1su0q_u32(m3, m0, m1);
+
+    /* rounds 16-19 */
+    e1 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+    abcd = vsha1cq_u32(abcd, e0, t0);
+    t0 = vaddq_u32(m2, vdupq_n_u32(sha1_k[1]));
+    m3 = vsha1su1q_u32(m3, m2);
+    m0 = vsha1su0q_u32(m0, m1, m2);
+
+    /* rounds 20-23 */
+    e0 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+    abcd = vsha1pq_u32(abcd, e1, t1);
+    t1 = vaddq_u32(m3, vdupq_n_u32(sha1_k[1]));
+    m0 = vsha1su1q_u32(m0, m3);
+    m1 = vsha1su0q_u32(m1, m2, m3);
+
+    /* rounds 24-27 */
+    e1 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+    abcd = vsha1pq_u32(abcd, e0, t0);
+    t0 = vaddq_u32(m0, vdupq_n_u32(sha1_k[1]));
+    m1 = vsha1su1q_u32(m1, m0);
+    m2 = vsha1su0q_u32(m2, m3, m0);
+
+    /* rounds 28-31 */
+    e0 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+    abcd = vsha1pq_u32(abcd, e1, t1);
+    t1 = vaddq_u32(m1, vdupq_n_u32(sha1_k[1]));
+    m2 = vsha1su1q_u32(m2, m1);
+    m3 = vsha1su0q_u32(m3, m0, m1);
+
+    /* rounds 32-35 */
+    e1 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+    abcd = vsha1pq_u32(abcd, e0, t0);
+    t0 = vaddq_u32(m2, vdupq_n_u32(sha1_k[2]));
+    m3 = vsha1su1q_u32(m3, m2);
+    m0 = vsha1su0q_u32(m0, m1, m2);
+
+    /* rounds 36-39 */
+    e0 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+    abcd = vsha1pq_u32(abcd, e1, t1);
+    t1 = vaddq_u32(m3, vdupq_n_u32(sha1_k[2]));
+    m0 = vsha1su1q_u32(m0, m3);
+    m1 = vsha1su0q_u32(m1, m2, m3);
+
+    /* rounds 40-43 */
+    e1 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+    abcd = vsha1mq_u32(abcd, e0, t0);
+    t0 = vaddq_u32(m0, vdupq_n_u32(sha1_k[2]));
+    m1 = vsha1su1q_u32(m1, m0);
+    m2 = vsha1su0q_u32(m2, m3, m0);
+
+    /* rounds 44-47 */
+    e0 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+    abcd = vsha1mq_u32(abcd, e1, t1);
+    t1 = vaddq_u32(m1, vdupq_n_u32(sha1_k[2]));
+    m2 = vsha1su1q_u32(m2, m1);
+    m3 = vsha1su0q_u32(m3, m0, m1);
+
+    /* rounds 48-51 */
+    e1 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+    abcd = vsha1mq_u32(abcd, e0, t0);
+    t0 = vaddq_u32(m2, vdupq_n_u32(sha1_k[2]));
+    m3 = vsha1su1q_u32(m3, m2);
+    m0 = vsha1su0q_u32(m0, m1, m2);
+
+    /* rounds 52-55 */
+    e0 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+    abcd = vsha1mq_u32(abcd, e1, t1);
+    t1 = vaddq_u32(m3, vdupq_n_u32(sha1_k[3]));
+    m0 = vsha1su1q_u32(m0, m3);
+    m1 = vsha1su0q_u32(m1, m2, m3);
+
+    /* rounds 56-59 */
+    e1 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+    abcd = vsha1mq_u32(abcd, e0, t0);
+    t0 = vaddq_u32(m0, vdupq_n_u32(sha1_k[3]));
+    m1 = vsha1su1q_u32(m1, m0);
+    m2 = vsha1su0q_u32(m2, m3, m0);
+
+    /* rounds 60-63 */
+    e0 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+    abcd = vsha1pq_u32(abcd, e1, t1);
+    t1 = vaddq_u32(m1, vdupq_n_u32(sha1_k[3]));
+    m2 = vsha1su1q_u32(m2, m1);
+    m3 = vsha1su0q_u32(m3, m0, m1);
+
+    /* rounds 64-67 */
+    e1 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+    abcd = vsha1pq_u32(abcd, e0, t0);
+    t0 = vaddq_u32(m2, vdupq_n_u32(sha1_k[3]));
+    m3 = vsha1su1q_u32(m3, m2);
+
+    /* rounds 68-71 */
+    e0 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+    abcd = vsha1pq_u32(abcd, e1, t1);
+    t1 = vaddq_u32(m3, vdupq_n_u32(sha1_k[3]));
+
+    /* rounds 72-75 */
+    e1 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+    abcd = vsha1pq_u32(abcd, e0, t0);
+
+    /* rounds 76-79 */
+    e0 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+    abcd = vsha1pq_u32(abcd, e1, t1);
+
+    e0 += e0_save;
+    abcd = vaddq_u32(abcd_save, abcd);
+  }
+
+  vst1q_u32(state, abcd);
+  state[4] = e0;
+}
+
+
+SHA_HW_TARGET void sha256_hw_blocks(uint32_t *state, const unsigned char *data, size_t len)
+{
+  uint32x4_t state0, state1, abef_save, cdgh_save, m0, m1, m2, m3, t0, t1, t2;
+
+  state0 = vld1q_u32(state);
+  state1 = vld1q_u32(state + 4);
+
+  for(; len >= 64; len -= 64, data += 64) {
+    abef_save = state0;
+    cdgh_save = state1;
+
+    m0 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data)));
+    m1 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 16)));
+    m2 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 32)));
+    m3 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 48)));
+
+    t0 = vaddq_u32(m0, vld1q_u32(sha256_k));
+
+    /* rounds 0-3 */
+    m0 = vsha256su0q_u32(m0, m1);
+    t2 = state0;
+    t1 = vaddq_u32(m1, vld1q_u32(sha256_k + 4));
+    state0 = vsha256hq_u32(state0, state1, t0);
+    state1 = vsha256h2q_u32(state1, t2, t0);
+    m0 = vsha256su1q_u32(m0, m2, m3);
+
+    /* rounds 4-7 */
+    m1 = vsha256su0q_u32(m1, m2);
+    t2 = state0;
+    t0 = vaddq_u32(m2, vld1q_u32(sha256_k + 8));
+    state0 = vsha256hq_u32(state0, state1, t1);
+    state1 = vsha256h2q_u32(state1, t2, t1);
+    m1 = vsha256su1q_u32(m1, m3, m0);
+
+    /* rounds 8-11 */
+    m2 = vsha256su0q_u32(m2, m3);
+    t2 = state0;
+    t1 = vaddq_u32(m3, vld1q_u32(sha256_k + 12));
+    state0 = vsha256hq_u32(state0, state1, t0);
+    state1 = vsha256h2q_u32(state1, t2, t0);
+    m2 = vsha256su1q_u32(m2, m0, m1);
+
+    /* rounds 12-15 */
+    m3 = vsha256su0q_u32(m3, m0);
+    t2 = state0;
+    t0 = vaddq_u32(m0, vld1q_u32(sha256_k + 16));
+    state0 = vsha256hq_u32(state0, state1, t1);
+    state1 = vsha256h2q_u32(state1, t2, t1);
+    m3 = vsha256su1q_u32(m3, m1, m2);
+
+    /* rounds 16-19 */
+    m0 = vsha256su0q_u32(m0, m1);
+    t2 = state0;
+    t1 = vaddq_u32(m1, vld1q_u32(sha256_k + 20));
+    state0 = vsha256hq_u32(state0, state1, t0);
+    state1 = vsha256h2q_u32(state1, t2, t0);
+    m0 = vsha256su1q_u32(m0, m2, m3);
+
+    /* rounds 20-23 */
+    m1 = vsha256su0q_u32(m1, m2);
+    t2 = state0;
+    t0 = vaddq_u32(m2, vld1q_u32(sha256_k + 24));
+    state0 = vsha256hq_u32(state0, state1, t1);
+    state1 = vsha256h2q_u32(state1, t2, t1);
+    m1 = vsha256su1q_u32(m1, m3, m0);
+
+    /* rounds 24-27 */
+    m2 = vsha256su0q_u32(m2, m3);
+    t2 = state0;
+    t1 = vaddq_u32(m3, vld1q_u32(sha256_k + 28));
+    state0 = vsha256hq_u32(state0, state1, t0);
+    state1 = vsha256h2q_u32(state1, t2, t0);
+    m2 = vsha256su1q_u32(m2, m0, m1);
+
+    /* rounds 28-31 */
+    m3 = vsha256su0q_u32(m3, m0);
+    t2 = state0;
+    t0 = vaddq_u32(m0, vld1q_u32(sha256_k + 32));
+    state0 = vsha256hq_u32(state0, state1, t1);
+    state1 = vsha256h2q_u32(state1, t2, t1);
+    m3 = vsha256su1q_u32(m3, m1, m2);
+
+    /* rounds 32-35 */
+    m0 = vsha256su0q_u32(m0, m1);
+    t2 = state0;
+    t1 = vaddq_u32(m1, vld1q_u32(sha256_k + 36));
+    state0 = vsha256hq_u32(state0, state1, t0);
+    state1 = vsha256h2q_u32(state1, t2, t0);
+    m0 = vsha256su1q_u32(m0, m2, m3);
+
+    /* rounds 36-39 */
+    m1 = vsha256su0q_u32(m1, m2);
+    t2 = state0;
+    t0 = vaddq_u32(m2, vld1q_u32(sha256_k + 40));
+    state0 = vsha256hq_u32(state0, state1, t1);
+    state1 = vsha256h2q_u32(state1, t2, t1);
+    m1 = vsha256su1q_u32(m1, m3, m0);
+
+    /* rounds 40-43 */
+    m2 = vsha256su0q_u32(m2, m3);
+    t2 = state0;
+    t1 = vaddq_u32(m3, vld1q_u32(sha256_k + 44));
+    state0 = vsha256hq_u32(state0, state1, t0);
+    state1 = vsha256h2q_u32(state1, t2, t0);
+    m2 = vsha256su1q_u32(m2, m0, m1);
+
+    /* rounds 44-47 */
+    m3 = vsha256su0q_u32(m3, m0);
+    t2 = state0;
+    t0 = vaddq_u32(m0, vld1q_u32(sha256_k + 48));
+    state0 = vsha256hq_u32(state0, state1, t1);
+    state1 = vsha256h2q_u32(state1, t2, t1);
+    m3 = vsha256su1q_u32(m3, m1, m2);
+
+    /* rounds 48-51 */
+    t2 = state0;
+    t1 = vaddq_u32(m1, vld1q_u32(sha256_k + 52));
+    state0 = vsha256hq_u32(state0, state1, t0);
+    state1 = vsha256h2q_u32(state1, t2, t0);
+
+    /* rounds 52-55 */
+    t2 = state0;
+    t0 = vaddq_u32(m2, vld1q_u32(sha256_k + 56));
+    state0 = vsha256hq_u32(state0, state1, t1);
+    state1 = vsha256h2q_u32(state1, t2, t1);
+
+    /* rounds 56-59 */
+    t2 = state0;
+    t1 = vaddq_u32(m3, vld1q_u32(sha256_k + 60));
+    state0 = vsha256hq_u32(state0, state1, t0);
+    state1 = vsha256h2q_u32(state1, t2, t0);
+
+    /* rounds 60-63 */
+    t2 = state0;
+    state0 = vsha256hq_u32(state0, state1, t1);
+    state1 = vsha256h2q_u32(state1, t2, t1);
+
+    state0 = vaddq_u32(state0, abef_save);
+    state1 = vaddq_u32(state1, cdgh_save);
+  }
+
+  vst1q_u32(state, state0);
+  vst1q_u32(state + 4, state1);
+}
+
+#else
+
+char *sha_hw_name()
+{
+  return NULL;
+}
+
+
+int sha1_hw_process_block(const void *buffer, size_t len, struct sha1_ctx *ctx)
+{
+  return 0;
+}
+
+
+int sha256_hw_process_block(const void *buffer, size_t len, struct sha256_ctx *ctx)
+{
+  return 0;
+}
+
+#endif
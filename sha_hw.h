@@ -0,0 +1,6 @@
+struct sha1_ctx;
+struct sha256_ctx;
+
+char *sha_hw_name(void);
+int sha1_hw_process_block(const void *buffer, size_t len, struct sha1_ctx *ctx);
+int sha256_hw_process_block(const void *buffer, size_t len, struct sha256_ctx *ctx);
@@ -4,7 +4,11 @@
 #include <string.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
 #include <fnmatch.h>
+#include <net/if.h>
 #include <sys/socket.h>
 #include <sys/utsname.h>
 #include <netinet/in.h>
@@ -16,109 +20,300 @@
 #include "util.h"
 #include "slp.h"
 
+#define SLP_PORT	427
+#define SLP_TRIES	3	/* number of SrvRqst multicasts */
+#define SLP_RETRY	500	/* ms between SrvRqst multicasts */
+#define SLP_QUIET	500	/* ms without new answers before we stop */
+#define SLP_TCP_TIMEOUT	2000	/* ms for a single TCP request */
+#define SLP_MAX_REPLY	80000
+
+/* an installation source found via SLP */
+typedef struct
+{
+  char *url;		/* without service key */
+  char *descr;		/* NULL while the AttrRqst is pending */
+} slp_src_t;
+
+/* a TCP request: AttrRqst, or SrvRqst after an overflow */
+typedef struct
+{
+  int fd;		/* -1: done */
+  int src;		/* index into slp_t.src for AttrRqst, -1 for SrvRqst */
+  int xid;
+  int connected;
+  long long deadline;
+  unsigned char *req;
+  int req_len, req_pos;
+  unsigned char *reply;
+  int reply_len, reply_pos;
+} slp_tcp_t;
+
+/* discovery state */
+typedef struct
+{
+  int xid;
+  unsigned char sendbuf[8000];	/* SrvRqst, including the previous responder list */
+  int len;
+  char service_key[256];
+  int service_key_len;
+  slp_src_t *src;
+  int src_cnt;
+  slp_tcp_t *tcp;
+  int tcp_cnt;
+} slp_t;
+
 static int nextxid = 1;
 
+static int slp_xid(void);
+static long long slp_now(void);
+static char *slp_peer_addr(struct sockaddr *peer);
+static int slp_seen(slp_t *slp, char *iaddr);
+static void slp_add_responder(slp_t *slp, char *iaddr);
+static void slp_srvrply(slp_t *slp, unsigned char *buf, int len, struct sockaddr *peer, socklen_t peer_len);
+static char *slp_attrrply(unsigned char *buf, int len, int xid);
+static int slp_tcp_start(slp_t *slp, struct sockaddr *peer, socklen_t peer_len, unsigned char *req, int req_len, int xid, int src);
+static int slp_attr_start(slp_t *slp, struct sockaddr *peer, socklen_t peer_len, unsigned char *url, int urllen, int src);
+static void slp_tcp_io(slp_t *slp, int i, short revents);
+static void slp_tcp_done(slp_t *slp, int i, int ok);
+static int slp_udp_open(int family);
+static void slp_udp_read(slp_t *slp, int s);
+static int slp_match(slp_t *slp, url_t *url);
+static int slp_src_cmp(const void *p0, const void *p1);
+
 static inline int slpgetw(unsigned char *p)
 {
   return p[0] << 8 | p[1];
 }
 
-static int slpsend(int s,  unsigned char *buf, int buflen, struct sockaddr_in *peer, int tcp)
+static inline int slpget3(unsigned char *p)
 {
-  int l;
-  if (tcp)
+  return p[0] << 16 | p[1] << 8 | p[2];
+}
+
+int slp_xid(void)
+{
+  int xid = nextxid;
+
+  if (++nextxid == 65536)
+    nextxid = 1;
+
+  return xid;
+}
+
+long long slp_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* address string for the previous responder list; static buffer */
+char *slp_peer_addr(struct sockaddr *peer)
+{
+  static char buf[INET6_ADDRSTRLEN];
+
+  if (peer->sa_family == AF_INET6)
+    inet_ntop(AF_INET6, &((struct sockaddr_in6 *) peer)->sin6_addr, buf, sizeof buf);
+  else
+    inet_ntop(AF_INET, &((struct sockaddr_in *) peer)->sin_addr, buf, sizeof buf);
+
+  return buf;
+}
+
+/* check if iaddr is already in the previous responder list */
+int slp_seen(slp_t *slp, char *iaddr)
+{
+  unsigned char *bp = slp->sendbuf + 18;
+  int l2 = slpgetw(slp->sendbuf + 16);
+  int l3 = strlen(iaddr);
+
+  while (l2)
     {
-      if (connect(s, peer, sizeof(*peer)))
-	return -1;
-      while (buflen)
+      if (l2 >= l3 && strncmp(bp, iaddr, l3) == 0 && (l2 == l3 || bp[l3] == ','))
+	return 1;
+      while (l2)
 	{
-	  l = write(s, buf, buflen);
-	  if (l <= 0 || l > buflen)
-	    return -1;
-	  buf += l;
-	  buflen -= l;
+	  l2--;
+	  if (*bp++ == ',')
+	    break;
 	}
     }
-  else
-    {
-      l = sendto(s, buf, buflen, 0, (struct sockaddr *)peer, sizeof(*peer));
-      if (l == -1)
-	perror("sendto");
-      if (l != buflen)
-	return -1;
-    }
+
   return 0;
 }
 
-/* returns: -2 on timeout, -1 on error, 0 for a bad msg,
-   #bytes if a good msg was received */
-static int slprecv(int s, unsigned char *buf, int buflen, struct sockaddr_in *peer)
+/* add iaddr to the previous responder list so the next multicast won't ask it again */
+void slp_add_responder(slp_t *slp, char *iaddr)
 {
-  fd_set fdset;
-  int l2, l3;
-  struct timeval tv;
-  int pesal;
-
-  FD_ZERO(&fdset);
-  FD_SET(s, &fdset);
-  tv.tv_sec = 0;
-  tv.tv_usec = 500000;
-  l2 = select(s + 1, &fdset, 0, 0, &tv);
-  if (l2 < 0)
+  unsigned char *sendbuf = slp->sendbuf, *bp;
+  int l = slp->len, l2, l3, comma;
+
+  l3 = strlen(iaddr);
+  comma = sendbuf[16] != 0 || sendbuf[17] != 0;
+  if (l + l3 + comma <= sizeof(slp->sendbuf))
     {
-      perror("select");
-      close(s);
-      return -1;
+      bp = sendbuf + 18;
+      memmove(bp + l3 + comma, bp, l - 18);
+      memmove(bp, iaddr, l3);
+      if (comma)
+	bp[l3] = ',';
+      l2 = slpgetw(sendbuf + 16) + l3 + comma;
+      sendbuf[16] = l2 >> 8;
+      sendbuf[17] = l2 & 255;
+      l += l3 + comma;
+      sendbuf[3] = l >> 8;
+      sendbuf[4] = l & 255;
+      slp->len = l;
     }
-  if (l2 == 0)
-    return -2;
-  pesal = sizeof(*peer);
-  if (peer)
-    l2 = recvfrom(s, buf, 16, MSG_PEEK, (struct sockaddr *)peer, &pesal);
-  else
-    l2 = recv(s, buf, 16, MSG_PEEK);
-  if (l2 <= 0)
-    return 0;
-  if (l2 >= 16)
-    l2 = buf[2] << 16 | buf[3] << 8 | buf[4];
-  if (l2 > buflen)
-    l2 = buflen;
-  if (peer)
-    l2 = recvfrom(s, buf, l2, 0, (struct sockaddr *)peer, &pesal);
-  else
+}
+
+/* handle SrvRply; start an AttrRqst for each new url */
+void slp_srvrply(slp_t *slp, unsigned char *buf, int len, struct sockaddr *peer, socklen_t peer_len)
+{
+  unsigned char *bp, *end, *origurl;
+  int l3, ec, ulen, origurllen, i;
+  char urlbuf[256];
+  slp_src_t *src;
+
+  end = buf + len;
+  bp = buf + 12;
+  l3 = slpgetw(bp);
+  bp += l3 + 2;
+  if (bp + 4 > end)
+    return;
+  if (slpgetw(bp))		/* error code */
+    return;
+  ec = slpgetw(bp + 2);
+  bp += 4;
+  for (; ec > 0; ec--)
     {
-      char *bp = buf;
-      int l4 = l2;
-      while(l4)
+      if (bp + 5 > end)
+	break;
+      ulen =  slpgetw(bp + 3);
+      bp += 5;
+      if (bp + ulen + 1 > end)
+	break;
+      origurl = bp;
+      origurllen = ulen;
+      if (ulen > slp->service_key_len && !strncasecmp(bp, slp->service_key, slp->service_key_len))
+	{
+	  bp += slp->service_key_len;
+	  ulen -= slp->service_key_len;
+	}
+      /* 8: room for install= */
+      if (ulen > sizeof(urlbuf) - 1 - 8)
+	{
+	  bp += ulen;
+	  if (*bp++)
+	    break;
+	  continue;
+	}
+      memcpy(urlbuf, bp, ulen);
+      urlbuf[ulen] = 0;
+      bp += ulen;
+      for (i = 0; i < slp->src_cnt; i++)
+	if (!strcasecmp(slp->src[i].url, urlbuf))
+	  break;
+      if (i == slp->src_cnt)
 	{
-	  l3 = read(s, bp, l4);
-	  if (l3 <= 0 || l3 > l4)
-	    return 0;
-	  bp += l3;
-	  l4 -= l3;
+	  if ((slp->src_cnt & 15) == 0)
+	    slp->src = realloc(slp->src, sizeof(*slp->src) * (slp->src_cnt + 16));
+	  src = slp->src + slp->src_cnt++;
+	  src->url = strdup(urlbuf);
+	  src->descr = NULL;
+	  if (slp_attr_start(slp, peer, peer_len, origurl, origurllen, i))
+	    src->descr = strdup(urlbuf);
 	}
+      if (*bp++)
+	break;
     }
-  if (l2 <= 16)
+}
+
+/* extract the description from an AttrRply; returns malloc'ed string or NULL */
+char *slp_attrrply(unsigned char *buf, int len, int xid)
+{
+  unsigned char *bp, *end;
+  int l3, al;
+  char *d;
+
+  end = buf + len;
+  if (buf[0] != 2)
+    return 0;
+  if (buf[1] != 7)	/* AttrRply */
     return 0;
-  l3 = buf[2] << 16 | buf[3] << 8 | buf[4];
-  if (l2 != l3)
+  if (slpgetw(buf + 10) != xid)
     return 0;
-  return l2;
+  bp = buf + 12;
+  l3 = slpgetw(bp);
+  bp += l3 + 2;
+  if (bp + 4 > end)
+    return 0;
+  if (slpgetw(bp))		/* error code */
+    return 0;
+  al = slpgetw(bp + 2);
+  bp += 4;
+  if (bp + al > end)
+    return 0;
+  if (al < 14 || strncasecmp(bp, "(description=", 13))
+    return 0;
+  d = malloc(al - 14 + 1);
+  if (d == 0)
+    return 0;
+  memcpy(d, bp + 13, al - 14);
+  d[al - 14] = 0;
+  return d;
 }
 
-char *
-slp_get_descr(struct sockaddr_in *peer, unsigned char *url, int urllen)
+/* queue a TCP request to peer; the reply is handled in slp_tcp_done() */
+int slp_tcp_start(slp_t *slp, struct sockaddr *peer, socklen_t peer_len, unsigned char *req, int req_len, int xid, int src)
 {
-  int s, l, l2, l3;
-  int xid, al;
-  char *d;
+  struct sockaddr_storage sa;
+  slp_tcp_t *tcp;
+  int s;
+
+  memcpy(&sa, peer, peer_len);
+  if (sa.ss_family == AF_INET6)
+    ((struct sockaddr_in6 *) &sa)->sin6_port = htons(SLP_PORT);
+  else
+    ((struct sockaddr_in *) &sa)->sin_port = htons(SLP_PORT);
+
+  s = socket(sa.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (s == -1)
+    return -1;
+  if (connect(s, (struct sockaddr *) &sa, peer_len) && errno != EINPROGRESS)
+    {
+      close(s);
+      return -1;
+    }
+
+  if ((slp->tcp_cnt & 15) == 0)
+    slp->tcp = realloc(slp->tcp, sizeof(*slp->tcp) * (slp->tcp_cnt + 16));
+  tcp = slp->tcp + slp->tcp_cnt++;
+  memset(tcp, 0, sizeof *tcp);
+  tcp->fd = s;
+  tcp->src = src;
+  tcp->xid = xid;
+  tcp->deadline = slp_now() + SLP_TCP_TIMEOUT;
+  tcp->req = malloc(req_len);
+  memcpy(tcp->req, req, req_len);
+  tcp->req_len = req_len;
+
+  return 0;
+}
+
+/* ask peer for the description of url (AttrRqst) */
+int slp_attr_start(slp_t *slp, struct sockaddr *peer, socklen_t peer_len, unsigned char *url, int urllen, int src)
+{
+  int l, xid;
   unsigned char sendbuf[8000];
-  unsigned char recvbuf[8000];
-  unsigned char *bp, *end;
+  unsigned char *bp;
 
-  xid = nextxid;
-  if (++nextxid == 65536)
-    nextxid = 1;
+  if (urllen > sizeof(sendbuf) - 64)
+    return -1;
+
+  xid = slp_xid();
   memset(sendbuf, 0, 18);
   sendbuf[0] = 2;
   sendbuf[1] = 6;	/* AttrRqst */
@@ -142,87 +337,274 @@ slp_get_descr(struct sockaddr_in *peer, unsigned char *url, int urllen)
   l = bp - sendbuf;
   sendbuf[3] = l >> 8;
   sendbuf[4] = l & 255;
-  s = socket(PF_INET, SOCK_STREAM, 0);
+
+  return slp_tcp_start(slp, peer, peer_len, sendbuf, l, xid, src);
+}
+
+/* continue TCP request i: finish connect, send request, read reply */
+void slp_tcp_io(slp_t *slp, int i, short revents)
+{
+  slp_tcp_t *tcp = slp->tcp + i;
+  int l, err;
+  socklen_t err_len = sizeof err;
+
+  if (!tcp->connected)
+    {
+      if (!(revents & (POLLOUT | POLLERR | POLLHUP)))
+	return;
+      if (getsockopt(tcp->fd, SOL_SOCKET, SO_ERROR, &err, &err_len) || err)
+	{
+	  slp_tcp_done(slp, i, 0);
+	  return;
+	}
+      tcp->connected = 1;
+    }
+
+  if (tcp->req_pos < tcp->req_len)
+    {
+      l = write(tcp->fd, tcp->req + tcp->req_pos, tcp->req_len - tcp->req_pos);
+      if (l <= 0)
+	{
+	  if (l == -1 && errno == EAGAIN)
+	    return;
+	  slp_tcp_done(slp, i, 0);
+	  return;
+	}
+      tcp->req_pos += l;
+      if (tcp->req_pos < tcp->req_len)
+	return;
+      tcp->reply = malloc(SLP_MAX_REPLY);
+      tcp->reply_len = 5;	/* enough to get the message length */
+      return;
+    }
+
+  if (!(revents & (POLLIN | POLLERR | POLLHUP)))
+    return;
+
+  l = read(tcp->fd, tcp->reply + tcp->reply_pos, tcp->reply_len - tcp->reply_pos);
+  if (l <= 0)
+    {
+      if (l == -1 && errno == EAGAIN)
+	return;
+      slp_tcp_done(slp, i, 0);
+      return;
+    }
+  tcp->reply_pos += l;
+  if (tcp->reply_pos == 5)
+    {
+      tcp->reply_len = slpget3(tcp->reply + 2);
+      if (tcp->reply_len <= 16 || tcp->reply_len > SLP_MAX_REPLY)
+	{
+	  slp_tcp_done(slp, i, 0);
+	  return;
+	}
+    }
+  if (tcp->reply_pos == tcp->reply_len)
+    slp_tcp_done(slp, i, 1);
+}
+
+/* TCP request i is finished (ok = 1) or failed (ok = 0) */
+void slp_tcp_done(slp_t *slp, int i, int ok)
+{
+  slp_tcp_t *tcp = slp->tcp + i;
+  struct sockaddr_storage sa;
+  socklen_t sa_len = sizeof sa;
+  slp_src_t *src;
+
+  if (tcp->fd == -1)
+    return;
+
+  if (tcp->src >= 0)
+    {
+      src = slp->src + tcp->src;
+      if (ok)
+	src->descr = slp_attrrply(tcp->reply, tcp->reply_len, tcp->xid);
+      if (!src->descr)
+	src->descr = strdup(src->url);
+    }
+  else if (ok && tcp->reply[0] == 2 && tcp->reply[1] == 2 && slpgetw(tcp->reply + 10) == tcp->xid)
+    {
+      if (!getpeername(tcp->fd, (struct sockaddr *) &sa, &sa_len))
+	slp_srvrply(slp, tcp->reply, tcp->reply_len, (struct sockaddr *) &sa, sa_len);
+      /* slp_srvrply() may have moved slp->tcp */
+      tcp = slp->tcp + i;
+    }
+
+  close(tcp->fd);
+  tcp->fd = -1;
+  free(tcp->req);
+  tcp->req = NULL;
+  free(tcp->reply);
+  tcp->reply = NULL;
+}
+
+int slp_udp_open(int family)
+{
+  int s;
+
+  s = socket(family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
   if (s == -1)
-    return 0;
-  if (slpsend(s, sendbuf, l, peer, 1))
     {
+      perror("socket");
+      return -1;
+    }
+  if (fcntl(s, F_SETFL, O_NONBLOCK))
+    {
+      perror("fcntl O_NONBLOCK");
       close(s);
-      return 0;
+      return -1;
     }
-  l2 = slprecv(s, recvbuf, sizeof(recvbuf), 0);
-  close(s);
-  if (l2 <= 0)
-    return 0;
-  end = recvbuf + l2;
-  if (recvbuf[0] != 2)
-    return 0;
-  if (recvbuf[1] != 7)	/* AttrRply */
-    return 0;
-  if (slpgetw(recvbuf + 10) != xid)
-    return 0;
-  bp = recvbuf + 12;
-  l3 = slpgetw(bp);
-  bp += l3 + 2;
-  if (bp + 4 > end)
-    return 0;
-  if (slpgetw(bp))		/* error code */
-    return 0;
-  al = slpgetw(bp + 2);
-  bp += 4;
-  if (bp + al > end)
-    return 0;
-  if (al < 14 || strncasecmp(bp, "(description=", 13))
-    return 0;
-  d = malloc(al - 14 + 1);
-  if (d == 0)
+
+  return s;
+}
+
+/* read all pending SrvRply packets from s */
+void slp_udp_read(slp_t *slp, int s)
+{
+  unsigned char recvbuf[SLP_MAX_REPLY];
+  struct sockaddr_storage pesa;
+  socklen_t pesal;
+  char *iaddr;
+  int l2;
+
+  for (;;)
+    {
+      pesal = sizeof pesa;
+      l2 = recvfrom(s, recvbuf, sizeof recvbuf, 0, (struct sockaddr *) &pesa, &pesal);
+      if (l2 < 0)
+	break;
+      if (l2 <= 16)
+	continue;
+      if (slpget3(recvbuf + 2) != l2)
+	continue;
+      if (recvbuf[0] != 2)
+	continue;
+      if (recvbuf[1] != 2)	/* SrvRply */
+	continue;
+      if (slpgetw(recvbuf + 10) != slp->xid)
+	continue;
+
+      iaddr = slp_peer_addr((struct sockaddr *) &pesa);
+      if (slp_seen(slp, iaddr))
+	continue;	/* saw it, ignore answer as it is a dup */
+
+      if (recvbuf[5] & 0x80)	/* OVERFLOW? */
+	{
+	  /* redo request with tcp and unicast */
+	  slp_tcp_start(slp, (struct sockaddr *) &pesa, pesal, slp->sendbuf, slp->len, slp->xid, -1);
+	}
+      else
+	{
+	  slp_srvrply(slp, recvbuf, l2, (struct sockaddr *) &pesa, pesal);
+	}
+
+      slp_add_responder(slp, iaddr);
+    }
+}
+
+/*
+ * Check if we already know an installation source matching the 'descr'
+ * and 'url' query keys.
+ *
+ * Return 2 if the match is unambiguous (the 'url' key is not a pattern),
+ * 1 if there is a match but other servers might match, too, and 0 if there
+ * is no match or no key is given - then we have to wait for all answers.
+ */
+int slp_match(slp_t *slp, url_t *url)
+{
+  slist_t *sl_descr, *sl_url;
+  slp_src_t *src;
+  int i, match = 0;
+
+  sl_descr = slist_getentry(url->query, "descr");
+  sl_url = slist_getentry(url->query, "url");
+
+  if (config.manual || (!sl_descr && !sl_url))
     return 0;
-  memcpy(d, bp + 13, al - 14);
-  d[al - 14] = 0;
-  return d;
+
+  for (i = 0; i < slp->src_cnt; i++)
+    {
+      src = slp->src + i;
+      if (!src->descr)
+	continue;
+      if (sl_descr && fnmatch(sl_descr->value, src->descr, FNM_CASEFOLD))
+	continue;
+      if (sl_url && fnmatch(sl_url->value, src->url, FNM_CASEFOLD))
+	continue;
+      if (sl_url && !strpbrk(sl_url->value, "*?[\\"))
+	{
+	  log_info("SLP: %s matches, stopping discovery\n", src->url);
+	  return 2;
+	}
+      match = 1;
+    }
+
+  return match;
 }
 
+int slp_src_cmp(const void *p0, const void *p1)
+{
+  const slp_src_t *src0 = p0, *src1 = p1;
+  int i;
+
+  i = strcmp(src0->descr, src1->descr);
+
+  return i ? i : strcmp(src0->url, src1->url);
+}
+
+/*
+ * Find installation sources via SLP.
+ *
+ * The SrvRqst is multicast (IPv4 and, if enabled, IPv6) SLP_TRIES times,
+ * every SLP_RETRY ms. Answers and descriptions (AttrRqst via TCP) are
+ * handled in a single poll() loop as they arrive. We stop SLP_QUIET ms
+ * after the last answer.
+ *
+ * If the 'descr' or 'url' query key is set, we stop as soon as a source
+ * matching an exact 'url' is known; or, for patterns, once there is a
+ * match and no new source has turned up for SLP_QUIET ms - without
+ * waiting for the remaining multicasts.
+ */
 char *slp_get_install(url_t *url)
 {
-  unsigned char sendbuf[8000];
-  unsigned char recvbuf[80000];
-  unsigned char *bp, *end, *service, service_key[256];
-  int xid, l, s, l2, l3, ec, comma, ulen, i, acnt, service_key_len;
+  slp_t *slp;
+  unsigned char *bp, *sendbuf, *service;
+  int l, s4 = -1, s6 = -1, i, j, acnt, timeout, tries, hash, match;
   struct sockaddr_in mysa;
   struct sockaddr_in mcsa;
-  struct sockaddr_in pesa;
-  int tries;
+  struct sockaddr_in6 mcsa6;
+  struct pollfd *pfd = NULL;
+  long long now, next, last, last_src;
   static char urlbuf[256];
-  char *iaddr, *d;
+  char *d;
   char **urls = 0;
   char **descs = 0;
   char **ambg = 0;
   int urlcnt = 0;
   int win_old;
-  unsigned char *origurl;
-  int origurllen;
   struct utsname utsname;
   char *key = NULL;
   slist_t *sl;
 
+  slp = calloc(1, sizeof *slp);
+  sendbuf = slp->sendbuf;
+
   mysa.sin_family = AF_INET;
   mysa.sin_port = 0;
   mysa.sin_addr.s_addr = config.net.hostname.ip.s_addr;
 
   mcsa.sin_family = AF_INET;
-  mcsa.sin_port = htons(427);
+  mcsa.sin_port = htons(SLP_PORT);
   mcsa.sin_addr.s_addr = htonl(0xeffffffd);
 
-  xid = nextxid;
-  if (++nextxid == 65536)
-    nextxid = 1;
+  slp->xid = slp_xid();
 
   memset(sendbuf, 0, 16);
   sendbuf[0] = 2;
   sendbuf[1] = 1;	/* SrvRqst */
   sendbuf[5] = 0x20;	/* flags: R */
-  sendbuf[10] = xid >> 8;
-  sendbuf[11] = xid & 255;
+  sendbuf[10] = slp->xid >> 8;
+  sendbuf[11] = slp->xid & 255;
   sendbuf[13] = 2;
   sendbuf[14] = 'e';
   sendbuf[15] = 'n';
@@ -230,17 +612,25 @@ char *slp_get_install(url_t *url)
   bp = sendbuf + 16;
   *bp++ = 0;
   *bp++ = 0;	/* prlistlen */
-  memcpy(bp, "\000\024service:", sizeof "\000\024service:" - 1);
-  bp += sizeof "\000\024service:" - 1;
   sl = slist_getentry(url->query, "service");
   service = sl ? sl->value : "install.suse";
-  memcpy(bp, service, strlen(service));
-  bp += strlen(service);
+  l = sizeof "service:" - 1 + strlen(service);
+  *bp++ = l >> 8;
+  *bp++ = l & 255;
+  memcpy(bp, "service:", sizeof "service:" - 1);
+  memcpy(bp + sizeof "service:" - 1, service, strlen(service));
+
+  /* IPv6 multicast address for this service type (RFC 3111, 4.1) */
+  for (hash = i = 0; i < l; i++)
+    hash = hash * 33 + bp[i];
+  hash &= 0x3ff;
+
+  bp += l;
   memcpy(bp, "\000\007default", 7 + 2);
   bp += 7 + 2;
 
-  sprintf(service_key, "service:%s:", service);
-  service_key_len = strlen(service_key);
+  sprintf(slp->service_key, "service:%s:", service);
+  slp->service_key_len = strlen(slp->service_key);
 
   if (uname(&utsname))
     {
@@ -251,7 +641,7 @@ char *slp_get_install(url_t *url)
     {
       int rell = strlen(utsname.release);
       int machl = strlen(utsname.machine);
-      if (bp + rell + machl + 57 + 4 < sendbuf + sizeof(sendbuf))
+      if (bp + rell + machl + 57 + 4 < sendbuf + sizeof(slp->sendbuf))
 	{
 	  *bp++ = (57 + rell + machl) >> 8;
 	  *bp++ = (57 + rell + machl) & 255;
@@ -264,189 +654,175 @@ char *slp_get_install(url_t *url)
   l = bp - sendbuf;
   sendbuf[3] = l >> 8;
   sendbuf[4] = l & 255;
-  s = socket(PF_INET, SOCK_DGRAM, 0);
-  if (s == -1)
+  slp->len = l;
+
+  if (config.net.ipv4 || !config.net.ipv6)
     {
-      perror("socket");
-      return NULL;
+      s4 = slp_udp_open(AF_INET);
+      if (s4 >= 0 && setsockopt(s4, IPPROTO_IP, IP_MULTICAST_IF, (char *)&mysa.sin_addr, sizeof(mysa.sin_addr)))
+	{
+	  perror("setsockopt IP_MULTICAST_IF");
+	  close(s4);
+	  s4 = -1;
+	}
+      i = 8;	/* like openslp */
+      if (s4 >= 0 && setsockopt(s4, IPPROTO_IP, IP_MULTICAST_TTL, &i, sizeof(i)))
+	{
+	  perror("setsockopt IP_MULTICAST_TTL");
+	}
     }
-  if (fcntl(s, F_SETFL, O_NONBLOCK))
+
+  if (config.net.ipv6)
     {
-      perror("fcntl O_NONBLOCK");
-      return NULL;
+      memset(&mcsa6, 0, sizeof mcsa6);
+      mcsa6.sin6_family = AF_INET6;
+      mcsa6.sin6_port = htons(SLP_PORT);
+      /* ff02::1:1000 + hash */
+      mcsa6.sin6_addr.s6_addr[0] = 0xff;
+      mcsa6.sin6_addr.s6_addr[1] = 0x02;
+      mcsa6.sin6_addr.s6_addr[13] = 0x01;
+      mcsa6.sin6_addr.s6_addr[14] = (0x1000 + hash) >> 8;
+      mcsa6.sin6_addr.s6_addr[15] = (0x1000 + hash) & 255;
+      s6 = slp_udp_open(AF_INET6);
+      i = config.ifcfg.current ? if_nametoindex(config.ifcfg.current) : 0;
+      mcsa6.sin6_scope_id = i;
+      if (s6 >= 0 && i && setsockopt(s6, IPPROTO_IPV6, IPV6_MULTICAST_IF, &i, sizeof(i)))
+	{
+	  perror("setsockopt IPV6_MULTICAST_IF");
+	}
     }
-  if (setsockopt(s, IPPROTO_IP, IP_MULTICAST_IF, (char *)&mysa.sin_addr, sizeof(mysa.sin_addr)))
+
+  if (s4 == -1 && s6 == -1)
     {
-      perror("setsockopt IP_MULTICAST_IF");
-      close(s);
+      free(slp);
       return NULL;
     }
-  i = 8;	/* like openslp */
-  if (setsockopt(s, IPPROTO_IP, IP_MULTICAST_TTL, &i, sizeof(i)))
-    {
-      perror("setsockopt IP_MULTICAST_TTL");
-    }
-  for (tries = 0; tries < 3; tries++)
+
+  now = last = last_src = next = slp_now();
+  for (tries = 0;;)
     {
-      if (slpsend(s, sendbuf, l, &mcsa, 0))
+      if (tries < SLP_TRIES && now >= next)
 	{
-	  close(s);
-	  return NULL;
+	  if (s4 >= 0 && sendto(s4, sendbuf, slp->len, 0, (struct sockaddr *) &mcsa, sizeof mcsa) != slp->len)
+	    perror("sendto");
+	  if (s6 >= 0 && sendto(s6, sendbuf, slp->len, 0, (struct sockaddr *) &mcsa6, sizeof mcsa6) != slp->len)
+	    perror("sendto");
+	  tries++;
+	  next = now + SLP_RETRY;
+	  last = now;
 	}
-      for (;;)
+
+      for (i = 0; i < slp->tcp_cnt; i++)
+	if (now >= slp->tcp[i].deadline)
+	  slp_tcp_done(slp, i, 0);
+
+      /* drop finished TCP requests */
+      for (i = j = 0; i < slp->tcp_cnt; i++)
+	if (slp->tcp[i].fd != -1)
+	  slp->tcp[j++] = slp->tcp[i];
+      slp->tcp_cnt = j;
+
+      match = slp_match(slp, url);
+      if (match == 2)
+	break;
+      if (match && !slp->tcp_cnt && now >= last_src + SLP_QUIET)
 	{
-	  l2 = slprecv(s, recvbuf, sizeof(recvbuf), &pesa);
-	  if (l2 == -1)
-	    {
-	      close(s);
-	      return NULL;
-	    }
-	  if (l2 == -2)
-	    break;
-	  if (l2 == 0)
-	   continue;
-	  if (recvbuf[0] != 2)
-	    continue;
-	  if (recvbuf[1] != 2)	/* SrvRply */
-	    continue;
-	  if (slpgetw(recvbuf + 10) != xid)
-	    continue;
-
-	  iaddr = inet_ntoa(pesa.sin_addr);
-	  end = recvbuf + l2;
-
-	  /* check if we already saw that answer */
-	  l2 = slpgetw(sendbuf + 16);
-	  l3 = strlen(iaddr);
-	  bp = sendbuf + 18;
-	  while (l2)
-	    {
-	      if (l2 >= l3 && strncmp(bp, iaddr, l3) == 0 && (l2 == l3 || bp[l3] == ','))
-		break;
-	      while (l2)
-		{
-		  l2--;
-		  if (*bp++ == ',')
-		    break;
-		}
-	    }
-	  if (l2)
-	    continue;	/* saw it, ignore answer as it is a dup */
-
-	  if (recvbuf[5] & 0x80)	/* OVERFLOW? */
-	    {
-	      /* redo request with tcp and unicast */
-	      int s2;
-	      s2 = socket(PF_INET, SOCK_STREAM, 0);
-	      if (s2 != 0 && slpsend(s2, sendbuf, l, &pesa, 1) == 0)
-		{
-		  l2 = slprecv(s2, recvbuf, sizeof(recvbuf), 0);
-		  close(s2);
-		  if (l2 <= 0)
-		    continue;
-		}
-	      if (recvbuf[0] != 2)
-		continue;
-	      if (recvbuf[1] != 2)	/* SrvRply */
-		continue;
-	      if (slpgetw(recvbuf + 10) != xid)
-		continue;
-	      end = recvbuf + l2;
-	    }
-
-	  l3 = strlen(iaddr);
-	  comma = sendbuf[16] != 0 || sendbuf[17] != 0;
-	  if (l + l3 + comma <= sizeof(sendbuf))
-	    {
-	      bp = sendbuf + 18;
-	      memmove(bp + l3 + comma, bp, l - 18);
-	      memmove(bp, iaddr, l3);
-	      if (comma)
-		bp[l3] = ',';
-	      l2 = slpgetw(sendbuf + 16) + l3 + comma;
-	      sendbuf[16] = l2 >> 8;
-	      sendbuf[17] = l2 & 255;
-	      l += l3 + comma;
-	      sendbuf[3] = l >> 8;
-	      sendbuf[4] = l & 255;
-	    }
-	  bp = recvbuf + 12;
-	  l3 = slpgetw(bp);
-	  bp += l3 + 2;
-	  if (bp + 4 > end)
-	    continue;
-	  if (slpgetw(bp))		/* error code */
-	    continue;
-	  ec = slpgetw(bp + 2);
-	  bp += 4;
-	  for (; ec > 0; ec--)
-	    {
-	      if (bp + 5 > end)
-		break;
-	      ulen =  slpgetw(bp + 3);
-	      bp += 5;
-	      if (bp + ulen + 1 > end)
-		break;
-	      origurl = bp;
-	      origurllen = ulen;
-	      if (ulen > service_key_len && !strncasecmp(bp, service_key, service_key_len))
-		{
-		  bp += service_key_len;
-		  ulen -= service_key_len;
-		}
-	      /* 8: room for install= */
-	      if (ulen > sizeof(urlbuf) - 1 - 8)
-		{
-		  bp += ulen;
-		  if (*bp++)
-		    break;
-		  continue;
-		}
-	      memcpy(urlbuf, bp, ulen);
-	      urlbuf[ulen] = 0;
-	      bp += ulen;
-	      for (i = 0; i < urlcnt; i++)
-		if (!strcasecmp(urls[i], urlbuf))
-		  break;
-	      if (i == urlcnt)
-		{
-		  if ((urlcnt & 15) == 0)
-		    {
-		      if (urls)
-			urls = realloc(urls, sizeof(char **) * (urlcnt + 16));
-		      else
-			urls = malloc(sizeof(char **) * (urlcnt + 16));
-		      if (descs)
-			descs = realloc(descs, sizeof(char **) * (urlcnt + 16));
-		      else
-			descs = malloc(sizeof(char **) * (urlcnt + 16));
-		    }
-		  if (!urls || !descs)
-		    {
-		      close(s);
-		      return NULL;
-		    }
-		  d = slp_get_descr(&pesa, origurl, origurllen);
-		  if (!d)
-		    d = strdup(urlbuf);
-		  for (i = 0; i < urlcnt; i++)
-		    if (strcmp(d, descs[i]) < 0 || (strcmp(d, descs[i]) == 0 && strcmp(urlbuf, urls[i]) < 0))
-		      break;
-		  if (i < urlcnt)
-		    {
-		      memmove(descs + i + 1, descs + i, sizeof(*descs) * (urlcnt - i));
-		      memmove(urls + i + 1, urls + i, sizeof(*urls) * (urlcnt - i));
-		    }
-		  descs[i] = d;
-		  urls[i] = strdup(urlbuf);;
-		  urlcnt++;
-		}
-	      if (*bp++)
-		break;
-	    }
+	  log_info("SLP: found matching source, stopping discovery\n");
+	  break;
+	}
+
+      if (tries == SLP_TRIES && !slp->tcp_cnt && now >= last + SLP_QUIET)
+	break;
+
+      timeout = (tries < SLP_TRIES ? next : last + SLP_QUIET) - now;
+      if (match && last_src + SLP_QUIET - now < timeout)
+	timeout = last_src + SLP_QUIET - now;
+      for (i = 0; i < slp->tcp_cnt; i++)
+	if (slp->tcp[i].deadline - now < timeout)
+	  timeout = slp->tcp[i].deadline - now;
+      if (timeout < 0)
+	timeout = 0;
+
+      pfd = realloc(pfd, sizeof *pfd * (slp->tcp_cnt + 2));
+      pfd[0].fd = s4;
+      pfd[0].events = POLLIN;
+      pfd[1].fd = s6;
+      pfd[1].events = POLLIN;
+      for (i = 0; i < slp->tcp_cnt; i++)
+	{
+	  pfd[i + 2].fd = slp->tcp[i].fd;
+	  pfd[i + 2].events = slp->tcp[i].req_pos < slp->tcp[i].req_len ? POLLOUT : POLLIN;
+	}
+
+      j = slp->tcp_cnt;
+      if (poll(pfd, j + 2, timeout) < 0 && errno != EINTR)
+	{
+	  perror("poll");
+	  break;
+	}
+
+      if ((pfd[0].revents & POLLIN))
+	{
+	  i = slp->src_cnt;
+	  slp_udp_read(slp, s4);
+	  if (slp->src_cnt != i || slp->tcp_cnt != j)
+	    last = last_src = slp_now();
+	}
+      if ((pfd[1].revents & POLLIN))
+	{
+	  i = slp->src_cnt;
+	  slp_udp_read(slp, s6);
+	  if (slp->src_cnt != i || slp->tcp_cnt != j)
+	    last = last_src = slp_now();
+	}
+      /* new requests may be added while we go */
+      for (i = 0; i < j; i++)
+	if (pfd[i + 2].revents)
+	  slp_tcp_io(slp, i, pfd[i + 2].revents);
+
+      now = slp_now();
+    }
+
+  for (i = 0; i < slp->tcp_cnt; i++)
+    {
+      if (slp->tcp[i].fd != -1)
+	close(slp->tcp[i].fd);
+      free(slp->tcp[i].req);
+      free(slp->tcp[i].reply);
+    }
+  if (s4 >= 0)
+    close(s4);
+  if (s6 >= 0)
+    close(s6);
+  free(pfd);
+  free(slp->tcp);
+
+  /* sources without description are those we didn't wait for */
+  for (i = j = 0; i < slp->src_cnt; i++)
+    {
+      if (slp->src[i].descr)
+	slp->src[j++] = slp->src[i];
+      else
+	free(slp->src[i].url);
+    }
+  slp->src_cnt = j;
+
+  qsort(slp->src, slp->src_cnt, sizeof *slp->src, slp_src_cmp);
+
+  urlcnt = slp->src_cnt;
+  if (urlcnt)
+    {
+      urls = malloc(urlcnt * sizeof(char **));
+      descs = malloc(urlcnt * sizeof(char **));
+      for (i = 0; i < urlcnt; i++)
+	{
+	  urls[i] = slp->src[i].url;
+	  descs[i] = slp->src[i].descr;
 	}
     }
-  close(s);
+  free(slp->src);
+  free(slp);
+
   if (urlcnt == 0)
     {
       log_info("SLP: no installation source found\n");
@@ -0,0 +1,506 @@
+/*
+ * Minimal SLP service agent to test linuxrc's SLP discovery (slp.c).
+ *
+ * Answers SrvRqst (UDP multicast and TCP) and AttrRqst (TCP) for a fixed
+ * list of installation sources. Run several instances with different
+ * addresses (--bind) to simulate several servers.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <getopt.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <net/if.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define SLP_PORT	427
+#define MAX_SOURCES	64
+
+struct option options[] = {
+  { "service", 1, NULL, 's' },
+  { "bind", 1, NULL, 'b' },
+  { "interface", 1, NULL, 'i' },
+  { "delay", 1, NULL, 'd' },
+  { "ipv6", 0, NULL, '6' },
+  { "verbose", 0, NULL, 'v' },
+  { "help", 0, NULL, 'h' },
+  { }
+};
+
+typedef struct {
+  char *url;
+  char *descr;
+} source_t;
+
+typedef struct {
+  unsigned char *buf;
+  unsigned len;
+  unsigned pos;
+} msg_t;
+
+source_t sources[MAX_SOURCES];
+unsigned sources_cnt;
+
+char *opt_service = "install.suse";
+char *opt_bind = "0.0.0.0";
+char *opt_interface;
+unsigned opt_delay;
+int opt_ipv6;
+int opt_verbose;
+
+void usage(int err);
+unsigned get16(unsigned char *p);
+int get_str(msg_t *msg, char **str);
+void put_str(msg_t *msg, char *str, unsigned len);
+void put_header(msg_t *msg, unsigned func, unsigned xid);
+void put_len(msg_t *msg);
+int handle_request(unsigned char *req, unsigned len, char *peer, msg_t *reply);
+int pr_list_has(char *pr_list, char *addr);
+char *local_addr(struct sockaddr *peer, socklen_t peer_len);
+void tcp_client(int fd, struct sockaddr *peer, socklen_t peer_len);
+int ipv6_group(struct in6_addr *addr);
+
+
+int main(int argc, char **argv)
+{
+  int i, udp4, udp6 = -1, udp_out, tcp, fd;
+  struct sockaddr_in sa4 = { .sin_family = AF_INET, .sin_port = htons(SLP_PORT) };
+  struct sockaddr_in6 sa6 = { .sin6_family = AF_INET6, .sin6_port = htons(SLP_PORT) };
+  struct sockaddr_storage peer;
+  socklen_t peer_len;
+  struct ip_mreqn mreq = { };
+  struct ipv6_mreq mreq6 = { };
+  struct pollfd pfd[4];
+  unsigned char buf[8000];
+  msg_t reply = { };
+  char *addr;
+  int one = 1, len;
+
+  opterr = 0;
+
+  while((i = getopt_long(argc, argv, "s:b:i:d:6vh", options, NULL)) != -1) {
+    switch(i) {
+      case 's':
+        opt_service = optarg;
+        break;
+
+      case 'b':
+        opt_bind = optarg;
+        break;
+
+      case 'i':
+        opt_interface = optarg;
+        break;
+
+      case 'd':
+        opt_delay = strtoul(optarg, NULL, 0);
+        break;
+
+      case '6':
+        opt_ipv6 = 1;
+        break;
+
+      case 'v':
+        opt_verbose++;
+        break;
+
+      case 'h':
+        usage(0);
+        break;
+
+      default:
+        usage(1);
+    }
+  }
+
+  argc -= optind;
+  argv += optind;
+
+  if(!argc || argc % 2 || argc / 2 > MAX_SOURCES) usage(1);
+
+  for(; argc; argc -= 2, argv += 2) {
+    sources[sources_cnt].url = argv[0];
+    sources[sources_cnt++].descr = argv[1];
+  }
+
+  if(!inet_aton(opt_bind, &sa4.sin_addr)) {
+    fprintf(stderr, "%s: invalid address\n", opt_bind);
+    return 1;
+  }
+
+  signal(SIGCHLD, SIG_IGN);
+
+  /* TCP: AttrRqst, and SrvRqst after an overflow */
+  tcp = socket(AF_INET, SOCK_STREAM, 0);
+  setsockopt(tcp, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+  if(bind(tcp, (struct sockaddr *) &sa4, sizeof sa4) || listen(tcp, 16)) {
+    perror("tcp");
+    return 1;
+  }
+
+  /* UDP: multicast SrvRqst; bind to any address to receive multicast packets */
+  udp4 = socket(AF_INET, SOCK_DGRAM, 0);
+  setsockopt(udp4, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+  sa4.sin_addr.s_addr = htonl(INADDR_ANY);
+  if(bind(udp4, (struct sockaddr *) &sa4, sizeof sa4)) {
+    perror("udp");
+    return 1;
+  }
+
+  /* answer from the --bind address: the client identifies servers by it */
+  udp_out = udp4;
+  if(strcmp(opt_bind, "0.0.0.0")) {
+    udp_out = socket(AF_INET, SOCK_DGRAM, 0);
+    setsockopt(udp_out, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+    inet_aton(opt_bind, &sa4.sin_addr);
+    if(bind(udp_out, (struct sockaddr *) &sa4, sizeof sa4)) {
+      perror("udp");
+      return 1;
+    }
+  }
+
+  mreq.imr_multiaddr.s_addr = htonl(0xeffffffd);
+  inet_aton(opt_bind, &mreq.imr_address);
+  if(opt_interface) mreq.imr_ifindex = if_nametoindex(opt_interface);
+  if(setsockopt(udp4, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof mreq)) {
+    perror("IP_ADD_MEMBERSHIP");
+    return 1;
+  }
+
+  if(opt_ipv6) {
+    udp6 = socket(AF_INET6, SOCK_DGRAM, 0);
+    setsockopt(udp6, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+    setsockopt(udp6, IPPROTO_IPV6, IPV6_V6ONLY, &one, sizeof one);
+    ipv6_group(&mreq6.ipv6mr_multiaddr);
+    if(opt_interface) mreq6.ipv6mr_interface = if_nametoindex(opt_interface);
+    if(
+      bind(udp6, (struct sockaddr *) &sa6, sizeof sa6) ||
+      setsockopt(udp6, IPPROTO_IPV6, IPV6_ADD_MEMBERSHIP, &mreq6, sizeof mreq6)
+    ) {
+      perror("ipv6");
+      return 1;
+    }
+  }
+
+  if(opt_verbose) {
+    inet_ntop(AF_INET6, &mreq6.ipv6mr_multiaddr, (char *) buf, sizeof buf);
+    fprintf(stderr, "service:%s, %u sources%s%s\n", opt_service, sources_cnt, opt_ipv6 ? ", ipv6 group " : "", opt_ipv6 ? (char *) buf : "");
+  }
+
+  pfd[0].fd = udp4;
+  pfd[1].fd = udp6;
+  pfd[2].fd = tcp;
+  pfd[3].fd = udp_out == udp4 ? -1 : udp_out;
+  pfd[0].events = pfd[1].events = pfd[2].events = pfd[3].events = POLLIN;
+
+  for(;;) {
+    if(poll(pfd, 4, -1) < 0) {
+      if(errno == EINTR) continue;
+      perror("poll");
+      return 1;
+    }
+
+    for(i = 0; i < 4; i++) {
+      if(i == 2 || !(pfd[i].revents & POLLIN)) continue;
+      peer_len = sizeof peer;
+      len = recvfrom(pfd[i].fd, buf, sizeof buf, 0, (struct sockaddr *) &peer, &peer_len);
+      if(len <= 0) continue;
+      fd = pfd[i].fd == udp4 ? udp_out : pfd[i].fd;
+      addr = fd == udp_out && udp_out != udp4 ? opt_bind : local_addr((struct sockaddr *) &peer, peer_len);
+      if(handle_request(buf, len, addr, &reply)) {
+        sendto(fd, reply.buf, reply.len, 0, (struct sockaddr *) &peer, peer_len);
+      }
+    }
+
+    if(pfd[2].revents & POLLIN) {
+      peer_len = sizeof peer;
+      fd = accept(tcp, (struct sockaddr *) &peer, &peer_len);
+      if(fd == -1) continue;
+      if(!fork()) {
+        close(tcp);
+        tcp_client(fd, (struct sockaddr *) &peer, peer_len);
+        exit(0);
+      }
+      close(fd);
+    }
+  }
+
+  return 0;
+}
+
+
+void usage(int err)
+{
+  fprintf(err ? stderr : stdout,
+    "Usage: slpd [options] url description [url description ...]\n"
+    "Answer SLP requests for installation sources (to test linuxrc).\n"
+    "  -s, --service TYPE  service type (default: install.suse)\n"
+    "  -b, --bind ADDR     IPv4 address to answer from (default: any)\n"
+    "  -i, --interface IF  join multicast groups on interface IF\n"
+    "  -d, --delay MS      delay AttrRqst answers by MS milliseconds\n"
+    "  -6, --ipv6          listen on the IPv6 multicast group, too\n"
+    "  -v, --verbose       log requests\n"
+    "  -h, --help          show this text\n"
+  );
+
+  exit(err);
+}
+
+
+unsigned get16(unsigned char *p)
+{
+  return (p[0] << 8) + p[1];
+}
+
+
+/*
+ * Read a 16-bit length prefixed string; return 0 if ok.
+ */
+int get_str(msg_t *msg, char **str)
+{
+  unsigned len;
+
+  if(msg->pos + 2 > msg->len) return 1;
+  len = get16(msg->buf + msg->pos);
+  if(msg->pos + 2 + len > msg->len) return 1;
+
+  *str = strndup((char *) msg->buf + msg->pos + 2, len);
+  msg->pos += 2 + len;
+
+  return 0;
+}
+
+
+void put_str(msg_t *msg, char *str, unsigned len)
+{
+  msg->buf = realloc(msg->buf, msg->len + 2 + len);
+  msg->buf[msg->len] = len >> 8;
+  msg->buf[msg->len + 1] = len;
+  memcpy(msg->buf + msg->len + 2, str, len);
+  msg->len += 2 + len;
+}
+
+
+void put_header(msg_t *msg, unsigned func, unsigned xid)
+{
+  msg->buf = realloc(msg->buf, 12);
+  memset(msg->buf, 0, 12);
+  msg->buf[0] = 2;
+  msg->buf[1] = func;
+  msg->buf[10] = xid >> 8;
+  msg->buf[11] = xid;
+  msg->len = 12;
+  put_str(msg, "en", 2);
+}
+
+
+void put_len(msg_t *msg)
+{
+  msg->buf[2] = msg->len >> 16;
+  msg->buf[3] = msg->len >> 8;
+  msg->buf[4] = msg->len;
+}
+
+
+/*
+ * Handle SrvRqst or AttrRqst; 'addr' is our address as seen by the client.
+ *
+ * Return 1 if there is a reply.
+ */
+int handle_request(unsigned char *req, unsigned len, char *addr, msg_t *reply)
+{
+  msg_t msg = { .buf = req, .len = len };
+  char *lang = NULL, *pr_list = NULL, *type = NULL, *url = NULL, *prefix = NULL, *s;
+  unsigned u, xid, cnt;
+  int ok = 0;
+
+  if(len < 14 || req[0] != 2 || (req[2] << 16) + (req[3] << 8) + req[4] != len) return 0;
+
+  xid = get16(req + 10);
+  msg.pos = 12;
+
+  if(get_str(&msg, &lang) || get_str(&msg, &pr_list)) goto done;
+
+  asprintf(&prefix, "service:%s:", opt_service);
+
+  if(req[1] == 1) {
+    /* SrvRqst */
+    if(get_str(&msg, &type)) goto done;
+    if(opt_verbose) fprintf(stderr, "SrvRqst xid %u from %s, type %s, previous responders '%s'\n", xid, addr, type, pr_list);
+    if(strncasecmp(type, prefix, strlen(type)) || strlen(type) != strlen(prefix) - 1) goto done;
+    if(pr_list_has(pr_list, addr)) goto done;
+
+    put_header(reply, 2, xid);
+    reply->buf = realloc(reply->buf, reply->len + 4);
+    reply->buf[reply->len++] = 0;		// error code
+    reply->buf[reply->len++] = 0;
+    reply->buf[reply->len++] = sources_cnt >> 8;
+    reply->buf[reply->len++] = sources_cnt;
+    for(u = 0; u < sources_cnt; u++) {
+      asprintf(&s, "%s%s", prefix, sources[u].url);
+      reply->buf = realloc(reply->buf, reply->len + 3);
+      reply->buf[reply->len++] = 0;		// reserved
+      reply->buf[reply->len++] = 0xff;	// lifetime
+      reply->buf[reply->len++] = 0xff;
+      put_str(reply, s, strlen(s));
+      reply->buf = realloc(reply->buf, reply->len + 1);
+      reply->buf[reply->len++] = 0;		// no auth blocks
+      free(s);
+    }
+    put_len(reply);
+    ok = 1;
+  }
+  else if(req[1] == 6) {
+    /* AttrRqst */
+    if(get_str(&msg, &url)) goto done;
+    if(opt_verbose) fprintf(stderr, "AttrRqst xid %u, url %s\n", xid, url);
+    if(opt_delay) usleep(opt_delay * 1000);
+
+    s = NULL;
+    for(u = cnt = 0; u < sources_cnt; u++) {
+      if(
+        !strncasecmp(url, prefix, strlen(prefix)) &&
+        !strcmp(url + strlen(prefix), sources[u].url)
+      ) {
+        asprintf(&s, "(description=%s)", sources[u].descr);
+        break;
+      }
+    }
+
+    put_header(reply, 7, xid);
+    reply->buf = realloc(reply->buf, reply->len + 2);
+    reply->buf[reply->len++] = 0;
+    reply->buf[reply->len++] = 0;
+    put_str(reply, s ?: "", s ? strlen(s) : 0);
+    reply->buf = realloc(reply->buf, reply->len + 1);
+    reply->buf[reply->len++] = 0;
+    put_len(reply);
+    free(s);
+    ok = 1;
+  }
+
+done:
+  free(lang);
+  free(pr_list);
+  free(type);
+  free(url);
+  free(prefix);
+
+  return ok;
+}
+
+
+/*
+ * Check if 'addr' is in the comma-separated list 'pr_list'.
+ */
+int pr_list_has(char *pr_list, char *addr)
+{
+  char *s, *t, *list = strdup(pr_list);
+  int found = 0;
+
+  for(s = strtok_r(list, ",", &t); s && !found; s = strtok_r(NULL, ",", &t)) {
+    found = !strcmp(s, addr);
+  }
+
+  free(list);
+
+  return found;
+}
+
+
+/*
+ * Our address as seen by 'peer' (the source address the kernel picks).
+ */
+char *local_addr(struct sockaddr *peer, socklen_t peer_len)
+{
+  static char buf[INET6_ADDRSTRLEN];
+  struct sockaddr_storage sa;
+  socklen_t sa_len = sizeof sa;
+  int fd;
+
+  *buf = 0;
+
+  fd = socket(peer->sa_family, SOCK_DGRAM, 0);
+  if(fd == -1) return buf;
+
+  if(!connect(fd, peer, peer_len) && !getsockname(fd, (struct sockaddr *) &sa, &sa_len)) {
+    if(sa.ss_family == AF_INET6) {
+      inet_ntop(AF_INET6, &((struct sockaddr_in6 *) &sa)->sin6_addr, buf, sizeof buf);
+    }
+    else {
+      inet_ntop(AF_INET, &((struct sockaddr_in *) &sa)->sin_addr, buf, sizeof buf);
+    }
+  }
+
+  close(fd);
+
+  return buf;
+}
+
+
+/*
+ * Answer a single request on TCP connection 'fd'.
+ */
+void tcp_client(int fd, struct sockaddr *peer, socklen_t peer_len)
+{
+  unsigned char *buf = malloc(5);
+  unsigned len = 5, pos = 0;
+  msg_t reply = { };
+  ssize_t i;
+
+  while(pos < len) {
+    if((i = read(fd, buf + pos, len - pos)) <= 0) break;
+    pos += i;
+    if(pos == 5) {
+      len = (buf[2] << 16) + (buf[3] << 8) + buf[4];
+      if(len < 14 || len > 0x10000) break;
+      buf = realloc(buf, len);
+    }
+  }
+
+  /* over TCP, the peer never appears in the previous responder list */
+  if(pos == len && handle_request(buf, len, "", &reply)) {
+    for(pos = 0; pos < reply.len; pos += i) {
+      if((i = write(fd, reply.buf + pos, reply.len - pos)) <= 0) break;
+    }
+  }
+
+  close(fd);
+  free(buf);
+  free(reply.buf);
+}
+
+
+/*
+ * Link-local IPv6 multicast group for our service type (RFC 3111, 4.1).
+ */
+int ipv6_group(struct in6_addr *addr)
+{
+  char *type = NULL, *s;
+  unsigned hash = 0;
+
+  asprintf(&type, "service:%s", opt_service);
+  for(s = type; *s; s++) hash = hash * 33 + (unsigned char) *s;
+  free(type);
+
+  hash = 0x1000 + (hash & 0x3ff);
+
+  memset(addr, 0, sizeof *addr);
+  addr->s6_addr[0] = 0xff;
+  addr->s6_addr[1] = 0x02;
+  addr->s6_addr[13] = 0x01;
+  addr->s6_addr[14] = hash >> 8;
+  addr->s6_addr[15] = hash;
+
+  return 0;
+}
@@ -20,6 +20,8 @@ known issues:
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mount.h>
+#include <pthread.h>
+#include <semaphore.h>
 
 #include <curl/curl.h>
 
@@ -33,10 +35,27 @@ known issues:
 #include "display.h"
 #include "auto2.h"
 #include "url.h"
+#include "sha_hw.h"
 
 #define CRAMFS_SUPER_MAGIC	0x28cd3d45
 #define CRAMFS_SUPER_MAGIC_BIG	0x453dcd28
 
+/* digest_process() passes data in pieces of this size to each digest */
+#define DIGEST_CHUNK_SIZE	(16 << 10)
+
+/* ring buffer used to pass data to the digest thread */
+#define DIGEST_RING_SLOTS	16
+#define DIGEST_SLOT_SIZE	(64 << 10)
+
+/* smaller downloads are not worth a digest thread */
+#define DIGEST_THREAD_MIN	(4 << 20)
+
+/* minimum size of a segment for segmented downloads */
+#define URL_SEGMENT_MIN		(16 << 20)
+
+/* max number of threads identifying candidate devices in url_mount() */
+#define URL_PROBE_THREADS	16
+
 struct cramfs_super_block {
   unsigned magic;
   unsigned size;
@@ -50,13 +69,97 @@ struct cramfs_super_block {
   unsigned char name[16];
 };
 
+typedef struct url_segment_s {
+  struct url_segments_s *all;
+  uint64_t start, end;		// byte range ('end' not included)
+  uint64_t pos;			// next write position
+  unsigned code;		// HTTP status
+  unsigned range_ok:1;		// Content-Range header matches [start, end)
+} url_segment_t;
+
+typedef struct url_segments_s {
+  url_data_t *url_data;
+  uint64_t size;		// file size
+  int fd;			// destination file
+  uint64_t digest_pos;		// data up to here have been passed to digest_process()
+  unsigned count;
+  url_segment_t seg[];
+} url_segments_t;
+
+/*
+ * Hashing thread state.
+ *
+ * The download side fills slot[head], the thread processes slot[tail].
+ * 'empty' and 'filled' count the free and ready slots. A slot with
+ * len = 0 tells the thread to stop.
+ */
+typedef struct digest_thread_s {
+  pthread_t thread;
+  url_data_t *url_data;
+  sem_t empty, filled;
+  unsigned head, tail;
+  unsigned running:1;		// thread has been started
+  unsigned have_slot:1;		// slot[head] has been taken from 'empty'
+  struct {
+    size_t len;
+    unsigned char *data;
+  } slot[DIGEST_RING_SLOTS];
+} digest_thread_t;
+
+/* url_read() checks the response headers to see if it can switch to range requests */
+typedef struct {
+  url_data_t *url_data;
+  uint64_t size;		// file size according to Content-Length header
+  char *url;			// final url after redirects
+  char if_range[256];		// 'If-Range' header to pin the file version (from ETag or Last-Modified)
+  char last_modified[128];
+  unsigned ok:1;		// status 200
+  unsigned ranges:1;		// server accepts range requests
+  unsigned done:1;		// got first data, decision made
+  unsigned segment:1;		// use url_read_segmented()
+} url_range_check_t;
+
+/*
+ * Devices to be identified by url_probe_devices().
+ */
+typedef struct {
+  slist_t *list;		// key: device name, value: fs type
+  slist_t **dev;		// list entries as array
+  unsigned char *done;		// dev[i] has been identified
+  unsigned count;
+  unsigned next;		// next device to be picked up
+  unsigned threads_cnt;
+  pthread_t threads[URL_PROBE_THREADS];
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;		// signaled when a device has been identified
+} url_devprobe_t;
+
+static CURL *url_read_init(url_data_t *url_data);
+static CURL *url_curl_init(url_data_t *url_data);
+static CURLSH *url_curl_share(void);
+static struct curl_slist *url_curl_resolve(url_t *url);
+static void url_read_done(url_data_t *url_data, CURL *c_handle);
+static void url_read_segmented(url_data_t *url_data, url_range_check_t *check);
+static size_t url_range_header_cb(void *buffer, size_t size, size_t nmemb, void *userp);
+static size_t url_range_write_cb(void *buffer, size_t size, size_t nmemb, void *userp);
+static size_t url_segment_header_cb(void *buffer, size_t size, size_t nmemb, void *userp);
+static size_t url_segment_write_cb(void *buffer, size_t size, size_t nmemb, void *userp);
+static void url_segment_digest(url_segments_t *segs);
 static size_t url_write_cb(void *buffer, size_t size, size_t nmemb, void *userp);
 static int url_progress_cb(void *clientp, double dltotal, double dlnow, double ultotal, double ulnow);
+static void url_write_data(url_data_t *url_data, void *buffer, size_t len);
+static int url_unzip_write(void *data, void *buffer, size_t len);
 
 static int url_read_file_nosig(url_t *url, char *dir, char *src, char *dst, char *label, unsigned flags);
+static int url_prepare_dst(char *dst, unsigned flags);
+static int url_sig_embedded(char *dst);
+static int url_sig_detached(char *name, char *dst, int sig_err);
+static url_data_t *url_data_new_file(url_t *url, char *src, char *dst, char *label, unsigned flags);
+static int url_data_check(url_data_t *url_data, unsigned flags);
 static int url_mount_really(url_t *url, char *device, char *dir);
 static int url_mount_disk(url_t *url, char *dir, int (*test_func)(url_t *));
 static int url_progress(url_data_t *url_data, int stage);
+static int url_load_instsys_parallel(url_t *url);
 static int url_setup_device(url_t *url);
 static int url_setup_interface(url_t *url);
 static int url_setup_slp(url_t *url);
@@ -66,10 +169,22 @@ static char *url_instsys_config(char *path);
 static char *url_config_get_path(char *entry);
 static slist_t *url_config_get_file_list(char *entry);
 static hd_t *sort_a_bit(hd_t *hd_list);
+static int url_mount_candidate(url_t *url, hd_t *hd, char *url_device, char **hwaddr);
+static url_devprobe_t *url_probe_devices(url_t *url, hd_t *hd_list, char *url_device);
+static slist_t *url_probe_result(url_devprobe_t *probe, char *device);
+static void url_probe_done(url_devprobe_t *probe);
+static void *url_probe_thread(void *arg);
+static slist_t *url_race_setup(url_t *url, hd_t *hd_list, char *url_device);
+static int url_race_next(slist_t **race, char *device);
 static int link_detected(hd_t *hd);
 static char *url_print_zypp(url_t *url);
 static void digest_init(url_data_t *url_data);
 static void digest_process(url_data_t *url_data, void *buffer, size_t len);
+static void digest_process_data(url_data_t *url_data, void *buffer, size_t len);
+static void digest_thread_start(url_data_t *url_data);
+static void digest_thread_stop(url_data_t *url_data);
+static void digest_thread_push(digest_thread_t *dt);
+static void *digest_thread_run(void *data);
 static void digest_finish(url_data_t *url_data);
 static int digest_verify(url_data_t *url_data, char *file_name);
 static int warn_signature_failed(char *file_name);
@@ -81,20 +196,209 @@ static unsigned url_scheme_attr(instmode_t scheme, char *attr_name);
 void url_read(url_data_t *url_data)
 {
   CURL *c_handle;
+  url_range_check_t check = { .url_data = url_data };
+  char *url;
   int i;
-  FILE *f;
-  char *buf, *s, *proxy_url = NULL;
   sighandler_t old_sigpipe = signal(SIGPIPE, SIG_IGN);
 
+  c_handle = url_read_init(url_data);
+
+  // big files may be loaded in segments, see url_range_write_cb()
+  if(
+    url_data->segments > 1 &&
+    (url_data->url->scheme == inst_http || url_data->url->scheme == inst_https)
+  ) {
+    curl_easy_setopt(c_handle, CURLOPT_HEADERFUNCTION, url_range_header_cb);
+    curl_easy_setopt(c_handle, CURLOPT_HEADERDATA, &check);
+    curl_easy_setopt(c_handle, CURLOPT_WRITEFUNCTION, url_range_write_cb);
+    curl_easy_setopt(c_handle, CURLOPT_WRITEDATA, &check);
+  }
+
+  if(!url_data->err) {
+    i = curl_easy_perform(c_handle);
+    if(!url_data->err) url_data->err = i;
+  }
+
+  if(check.segment) {
+    // we stopped it ourselves; get all ranges from the server that answered
+    if(curl_easy_getinfo(c_handle, CURLINFO_EFFECTIVE_URL, &url) == CURLE_OK && url) {
+      check.url = strdup(url);
+    }
+    curl_easy_cleanup(c_handle);
+    url_data->err = 0;
+    *url_data->curl_err_buf = 0;
+    url_read_segmented(url_data, &check);
+    free(check.url);
+  }
+  else {
+    url_read_done(url_data, c_handle);
+  }
+
+  signal(SIGPIPE, old_sigpipe);
+}
+
+
+/*
+ * Download several files concurrently.
+ *
+ * At most 'max' transfers are active at any time. If 'total' is set, its
+ * progress function is used to show the accumulated progress of all
+ * transfers. Else the progress functions of the individual entries are
+ * used one after the other, in list order.
+ */
+void url_read_multi(url_data_t **url_data, unsigned count, unsigned max, url_data_t *total)
+{
+  CURLM *m_handle;
+  CURL *c_handle;
+  CURLMsg *msg;
+  char *priv;
+  url_data_t *ud;
+  unsigned u, next = 0, active = 0, current = 0, current_shown = 0, aborted = 0;
+  int i, running, left;
+  int (**progress)(url_data_t *, int);
+  unsigned char *done;
+  sighandler_t old_sigpipe = signal(SIGPIPE, SIG_IGN);
+
+  if(!max) max = 1;
+
+  m_handle = curl_multi_init();
+
+  // progress is shown here, not by the transfers themselves
+  progress = calloc(count + 1, sizeof *progress);
+  done = calloc(count + 1, sizeof *done);
+  for(u = 0; u < count; u++) {
+    progress[u] = url_data[u]->progress;
+    url_data[u]->progress = NULL;
+  }
+
+  if(total && total->progress) total->progress(total, 0);
+
+  while(next < count || active) {
+    for(; active < max && next < count; next++) {
+      if(aborted && !url_data[next]->err) url_data[next]->err = 102;
+      c_handle = url_read_init(url_data[next]);
+      if(url_data[next]->err) {
+        url_read_done(url_data[next], c_handle);
+        done[next] = 1;
+      }
+      else {
+        curl_easy_setopt(c_handle, CURLOPT_PRIVATE, url_data[next]);
+        curl_multi_add_handle(m_handle, c_handle);
+        active++;
+      }
+    }
+
+    curl_multi_perform(m_handle, &running);
+
+    while((msg = curl_multi_info_read(m_handle, &left))) {
+      if(msg->msg != CURLMSG_DONE) continue;
+      c_handle = msg->easy_handle;
+      curl_easy_getinfo(c_handle, CURLINFO_PRIVATE, &priv);
+      ud = (url_data_t *) priv;
+      if(!ud->err) ud->err = msg->data.result;
+      curl_multi_remove_handle(m_handle, c_handle);
+      url_read_done(ud, c_handle);
+      for(u = 0; u < count; u++) if(url_data[u] == ud) done[u] = 1;
+      active--;
+    }
+
+    if(total) {
+      total->p_now = total->p_total = 0;
+      for(u = 0; u < next; u++) {
+        total->p_now += url_data[u]->p_now;
+        total->p_total += url_data[u]->p_total;
+        if(url_data[u]->err && !url_data[u]->optional && !total->err) {
+          total->err = url_data[u]->err;
+          memcpy(total->err_buf, url_data[u]->err_buf, total->err_buf_len);
+        }
+      }
+      if(total->progress && total->progress(total, 1)) aborted = 1;
+    }
+    else {
+      // show the first unfinished entry; entries after it may be done already
+      for(; current < count; current++, current_shown = 0) {
+        ud = url_data[current];
+        if(!progress[current]) continue;
+        if(!current_shown) {
+          progress[current](ud, 0);
+          current_shown = 1;
+        }
+        if(progress[current](ud, 1)) aborted = 1;
+        if(!done[current]) break;
+        progress[current](ud, 2);
+      }
+    }
+
+    if(aborted) {
+      // abort all active transfers
+      for(u = 0; u < next; u++) {
+        if(!url_data[u]->err) url_data[u]->err = 102;
+      }
+    }
+
+    if(active) curl_multi_wait(m_handle, NULL, 0, 1000, &i);
+  }
+
+  if(total && total->progress) total->progress(total, 2);
+
+  for(u = 0; u < count; u++) url_data[u]->progress = progress[u];
+
+  free(progress);
+  free(done);
+
+  curl_multi_cleanup(m_handle);
+
+  signal(SIGPIPE, old_sigpipe);
+}
+
+
+/*
+ * Create curl handle and set it up to download url_data->url.
+ *
+ * Check url_data->err for errors.
+ */
+CURL *url_read_init(url_data_t *url_data)
+{
+  CURL *c_handle;
+
   digest_init(url_data);
 
+  c_handle = url_curl_init(url_data);
+
+  curl_easy_setopt(c_handle, CURLOPT_WRITEFUNCTION, url_write_cb);
+  curl_easy_setopt(c_handle, CURLOPT_WRITEDATA, url_data);
+
+  curl_easy_setopt(c_handle, CURLOPT_PROGRESSFUNCTION, url_progress_cb);
+  curl_easy_setopt(c_handle, CURLOPT_PROGRESSDATA, url_data);
+  curl_easy_setopt(c_handle, CURLOPT_NOPROGRESS, 0);
+
+  if(url_data->progress) url_data->progress(url_data, 0);
+
+  return c_handle;
+}
+
+
+/*
+ * Create curl handle with our default settings for url_data->url.
+ *
+ * Set url_data->err if something went wrong.
+ */
+CURL *url_curl_init(url_data_t *url_data)
+{
+  CURL *c_handle;
+  char *proxy_url = NULL;
+  int i;
+
   c_handle = curl_easy_init();
   // log_info("curl handle = %p\n", c_handle);
 
   // curl_easy_setopt(c_handle, CURLOPT_VERBOSE, 1);
 
-  curl_easy_setopt(c_handle, CURLOPT_WRITEFUNCTION, url_write_cb);
-  curl_easy_setopt(c_handle, CURLOPT_WRITEDATA, url_data);
+  curl_easy_setopt(c_handle, CURLOPT_SHARE, url_curl_share());
+  // all handles for url_data share the list; curl reads it only when the transfer starts
+  if(!url_data->resolve) url_data->resolve = url_curl_resolve(url_data->url);
+  curl_easy_setopt(c_handle, CURLOPT_RESOLVE, url_data->resolve);
+  curl_easy_setopt(c_handle, CURLOPT_TCP_KEEPALIVE, 1L);
   curl_easy_setopt(c_handle, CURLOPT_ERRORBUFFER, url_data->curl_err_buf);
   curl_easy_setopt(c_handle, CURLOPT_FAILONERROR, 1);
   curl_easy_setopt(c_handle, CURLOPT_FOLLOWLOCATION, 1);
@@ -102,10 +406,6 @@ void url_read(url_data_t *url_data)
   curl_easy_setopt(c_handle, CURLOPT_SSL_VERIFYPEER, config.sslcerts ? 1 : 0);
   curl_easy_setopt(c_handle, CURLOPT_SSL_VERIFYHOST, config.sslcerts ? 2 : 0);
 
-  curl_easy_setopt(c_handle, CURLOPT_PROGRESSFUNCTION, url_progress_cb);
-  curl_easy_setopt(c_handle, CURLOPT_PROGRESSDATA, url_data);
-  curl_easy_setopt(c_handle, CURLOPT_NOPROGRESS, 0);
-
   if(config.net.ipv6 && !config.net.ipv4) {
     curl_easy_setopt(c_handle, CURLOPT_IPRESOLVE, CURL_IPRESOLVE_V6);
   }
@@ -116,9 +416,11 @@ void url_read(url_data_t *url_data)
     curl_easy_setopt(c_handle, CURLOPT_IPRESOLVE, CURL_IPRESOLVE_WHATEVER);
   }
 
-  url_data->err = curl_easy_setopt(c_handle, CURLOPT_URL, url_data->url->str);
+  // keep errors set by the caller (e.g. url_read_multi() after an abort)
+  i = curl_easy_setopt(c_handle, CURLOPT_URL, url_data->url->str);
+  if(!url_data->err) url_data->err = i;
 
-  if(config.debug >= 2) log_debug("curl opt url = %d (%s)\n", url_data->err, url_data->curl_err_buf);
+  if(config.debug >= 2) log_debug("curl opt url = %d (%s)\n", i, url_data->curl_err_buf);
   if(config.debug >= 2) log_debug("url_read(%s)\n", url_data->url->str);
 
   str_copy(&proxy_url, url_print(config.url.proxy, 1));
@@ -128,12 +430,20 @@ void url_read(url_data_t *url_data)
     if(config.debug >= 2) log_debug("proxy: %s\n", proxy_url);
   }
 
-  if(url_data->progress) url_data->progress(url_data, 0);
+  str_copy(&proxy_url, NULL);
 
-  if(!url_data->err) {
-    i = curl_easy_perform(c_handle);
-    if(!url_data->err) url_data->err = i;
-  }
+  return c_handle;
+}
+
+
+/*
+ * Finish download started with url_read_init() and free curl handle.
+ *
+ * url_data->err must already hold the transfer result.
+ */
+void url_read_done(url_data_t *url_data, CURL *c_handle)
+{
+  int i;
 
   if(!url_data->err) {
     url_data->flush = 1;
@@ -143,43 +453,24 @@ void url_read(url_data_t *url_data)
   if(config.debug >= 2) log_debug("curl perform = %d (%s)\n", url_data->err, url_data->curl_err_buf);
 
   if(url_data->f) {
-    i = url_data->pipe_fd >= 0 ? pclose(url_data->f) : fclose(url_data->f);
+    if(url_data->zstream && !url_data->err && zstream_finish(url_data->zstream)) {
+      url_data->err = 103;
+      snprintf(url_data->err_buf, url_data->err_buf_len, "%s", url_data->zstream->err);
+    }
+    i = fclose(url_data->f);
     url_data->f = NULL;
+    if(i && !url_data->err) url_data->err = 104;
+  }
 
-    if(url_data->pipe_fd >= 0) {
-      i = WIFEXITED(i) ? WEXITSTATUS(i) : 0;
-      if(i && i != 2) {
-        if(url_data->tmp_file) {
-          buf = malloc(url_data->err_buf_len);
-          f = fopen(url_data->tmp_file, "r");
-          i = fread(buf, 1, url_data->err_buf_len - 1, f);
-          fclose(f);
-          buf[i] = 0;
-          i = strlen(buf) - 1;
-          while(i > 0 && isspace(buf[i])) buf[i--] = 0;
-          s = buf;
-          while(isspace(*s)) s++;
-          if(!url_data->err) strcpy(url_data->err_buf, s);
-          free(buf);
-        }
-        url_data->err = 103;
-        snprintf(url_data->err_buf, url_data->err_buf_len, "%s: command terminated", url_data->compressed);
-      }
-      // log_info("close = %d\n", i);
-    }
-    else {
-      if(i && !url_data->err) url_data->err = 104;
-    }
+  if(url_data->zstream) {
+    url_data->zp_now = url_data->zstream->bytes_out;
+    url_data->zstream = zstream_free(url_data->zstream);
   }
 
   /* to get progress bar at 100% when uncompressing */
   url_data->flush = 0;
   url_write_cb(NULL, 0, 0, url_data);
 
-  if(url_data->pipe_fd >= 0) close(url_data->pipe_fd);
-
-  if(url_data->tmp_file) unlink(url_data->tmp_file);
-
   if(!*url_data->err_buf) {
     memcpy(url_data->err_buf, url_data->curl_err_buf, url_data->err_buf_len);
     *url_data->curl_err_buf = 0;
@@ -189,21 +480,352 @@ void url_read(url_data_t *url_data)
 
   curl_easy_cleanup(c_handle);
 
-  str_copy(&proxy_url, NULL);
+  if(!url_data->err) digest_finish(url_data);
+}
 
-  signal(SIGPIPE, old_sigpipe);
+
+/*
+ * Download url_data->url using several HTTP range requests in parallel.
+ *
+ * url_read() calls it once it knows the file size, the final url (after
+ * redirects) and that the server supports range requests. All ranges are
+ * requested from that url with an 'If-Range' header; anything but a 206
+ * response for exactly the requested range is an error.
+ *
+ * The segments are written directly to their final position in the
+ * destination file; digest_process() gets the data in file order.
+ *
+ * Compressed files that must be unpacked are not handled here.
+ *
+ * Check url_data->err for errors.
+ */
+void url_read_segmented(url_data_t *url_data, url_range_check_t *check)
+{
+  CURLM *m_handle;
+  CURL *c_handle;
+  CURLMsg *msg;
+  url_segments_t *segs;
+  url_segment_t *seg;
+  uint64_t seg_size, size = check->size;
+  unsigned u, count;
+  int i, running, left, active;
+  char *priv, range[64];
+  struct curl_slist *headers;
+
+  for(count = url_data->segments; count > 2 && size / count < URL_SEGMENT_MIN; count--);
+
+  log_info("%s: loading %"PRIu64" bytes in %u segments\n", url_print(url_data->url, 0), size, count);
+
+  segs = calloc(1, sizeof *segs + count * sizeof *segs->seg);
+  segs->url_data = url_data;
+  segs->size = size;
+  segs->count = count;
+
+  segs->fd = open(url_data->file_name, O_LARGEFILE | O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if(segs->fd < 0) {
+    url_data->err = 101;
+    snprintf(url_data->err_buf, url_data->err_buf_len, "open: %s: %s", url_data->file_name, strerror(errno));
+    free(segs);
+    if(url_data->progress) url_data->progress(url_data, 2);
+
+    return;
+  }
+
+  if((i = posix_fallocate(segs->fd, 0, size)) == ENOSPC) {
+    url_data->err = 101;
+    snprintf(url_data->err_buf, url_data->err_buf_len, "%s: %s", url_data->file_name, strerror(i));
+  }
+
+  digest_init(url_data);
+
+  url_data->p_total = size;
+
+  if(!check->url) {
+    url_data->err = 105;
+    snprintf(url_data->err_buf, url_data->err_buf_len, "no effective url");
+  }
+
+  headers = curl_slist_append(NULL, check->if_range);
+
+  m_handle = curl_multi_init();
+
+  seg_size = size / count;
+
+  for(u = 0; u < count && !url_data->err; u++) {
+    seg = segs->seg + u;
+    seg->all = segs;
+    seg->pos = seg->start = u * seg_size;
+    seg->end = u == count - 1 ? size : seg->start + seg_size;
+
+    c_handle = url_curl_init(url_data);
+    // no redirects: all ranges must come from the same server
+    curl_easy_setopt(c_handle, CURLOPT_URL, check->url);
+    curl_easy_setopt(c_handle, CURLOPT_FOLLOWLOCATION, 0);
+    curl_easy_setopt(c_handle, CURLOPT_HTTPHEADER, headers);
+    snprintf(range, sizeof range, "%"PRIu64"-%"PRIu64, seg->start, seg->end - 1);
+    curl_easy_setopt(c_handle, CURLOPT_RANGE, range);
+    curl_easy_setopt(c_handle, CURLOPT_HEADERFUNCTION, url_segment_header_cb);
+    curl_easy_setopt(c_handle, CURLOPT_HEADERDATA, seg);
+    curl_easy_setopt(c_handle, CURLOPT_WRITEFUNCTION, url_segment_write_cb);
+    curl_easy_setopt(c_handle, CURLOPT_WRITEDATA, seg);
+    curl_easy_setopt(c_handle, CURLOPT_PRIVATE, seg);
+    curl_multi_add_handle(m_handle, c_handle);
+  }
+
+  for(active = u; active;) {
+    curl_multi_perform(m_handle, &running);
+
+    while((msg = curl_multi_info_read(m_handle, &left))) {
+      if(msg->msg != CURLMSG_DONE) continue;
+      c_handle = msg->easy_handle;
+      curl_easy_getinfo(c_handle, CURLINFO_PRIVATE, &priv);
+      seg = (url_segment_t *) priv;
+      if(!url_data->err) {
+        url_data->err = msg->data.result;
+        if(!url_data->err && seg->pos != seg->end) {
+          url_data->err = 105;
+          snprintf(url_data->err_buf, url_data->err_buf_len, "range %"PRIu64"-%"PRIu64": incomplete", seg->start, seg->end - 1);
+        }
+      }
+      curl_multi_remove_handle(m_handle, c_handle);
+      curl_easy_cleanup(c_handle);
+      active--;
+    }
+
+    if(url_data->progress && url_data->progress(url_data, 1) && !url_data->err) url_data->err = 102;
+
+    if(active) curl_multi_wait(m_handle, NULL, 0, 1000, &i);
+  }
+
+  curl_multi_cleanup(m_handle);
+
+  curl_slist_free_all(headers);
+
+  if(!url_data->err) {
+    url_segment_digest(segs);
+    if(segs->digest_pos != size && !url_data->err) url_data->err = 104;
+  }
+
+  if(close(segs->fd) && !url_data->err) url_data->err = 104;
+
+  free(segs);
+
+  if(!*url_data->err_buf) {
+    memcpy(url_data->err_buf, url_data->curl_err_buf, url_data->err_buf_len);
+    *url_data->curl_err_buf = 0;
+  }
+
+  if(url_data->progress) url_data->progress(url_data, 2);
 
   if(!url_data->err) digest_finish(url_data);
 }
 
 
+/*
+ * Header callback for url_read(): note the file size and whether the
+ * server accepts range requests.
+ */
+size_t url_range_header_cb(void *buffer, size_t size, size_t nmemb, void *userp)
+{
+  url_range_check_t *check = userp;
+  size_t len = size * nmemb;
+  unsigned code;
+  char buf[256], *p;
+
+  if(len >= sizeof buf) return len;
+
+  memcpy(buf, buffer, len);
+  buf[len] = 0;
+
+  // strip line end
+  for(p = buf + len; p > buf && (p[-1] == '\n' || p[-1] == '\r'); *--p = 0);
+
+  // new response (e.g. after a redirect)
+  if(!strncmp(buf, "HTTP/", sizeof "HTTP/" - 1)) {
+    check->size = 0;
+    check->ranges = 0;
+    *check->if_range = *check->last_modified = 0;
+    check->ok = sscanf(buf, "HTTP/%*s %u", &code) == 1 && code == 200;
+  }
+  // weak ETags can't be used with If-Range
+  else if(!strncasecmp(buf, "ETag:", sizeof "ETag:" - 1)) {
+    p = buf + sizeof "ETag:" - 1;
+    while(*p == ' ' || *p == '\t') p++;
+    if(*p == '"') snprintf(check->if_range, sizeof check->if_range, "If-Range: %s", p);
+  }
+  else if(!strncasecmp(buf, "Last-Modified:", sizeof "Last-Modified:" - 1)) {
+    p = buf + sizeof "Last-Modified:" - 1;
+    while(*p == ' ' || *p == '\t') p++;
+    snprintf(check->last_modified, sizeof check->last_modified, "%s", p);
+  }
+  else if(!strncasecmp(buf, "Content-Length:", sizeof "Content-Length:" - 1)) {
+    if(sscanf(buf + sizeof "Content-Length:" - 1, " %"SCNu64, &check->size) != 1) {
+      check->size = 0;
+    }
+  }
+  else if(!strncasecmp(buf, "Accept-Ranges:", sizeof "Accept-Ranges:" - 1)) {
+    check->ranges = strstr(buf, "bytes") ? 1 : 0;
+  }
+
+  return len;
+}
+
+
+/*
+ * Write callback for url_read() if a segmented download is possible.
+ *
+ * With the first data, decide: if the file is big enough and the server
+ * accepts range requests, stop the transfer (url_read() continues with
+ * url_read_segmented()). Else pass everything on to url_write_cb().
+ */
+size_t url_range_write_cb(void *buffer, size_t size, size_t nmemb, void *userp)
+{
+  url_range_check_t *check = userp;
+  size_t len = size * nmemb;
+
+  if(!check->done) {
+    check->done = 1;
+    if(!*check->if_range && *check->last_modified) {
+      snprintf(check->if_range, sizeof check->if_range, "If-Range: %s", check->last_modified);
+    }
+    check->segment =
+      check->ok &&
+      check->ranges &&
+      // we must be able to pin the file version
+      *check->if_range &&
+      check->size / 2 >= URL_SEGMENT_MIN &&
+      // we would have to uncompress it on the fly
+      !(check->url_data->unzip && (len < 6 || compress_type(buffer)));
+    if(check->segment) {
+      if(config.debug >= 2) log_debug("range requests possible, size %"PRIu64"\n", check->size);
+
+      return 0;
+    }
+  }
+
+  return url_write_cb(buffer, size, nmemb, check->url_data);
+}
+
+
+/*
+ * Header callback for url_read_segmented(): check that we get exactly the
+ * range we asked for.
+ */
+size_t url_segment_header_cb(void *buffer, size_t size, size_t nmemb, void *userp)
+{
+  url_segment_t *seg = userp;
+  size_t len = size * nmemb;
+  uint64_t start, end, total;
+  char buf[256];
+
+  if(len >= sizeof buf) return len;
+
+  memcpy(buf, buffer, len);
+  buf[len] = 0;
+
+  if(!strncmp(buf, "HTTP/", sizeof "HTTP/" - 1)) {
+    seg->range_ok = 0;
+    if(sscanf(buf, "HTTP/%*s %u", &seg->code) != 1) seg->code = 0;
+  }
+  else if(!strncasecmp(buf, "Content-Range:", sizeof "Content-Range:" - 1)) {
+    seg->range_ok =
+      sscanf(buf + sizeof "Content-Range:" - 1, " bytes %"SCNu64"-%"SCNu64"/%"SCNu64, &start, &end, &total) == 3 &&
+      start == seg->start &&
+      end == seg->end - 1 &&
+      total == seg->all->size;
+  }
+
+  return len;
+}
+
+
+size_t url_segment_write_cb(void *buffer, size_t size, size_t nmemb, void *userp)
+{
+  url_segment_t *seg = userp;
+  url_data_t *url_data = seg->all->url_data;
+  size_t len = size * nmemb;
+  ssize_t i;
+  unsigned char *buf = buffer;
+
+  if(url_data->err) return 0;
+
+  // e.g. 200 with the full (possibly changed) file if If-Range didn't match
+  if(seg->code != 206 || !seg->range_ok) {
+    url_data->err = 105;
+    snprintf(url_data->err_buf, url_data->err_buf_len, "range %"PRIu64"-%"PRIu64": unexpected response (status %u)", seg->start, seg->end - 1, seg->code);
+
+    return 0;
+  }
+
+  if(seg->pos + len > seg->end) {
+    url_data->err = 105;
+    snprintf(url_data->err_buf, url_data->err_buf_len, "range %"PRIu64"-%"PRIu64": too much data", seg->start, seg->end - 1);
+
+    return 0;
+  }
+
+  while(len) {
+    i = pwrite(seg->all->fd, buf, len, seg->pos);
+    if(i <= 0) {
+      if(i < 0 && errno == EINTR) continue;
+      url_data->err = 101;
+      snprintf(url_data->err_buf, url_data->err_buf_len, "write: %s: %s", url_data->file_name, strerror(errno));
+
+      return 0;
+    }
+    buf += i;
+    len -= i;
+    seg->pos += i;
+    url_data->p_now += i;
+  }
+
+  url_segment_digest(seg->all);
+
+  return size * nmemb;
+}
+
+
+/*
+ * Pass all data that are available in file order to digest_process().
+ */
+void url_segment_digest(url_segments_t *segs)
+{
+  url_segment_t *seg;
+  unsigned char buf[1 << 16];
+  unsigned u;
+  ssize_t len;
+
+  for(u = 0; u < segs->count; u++) {
+    seg = segs->seg + u;
+    if(segs->digest_pos >= seg->end) continue;
+
+    while(segs->digest_pos < seg->pos) {
+      len = seg->pos - segs->digest_pos;
+      if(len > sizeof buf) len = sizeof buf;
+      len = pread(segs->fd, buf, len, segs->digest_pos);
+      if(len <= 0) {
+        if(!segs->url_data->err) {
+          segs->url_data->err = 104;
+          snprintf(segs->url_data->err_buf, segs->url_data->err_buf_len, "read: %s: %s", segs->url_data->file_name, strerror(errno));
+        }
+
+        return;
+      }
+      digest_process(segs->url_data, buf, len);
+      segs->digest_pos += len;
+    }
+
+    if(seg->pos < seg->end) break;
+  }
+}
+
+
 size_t url_write_cb(void *buffer, size_t size, size_t nmemb, void *userp)
 {
   url_data_t *url_data = userp;
   size_t z1, z2;
-  int i, fd, fd1, fd2, tmp;
+  int i;
   struct cramfs_super_block *cramfs_sb;
-  off_t off;
 
   z1 = size * nmemb;
 
@@ -261,53 +883,20 @@ size_t url_write_cb(void *buffer, size_t size, size_t nmemb, void *userp)
   if(url_data->buf.len == url_data->buf.max || url_data->flush) {
     if(!url_data->file_opened) {
       url_data->file_opened = 1;
-      if(url_data->compressed) {
-        url_data->tmp_file = strdup("/tmp/foo_XXXXXX");
-        tmp = mkstemp(url_data->tmp_file);
-        if(tmp > 0) {
-          fd = open(url_data->file_name, O_LARGEFILE | O_WRONLY | O_CREAT | O_TRUNC, 0644);
-          if(fd >= 0) {
-            fd1 = dup(1);
-            fd2 = dup(2);
-            dup2(fd, 1);
-            dup2(tmp, 2);
-            url_data->pipe_fd = fd;
-            char cmd[64];
-            snprintf(cmd, sizeof cmd, "%s -dc", url_data->compressed);
-            url_data->f = popen(cmd, "w");
-            dup2(fd1, 1);
-            dup2(fd2, 2);
-            url_data->zp_total = url_data->image_size << 10;
-          }
-          else {
-            url_data->err = 101;
-            snprintf(url_data->err_buf, url_data->err_buf_len, "open: %s: %s", url_data->file_name, strerror(errno));
-          }
-          close(tmp);
-        }
-        else {
-          url_data->err = 1;
-          snprintf(url_data->err_buf, url_data->err_buf_len, "mkstemp: %s", strerror(errno));
-        }
+      url_data->f = fopen(url_data->file_name, "w");
+      if(!url_data->f) {
+        url_data->err = 101;
+        snprintf(url_data->err_buf, url_data->err_buf_len, "open: %s: %s", url_data->file_name, strerror(errno));
       }
-      else {
-        url_data->f = fopen(url_data->file_name, "w");
-        if(!url_data->f) {
-          url_data->err = 101;
-          snprintf(url_data->err_buf, url_data->err_buf_len, "open: %s: %s", url_data->file_name, strerror(errno));
-        }
+      else if(url_data->compressed) {
+        url_data->zstream = zstream_new(url_data->compressed, url_unzip_write, url_data);
+        url_data->zp_total = url_data->image_size << 10;
       }
     }
 
-    if(url_data->f && url_data->buf.len) {
-      fwrite(url_data->buf.data, url_data->buf.len, 1, url_data->f);
-      url_data->p_now += url_data->buf.len;
-    }
+    if(url_data->f && url_data->buf.len) url_write_data(url_data, url_data->buf.data, url_data->buf.len);
 
-    if(url_data->f && z1) {
-      fwrite(buffer, z1, 1, url_data->f);
-      url_data->p_now += z1;
-    }
+    if(url_data->f && z1) url_write_data(url_data, buffer, z1);
 
     if(url_data->buf.max) {
       url_data->buf.len = url_data->buf.max = 0;
@@ -316,11 +905,6 @@ size_t url_write_cb(void *buffer, size_t size, size_t nmemb, void *userp)
     }
   }
 
-  if(url_data->pipe_fd >= 0) {
-    off = lseek(url_data->pipe_fd, 0, SEEK_CUR);
-    if(off != -1) url_data->zp_now = off;
-  }
-
   if(url_data->p_total || url_data->zp_total) {
     if(url_data->progress) {
       if(url_data->progress(url_data, 1) && !url_data->err) url_data->err = 102;
@@ -331,6 +915,37 @@ size_t url_write_cb(void *buffer, size_t size, size_t nmemb, void *userp)
 }
 
 
+/*
+ * Write downloaded data to file, uncompressing it if necessary.
+ */
+void url_write_data(url_data_t *url_data, void *buffer, size_t len)
+{
+  if(url_data->zstream) {
+    if(zstream_write(url_data->zstream, buffer, len) && !url_data->err) {
+      url_data->err = 103;
+      snprintf(url_data->err_buf, url_data->err_buf_len, "%s", url_data->zstream->err);
+    }
+    url_data->zp_now = url_data->zstream->bytes_out;
+  }
+  else {
+    fwrite(buffer, len, 1, url_data->f);
+  }
+
+  url_data->p_now += len;
+}
+
+
+/*
+ * Output function for zstream_write().
+ */
+int url_unzip_write(void *data, void *buffer, size_t len)
+{
+  url_data_t *url_data = data;
+
+  return fwrite(buffer, len, 1, url_data->f) == 1 ? 0 : 1;
+}
+
+
 int url_progress_cb(void *clientp, double dltotal, double dlnow, double ultotal, double ulnow)
 {
   url_data_t *url_data = clientp;
@@ -879,6 +1494,94 @@ url_t *url_free(url_t *url)
 }
 
 
+// shared DNS cache, TLS sessions and connections for all curl handles
+static CURLSH *url_share;
+
+/*
+ * Get share handle so consecutive downloads reuse DNS lookups, TLS
+ * sessions and open connections (curl looks them up by scheme, host,
+ * port and proxy).
+ *
+ * Note: we're single-threaded (parallel downloads use a multi handle), so
+ * no locking functions are needed.
+ */
+CURLSH *url_curl_share()
+{
+  if(!url_share) {
+    url_share = curl_share_init();
+    curl_share_setopt(url_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(url_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900
+    curl_share_setopt(url_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+  }
+
+  return url_share;
+}
+
+
+/*
+ * Resolve url->server with our own dns cache and build a list to pass to
+ * curl via CURLOPT_RESOLVE.
+ *
+ * So each host name is looked up only once (per dns cache lifetime), no
+ * matter whether curl or linuxrc needs it. The entry holds all addresses
+ * of the host, so curl can still try the next one if one is down.
+ *
+ * curl keeps CURLOPT_RESOLVE entries in the shared dns cache forever, so
+ * build the list for every new url_data from the current dns cache entry
+ * and drop the old address if the name doesn't resolve any longer.
+ *
+ * Return list for CURLOPT_RESOLVE (free it with curl_slist_free_all()).
+ */
+struct curl_slist *url_curl_resolve(url_t *url)
+{
+  struct curl_slist *sl;
+  char *entry = NULL, *addr;
+  unsigned port = url->port;
+
+  // with a proxy, curl doesn't resolve the server name anyway
+  if(!url->server || (config.url.proxy && config.url.proxy->server)) return NULL;
+
+  if(!port) {
+    switch(url->scheme) {
+      case inst_http:
+        port = 80;
+        break;
+
+      case inst_https:
+        port = 443;
+        break;
+
+      case inst_ftp:
+        port = 21;
+        break;
+
+      case inst_tftp:
+        port = 69;
+        break;
+
+      default:
+        return NULL;
+    }
+  }
+
+  if((addr = net_resolve(url->server))) {
+    strprintf(&entry, "%s:%u:%s", url->server, port, addr);
+  }
+  else {
+    strprintf(&entry, "-%s:%u", url->server, port);
+  }
+
+  sl = curl_slist_append(NULL, entry);
+  log_debug("curl resolve: %s\n", entry);
+
+  free(entry);
+
+  return sl;
+}
+
+
 url_data_t *url_data_new()
 {
   static int curl_init = 0;
@@ -892,7 +1595,6 @@ url_data_t *url_data_new()
   url_data->buf.data = malloc(url_data->buf.max = 256);
   url_data->buf.len = 0;
 
-  url_data->pipe_fd = -1;
   url_data->percent = -1;
 
   if(!curl_init) {
@@ -913,17 +1615,28 @@ void url_data_free(url_data_t *url_data)
   free(url_data->err_buf);
   free(url_data->curl_err_buf);
   free(url_data->orig_name);
-  free(url_data->tmp_file);
   free(url_data->buf.data);
   free(url_data->label);
   free(url_data->compressed);
 
+  zstream_free(url_data->zstream);
+
+  digest_thread_stop(url_data);
+
+  curl_slist_free_all(url_data->resolve);
+
   free(url_data);
 }
 
 
 void url_cleanup()
 {
+  // all easy handles are gone by now, so this closes cached connections
+  if(url_share) {
+    curl_share_cleanup(url_share);
+    url_share = NULL;
+  }
+
   curl_global_cleanup();
 }
 
@@ -1430,13 +2143,13 @@ int url_mount_disk(url_t *url, char *dir, int (*test_func)(url_t *))
  * *** Note: inverse return value compared to url_mount_disk(). ***
  */
 int url_mount(url_t *url, char *dir, int (*test_func)(url_t *))
-{
-  int err = 0, ok, found, matched;
-  hd_t *hd;
-  hd_res_t *res;
+{
+  int err = 0, ok, found;
+  hd_t *hd, *hd0;
   char *hwaddr;
   hd_hw_item_t hw_item = hw_network_ctrl;
-  str_list_t *sl;
+  url_devprobe_t *probe;
+  slist_t *sl_probe, *race;
   char *url_device;
 
   if(!url || !url->scheme) return 1;
@@ -1469,33 +2182,20 @@ int url_mount(url_t *url, char *dir, int (*test_func)(url_t *))
   url_device = url->device;
   if(!url_device) url_device = url->is.network ? config.ifcfg.manual->device : config.device;
 
-  for(found = 0, hd = sort_a_bit(fix_device_names(hd_list(config.hd_data, hw_item, 0, NULL))); hd; hd = hd->next) {
-    for(hwaddr = NULL, res = hd->res; res; res = res->next) {
-      if(res->any.type == res_hwaddr) {
-        hwaddr = res->hwaddr.addr;
-        break;
-      }
-    }
+  hd0 = sort_a_bit(fix_device_names(hd_list(config.hd_data, hw_item, 0, NULL)));
 
-    if(
-      (	/* hd: neither floppy nor cdrom */
-        url->scheme == inst_hd &&
-        (
-          hd_is_hw_class(hd, hw_floppy) ||
-          hd_is_hw_class(hd, hw_cdrom)
-        )
-      ) ||
-      (hd_is_hw_class(hd, hw_block) && hd->child_ids && hd->child_ids->next) ||	/* skip whole block device if it has > 1 partition */
-      !hd->unix_dev_name
-    ) continue;
+  probe = url_probe_devices(url, hd0, url_device);
 
-    matched = url_device ? match_netdevice(short_dev(hd->unix_dev_name), hwaddr, url_device) : 1;
+  race = url_race_setup(url, hd0, url_device);
 
-    for(sl = hd->unix_dev_names; !matched && sl; sl = sl->next) {
-      matched = match_netdevice(short_dev(sl->str), NULL, url_device);
-    }
+  for(found = 0, hd = hd0; hd; hd = hd->next) {
+    if(!url_mount_candidate(url, hd, url_device, &hwaddr)) continue;
 
-    if(!matched) continue;
+    if((sl_probe = url_probe_result(probe, hd->unix_dev_name)) && !sl_probe->value) {
+      log_info("url mount: %s: swap, skipped\n", hd->unix_dev_name);
+      err = 1;
+      continue;
+    }
 
     str_copy(&url->used.unique_id, hd->unique_id);
     str_copy(&url->used.device, hd->unix_dev_name);
@@ -1510,6 +2210,8 @@ int url_mount(url_t *url, char *dir, int (*test_func)(url_t *))
 
     if(hd->is.wlan) util_set_wlan(hd->unix_dev_name);
 
+    if(url_race_next(&race, hd->unix_dev_name)) continue;
+
     if((ok = url_mount_disk(url, dir, test_func))) {
       found++;
       if(hd_is_hw_class(hd, hw_cdrom)) url->is.cdrom = 1;
@@ -1520,6 +2222,8 @@ int url_mount(url_t *url, char *dir, int (*test_func)(url_t *))
     }
   }
 
+  url_race_next(&race, NULL);
+
   /*
    * should not happen, but anyway: device name was not in our list
    *
@@ -1542,10 +2246,320 @@ int url_mount(url_t *url, char *dir, int (*test_func)(url_t *))
     str_copy(&url->used.unique_id, NULL);
   }
 
+  url_probe_done(probe);
+
   return found ? 0 : 1;
 }
 
 
+/*
+ * Check if 'hd' is a device url_mount() should try.
+ *
+ * Sets *hwaddr to the hardware address of 'hd' (or NULL).
+ */
+int url_mount_candidate(url_t *url, hd_t *hd, char *url_device, char **hwaddr)
+{
+  hd_res_t *res;
+  str_list_t *sl;
+  int matched;
+
+  for(*hwaddr = NULL, res = hd->res; res; res = res->next) {
+    if(res->any.type == res_hwaddr) {
+      *hwaddr = res->hwaddr.addr;
+      break;
+    }
+  }
+
+  if(
+    (	/* hd: neither floppy nor cdrom */
+      url->scheme == inst_hd &&
+      (
+        hd_is_hw_class(hd, hw_floppy) ||
+        hd_is_hw_class(hd, hw_cdrom)
+      )
+    ) ||
+    (hd_is_hw_class(hd, hw_block) && hd->child_ids && hd->child_ids->next) ||	/* skip whole block device if it has > 1 partition */
+    !hd->unix_dev_name
+  ) return 0;
+
+  matched = url_device ? match_netdevice(short_dev(hd->unix_dev_name), *hwaddr, url_device) : 1;
+
+  for(sl = hd->unix_dev_names; !matched && sl; sl = sl->next) {
+    matched = match_netdevice(short_dev(sl->str), NULL, url_device);
+  }
+
+  return matched;
+}
+
+
+/*
+ * Start identifying the file systems on all candidate devices for
+ * url_mount() concurrently.
+ *
+ * The threads go through the devices in url_mount() order, so the first
+ * device can be mounted as soon as it has been identified, while the
+ * others are still being checked. Use url_probe_result() to get the
+ * result for a device and url_probe_done() to stop.
+ *
+ * Return NULL if nothing is done. That's the case for network devices,
+ * devices that don't have to be mounted, and if there's just one candidate.
+ */
+url_devprobe_t *url_probe_devices(url_t *url, hd_t *hd_list, char *url_device)
+{
+  url_devprobe_t *probe;
+  slist_t *sl, *sl0 = NULL;
+  unsigned u, count = 0;
+  hd_t *hd;
+  char *hwaddr;
+
+  if(
+    url->is.network ||
+    !url->is.mountable ||
+    url->scheme == inst_file ||
+    url->scheme >= inst_extern ||
+    !url->path ||
+    !strcmp(url->path, "/")
+  ) return NULL;
+
+  for(hd = hd_list; hd; hd = hd->next) {
+    if(
+      url_mount_candidate(url, hd, url_device, &hwaddr) &&
+      !slist_getentry(sl0, hd->unix_dev_name)
+    ) {
+      slist_append_str(&sl0, hd->unix_dev_name);
+      count++;
+    }
+  }
+
+  if(count < 2) {
+    slist_free(sl0);
+
+    return NULL;
+  }
+
+  probe = calloc(1, sizeof *probe);
+  probe->list = sl0;
+  probe->count = count;
+  probe->dev = calloc(count, sizeof *probe->dev);
+  probe->done = calloc(count, sizeof *probe->done);
+  for(u = 0, sl = sl0; sl; sl = sl->next) probe->dev[u++] = sl;
+
+  pthread_mutex_init(&probe->mutex, NULL);
+  pthread_cond_init(&probe->cond, NULL);
+
+  for(u = 0; u < count && u < URL_PROBE_THREADS; u++) {
+    if(pthread_create(probe->threads + u, NULL, url_probe_thread, probe)) break;
+  }
+  probe->threads_cnt = u;
+
+  return probe;
+}
+
+
+/*
+ * Wait until 'device' has been identified by url_probe_devices().
+ *
+ * Return its entry (value is the fs type, 'unknown' if it couldn't be
+ * identified, or NULL for swap devices). NULL if 'device' has not been
+ * checked.
+ */
+slist_t *url_probe_result(url_devprobe_t *probe, char *device)
+{
+  slist_t *sl = NULL;
+  unsigned u;
+
+  if(!probe || !probe->threads_cnt) return NULL;
+
+  for(u = 0; u < probe->count; u++) {
+    if(!strcmp(probe->dev[u]->key, device)) break;
+  }
+
+  if(u == probe->count) return NULL;
+
+  pthread_mutex_lock(&probe->mutex);
+  while(!probe->done[u]) pthread_cond_wait(&probe->cond, &probe->mutex);
+  pthread_mutex_unlock(&probe->mutex);
+
+  sl = probe->dev[u];
+
+  log_info("url mount: %s: type = %s\n", sl->key, sl->value ?: "swap");
+
+  return sl;
+}
+
+
+/*
+ * Stop url_probe_devices() threads and free 'probe'.
+ *
+ * Devices that are not being checked yet are dropped.
+ */
+void url_probe_done(url_devprobe_t *probe)
+{
+  unsigned u;
+
+  if(!probe) return;
+
+  pthread_mutex_lock(&probe->mutex);
+  probe->next = probe->count;
+  pthread_mutex_unlock(&probe->mutex);
+
+  for(u = 0; u < probe->threads_cnt; u++) pthread_join(probe->threads[u], NULL);
+
+  pthread_cond_destroy(&probe->cond);
+  pthread_mutex_destroy(&probe->mutex);
+  free(probe->dev);
+  free(probe->done);
+  slist_free(probe->list);
+  free(probe);
+}
+
+
+/*
+ * Worker thread for url_probe_devices().
+ */
+void *url_probe_thread(void *arg)
+{
+  url_devprobe_t *probe = arg;
+  slist_t *sl;
+  unsigned u;
+  char *type;
+
+  for(;;) {
+    pthread_mutex_lock(&probe->mutex);
+    u = probe->next < probe->count ? probe->next++ : probe->count;
+    pthread_mutex_unlock(&probe->mutex);
+
+    if(u == probe->count) break;
+
+    sl = probe->dev[u];
+
+    // the result ends up in the probe cache, so url_mount_disk() gets it for free
+    type = util_fstype(sl->key, NULL);
+
+    // unknown types are left to url_mount_disk(), only swap is surely useless
+    if(!type || strcmp(type, "swap")) sl->value = strdup(type ?: "unknown");
+
+    pthread_mutex_lock(&probe->mutex);
+    probe->done[u] = 1;
+    pthread_cond_broadcast(&probe->cond);
+    pthread_mutex_unlock(&probe->mutex);
+  }
+
+  return NULL;
+}
+
+
+/*
+ * Bring up all candidate network interfaces for 'url' at once (see
+ * net_dhcp_race()) instead of trying them one after another.
+ *
+ * Only done if no interface is up, dhcp is used, and there is more than one
+ * card with link.
+ *
+ * Return list of interfaces that took part (key); value is set for those
+ * that are up. NULL if there was no race or nobody won it.
+ */
+slist_t *url_race_setup(url_t *url, hd_t *hd_list, char *url_device)
+{
+  slist_t *devices = NULL, *up, *sl;
+  hd_t *hd;
+  char *hwaddr;
+
+  if(
+    !config.net.race ||
+    !url->is.network ||
+    config.ifcfg.if_up ||
+    !config.ifcfg.manual->dhcp ||
+    config.ifcfg.manual->vlan ||
+    (config.net.do_setup & DS_SETUP)
+  ) return NULL;
+
+  for(hd = hd_list; hd; hd = hd->next) {
+    if(
+      !hd->is.wlan &&
+      link_detected(hd) &&
+      url_mount_candidate(url, hd, url_device, &hwaddr) &&
+      strncmp(hd->unix_dev_name, "lo", sizeof "lo" - 1) &&
+      !check_ptp(hd->unix_dev_name)
+    ) {
+      slist_append_str(&devices, hd->unix_dev_name);
+    }
+  }
+
+  if(!devices || !devices->next) {
+    slist_free(devices);
+
+    return NULL;
+  }
+
+  up = net_dhcp_race(devices);
+
+  if(!up) return slist_free(devices);
+
+  for(sl = devices; sl; sl = sl->next) {
+    if(slist_getentry(up, sl->key)) str_copy(&sl->value, "up");
+  }
+
+  slist_free(up);
+
+  return devices;
+}
+
+
+/*
+ * Prepare 'device' for use while going through the interfaces from
+ * url_race_setup().
+ *
+ * If 'device' won the race, shut down the other winners (so the repo test
+ * can't succeed through them) and use it; the others drop out of the race
+ * and get the normal interface setup later. If 'device' lost, skip it - it
+ * already had its chance to get a dhcp answer. Else ('device' didn't take
+ * part) shut down all interfaces from the race as we're going to do the
+ * normal interface setup. Pass NULL as 'device' when done.
+ *
+ * Return 1 if 'device' should be skipped.
+ */
+int url_race_next(slist_t **race, char *device)
+{
+  slist_t *sl, *up = NULL;
+
+  if(!*race) return 0;
+
+  if(device && (sl = slist_getentry(*race, device))) {
+    if(!sl->value) {
+      log_info("%s: no dhcp answer, skipped\n", device);
+
+      return 1;
+    }
+
+    for(sl = *race; sl; sl = sl->next) {
+      if(sl->value && strcmp(sl->key, device)) slist_append_str(&up, sl->key);
+    }
+
+    net_dhcp_race_end(up, NULL);
+
+    for(sl = up; sl; sl = sl->next) slist_free_entry(race, sl->key);
+
+    slist_free(up);
+
+    net_dhcp_race_use(device);
+
+    return 0;
+  }
+
+  for(sl = *race; sl; sl = sl->next) {
+    if(sl->value) slist_append_str(&up, sl->key);
+  }
+
+  net_dhcp_race_end(up, device ? NULL : config.ifcfg.current);
+
+  slist_free(up);
+  *race = slist_free(*race);
+
+  return 0;
+}
+
+
 /*
  * Warn if signature check failed and ask user what to do.
  *
@@ -1775,8 +2789,8 @@ int is_signed(char *file, int check)
  */
 int url_read_file(url_t *url, char *dir, char *src, char *dst, char *label, unsigned flags)
 {
-  int err, gpg;
-  char *src_sig = NULL, *dst_sig = NULL, *buf = NULL, *old_path = NULL, *s;
+  int err;
+  char *src_sig = NULL, *dst_sig = NULL, *old_path = NULL;
 
   str_copy(&old_path, url->path);
 
@@ -1793,74 +2807,212 @@ int url_read_file(url_t *url, char *dir, char *src, char *dst, char *label, unsi
   err = url_read_file_nosig(url, dir, src, dst, label, flags);
   str_copy(&url->path, old_path);
 
-  if(err) {
+  if(!err) err = url_sig_embedded(dst);
+
+  if(err != 2) {
     free(old_path);
     return err;
   }
 
+  if(!(src || (url && url->path)) || !dst) {
+    free(old_path);
+    return 0;
+  }
+
+  if(src) {
+    strprintf(&src_sig, "%s.asc", src);
+  }
+  else {
+    strprintf(&url->path, "%s.asc", old_path);
+  }
+  strprintf(&dst_sig, "%s.asc", dst);
+
+  err = url_read_file_nosig(url, dir, src_sig, dst_sig, NULL, flags);
+  str_copy(&url->path, old_path);
+
+  err = url_sig_detached(url_print2(url, src), dst, err);
+
+  free(dst_sig);
+  free(src_sig);
+  free(old_path);
+
+  return err;
+}
+
+
+/*
+ * Check signature of downloaded file 'dst'.
+ *
+ * Sets config.sig_failed.
+ *
+ * return:
+ *   0: ok
+ *   1: failed
+ *   2: no embedded signature; check detached signature with url_sig_detached()
+ */
+int url_sig_embedded(char *dst)
+{
+  int gpg;
+
   config.sig_failed = 0;
 
   if(!config.secure) {
     is_signed(dst, 0);
-    free(old_path);
-    return err;
+    return 0;
   }
 
   gpg = is_signed(dst, 1);
 
-  if(gpg != 2) {
-    free(old_path);
-    return gpg ? 1 : 0;
-  }
+  if(gpg != 2) return gpg ? 1 : 0;
 
   config.sig_failed = 1;
 
-  if(!(src || (url && url->path)) || !dst) {
-    free(old_path);
-    return err;
-  }
+  return 2;
+}
 
-  if(src) {
-    strprintf(&src_sig, "%s.asc", src);
+
+/*
+ * Verify 'dst' using detached signature 'dst'.asc.
+ *
+ * 'sig_err' is the download status of the signature file, 'name' is used
+ * in messages.
+ *
+ * return:
+ *   0: ok
+ *   1: failed
+ */
+int url_sig_detached(char *name, char *dst, int sig_err)
+{
+  int err;
+  char *buf = NULL;
+
+  strprintf(&buf,
+    "gpg --homedir /root/.gnupg --batch --no-default-keyring --keyring /installkey.gpg --ignore-valid-from --ignore-time-conflict --verify '%s.asc' '%s'",
+    dst, dst
+  );
+
+  if(!sig_err) {
+    if(lxrc_run(buf)) {
+      log_info("%s: signature check failed\n", name);
+      config.sig_failed = 2;
+    }
+    else {
+      log_info("%s: signature ok\n", name);
+      config.sig_failed = 0;
+    }
   }
   else {
-    strprintf(&url->path, "%s.asc", old_path);
+    log_info("%s: no signature\n", name);
+  }
+
+  err = warn_signature_failed(name);
+
+  free(buf);
+
+  return err;
+}
+
+
+/*
+ * Download several (small) files from 'url'.
+ *
+ * Files from network sources are loaded concurrently. Otherwise (or if
+ * parallel downloads are disabled) this is the same as calling
+ * url_read_file() for each entry.
+ *
+ * Labels and progress bars are not supported. The result for each file is
+ * stored in files[].err (0: ok, 1: failed).
+ *
+ * Return number of failed downloads.
+ */
+int url_read_files_batch(url_t *url, char *dir, url_file_t *files, unsigned count)
+{
+  unsigned u, n, failed = 0, flags;
+  int err, *data_idx, *sig_idx;
+  url_data_t **url_data;
+  char *src_sig = NULL, *dst_sig = NULL;
+
+  if(!url || !count) return count;
+
+  if(!url->is.network || url->is.mountable || url->mount || config.download.parallel < 2) {
+    for(u = 0; u < count; u++) {
+      failed += files[u].err = url_read_file(url, dir, files[u].src, files[u].dst, NULL, files[u].flags) ? 1 : 0;
+    }
+
+    return failed;
+  }
+
+  data_idx = calloc(count, sizeof *data_idx);
+  sig_idx = calloc(count, sizeof *sig_idx);
+  url_data = calloc(2 * count, sizeof *url_data);
+
+  for(u = n = 0; u < count; u++) {
+    data_idx[u] = sig_idx[u] = -1;
+    flags = files[u].flags & ~URL_FLAG_PROGRESS;
+    if((flags & URL_FLAG_CHECK_SIG)) flags |= URL_FLAG_NODIGEST;
+
+    // no file name: url->path is the file; leave it to url_read_file()
+    if(!files[u].src || url_prepare_dst(files[u].dst, flags)) continue;
+
+    data_idx[u] = n;
+    url_data[n++] = url_data_new_file(url, files[u].src, files[u].dst, NULL, flags);
+
+    // we'll likely need the detached signature; load it right away
+    if((flags & URL_FLAG_CHECK_SIG) && config.secure) {
+      strprintf(&src_sig, "%s.asc", files[u].src);
+      strprintf(&dst_sig, "%s.asc", files[u].dst);
+      if(!url_prepare_dst(dst_sig, flags)) {
+        sig_idx[u] = n;
+        url_data[n++] = url_data_new_file(url, src_sig, dst_sig, NULL, flags | URL_FLAG_OPTIONAL);
+      }
+    }
   }
-  strprintf(&dst_sig, "%s.asc", dst);
-  strprintf(&buf,
-    "gpg --homedir /root/.gnupg --batch --no-default-keyring --keyring /installkey.gpg --ignore-valid-from --ignore-time-conflict --verify '%s' '%s'",
-    dst_sig, dst
-  );
 
-  err = url_read_file_nosig(url, dir, src_sig, dst_sig, NULL, flags);
-  str_copy(&url->path, old_path);
+  url_read_multi(url_data, n, config.download.parallel, NULL);
 
-  s = url_print2(url, src);
+  for(u = 0; u < count; u++) {
+    if(!files[u].src) {
+      failed += files[u].err = url_read_file(url, dir, NULL, files[u].dst, NULL, files[u].flags) ? 1 : 0;
+      continue;
+    }
 
-  if(!err) {
-    if(lxrc_run(buf)) {
-      log_info("%s: signature check failed\n", s);
-      config.sig_failed = 2;
+    flags = files[u].flags | ((files[u].flags & URL_FLAG_CHECK_SIG) ? URL_FLAG_NODIGEST : 0);
+
+    err = data_idx[u] < 0 || !url_data_check(url_data[data_idx[u]], flags) ? 1 : 0;
+
+    if(!err && (flags & URL_FLAG_CHECK_SIG)) {
+      err = url_sig_embedded(files[u].dst);
+      if(err == 2) {
+        err = url_sig_detached(
+          url_print2(url_data[data_idx[u]]->url, NULL),
+          files[u].dst,
+          sig_idx[u] < 0 || url_data[sig_idx[u]]->err
+        );
+      }
+      // signature was embedded after all
+      else if(sig_idx[u] >= 0) {
+        unlink(url_data[sig_idx[u]]->file_name);
+      }
     }
-    else {
-      log_info("%s: signature ok\n", s);
-      config.sig_failed = 0;
+    else if(sig_idx[u] >= 0) {
+      unlink(url_data[sig_idx[u]]->file_name);
     }
-  }
-  else {
-    log_info("%s: no signature\n", s);
+
+    failed += files[u].err = err;
   }
 
-  err = warn_signature_failed(s);
+  for(u = 0; u < n; u++) url_data_free(url_data[u]);
 
-  free(buf);
-  free(dst_sig);
+  free(url_data);
+  free(sig_idx);
+  free(data_idx);
   free(src_sig);
-  free(old_path);
+  free(dst_sig);
 
-  return err;
+  return failed;
 }
 
+
 static char *tc_src, *tc_dst;
 static int real_err = 0;
 static int keep_mounted = 0;
@@ -1869,8 +3021,8 @@ static char *tc_label;
 
 static int test_and_copy(url_t *url)
 {
-  int ok = 0, new_url = 0, i, win;
-  char *old_path, *buf = NULL;
+  int ok = 0, new_url = 0;
+  char *buf = NULL;
   url_data_t *url_data;
 
   if(!url) return 0;
@@ -1888,6 +3040,33 @@ static int test_and_copy(url_t *url)
     new_url = 1;
   }
 
+  url_data = url_data_new_file(url, tc_src, tc_dst, tc_label, tc_flags);
+
+  url_read(url_data);
+
+  ok = url_data_check(url_data, tc_flags);
+
+  str_copy(&buf, NULL);
+
+  if(new_url) url_free(url);
+
+  url_data_free(url_data);
+
+  return ok;
+}
+
+
+/*
+ * Create new url_data_t to download 'src' (relative to 'url') to 'dst'.
+ *
+ * 'label' and 'flags' as for url_read_file().
+ */
+url_data_t *url_data_new_file(url_t *url, char *src, char *dst, char *label, unsigned flags)
+{
+  int i;
+  char *old_path, *buf = NULL;
+  url_data_t *url_data;
+
   url_data = url_data_new();
 
   old_path = url->path;
@@ -1897,12 +3076,12 @@ static int test_and_copy(url_t *url)
   i = strlen(old_path);
   strprintf(&url->path, "%s%s%s",
     old_path,
-    (i && old_path[i - 1] == '/') || !*old_path || !*tc_src || *tc_src == '/' ? "" : "/",
-    strcmp(tc_src, "/") ? tc_src : ""
+    (i && old_path[i - 1] == '/') || !*old_path || !*src || *src == '/' ? "" : "/",
+    strcmp(src, "/") ? src : ""
   );
   if(url->path[0] == '/' && url->path[1] == '/') str_copy(&url->path, url->path + 1);
 
-  if(config.debug >= 3) log_debug("path: \"%s\" + \"%s\" = \"%s\"\n", old_path, tc_src, url->path);
+  if(config.debug >= 3) log_debug("path: \"%s\" + \"%s\" = \"%s\"\n", old_path, src, url->path);
 
   str_copy(&buf, url_print(url, 1));
   url_data->url = url_set(buf);
@@ -1910,16 +3089,36 @@ static int test_and_copy(url_t *url)
   free(url->path);
   url->path = old_path;
 
-  url_data->file_name = strdup(tc_dst);
+  url_data->file_name = strdup(dst);
 
-  if((tc_flags & URL_FLAG_OPTIONAL)) url_data->optional = 1;
-  if((tc_flags & URL_FLAG_UNZIP)) url_data->unzip = 1;
-  if((tc_flags & URL_FLAG_PROGRESS)) url_data->progress = url_progress;
-  str_copy(&url_data->label, tc_label);
+  if((flags & URL_FLAG_OPTIONAL)) url_data->optional = 1;
+  if((flags & URL_FLAG_UNZIP)) url_data->unzip = 1;
+  if((flags & URL_FLAG_PROGRESS)) {
+    url_data->progress = url_progress;
+    // only big files are worth the effort
+    url_data->segments = config.download.segments;
+  }
+  str_copy(&url_data->label, label);
 
   log_info("loading %s -> %s\n", url_print(url_data->url, 0), url_data->file_name);
 
-  url_read(url_data);
+  str_copy(&buf, NULL);
+
+  return url_data;
+}
+
+
+/*
+ * Check download result and verify digest (if needed).
+ *
+ * return:
+ *   0: failed
+ *   1: ok
+ */
+int url_data_check(url_data_t *url_data, unsigned flags)
+{
+  int ok = 0, i, win;
+  char *buf = NULL;
 
   if(url_data->err) {
     log_info("error %d: %s%s\n", url_data->err, url_data->err_buf, url_data->optional ? " (ignored)" : "");
@@ -1934,7 +3133,7 @@ static int test_and_copy(url_t *url)
       if(config.digests.sha384) log_info("sha384 %.32s...\n", url_data->digest.sha384 );
       if(config.digests.sha512) log_info("sha512 %.32s...\n", url_data->digest.sha512);
 
-      if((tc_flags & URL_FLAG_NODIGEST)) {
+      if((flags & URL_FLAG_NODIGEST)) {
         log_info("digest not checked\n");
       }
       else {
@@ -1972,10 +3171,6 @@ static int test_and_copy(url_t *url)
 
   str_copy(&buf, NULL);
 
-  if(new_url) url_free(url);
-
-  url_data_free(url_data);
-
   return ok;
 }
 
@@ -1989,30 +3184,14 @@ static int test_and_copy(url_t *url)
 int url_read_file_nosig(url_t *url, char *dir, char *src, char *dst, char *label, unsigned flags)
 {
   int err = 0, free_src = 0;
-  char *buf1 = NULL, *s, *t;
+  char *buf1 = NULL, *s;
 
   // don't assign tc_src yet, src may get modified
   tc_dst = dst;
   tc_flags = flags;
   tc_label = label;
   
-  if(!dst) return 1;
-  if(!(flags & URL_FLAG_NOUNLINK)) unlink(dst);
-
-  /* create missing directories */
-  str_copy(&buf1, dst);
-  for(s = buf1; (t = strchr(s, '/')) && !err; s = t + 1) {
-    *t = 0;
-    if(*buf1 && util_check_exist(buf1) != 'd') err = mkdir(buf1, 0755);
-    *t = '/';
-  }
-  str_copy(&buf1, NULL);
-
-  if(err) {
-    log_info("url read: %s: failed to create directories\n", dst);
-
-    return 1;
-  }
+  if(url_prepare_dst(dst, flags)) return 1;
 
   if(!src && url->mount) return 1;
 
@@ -2056,6 +3235,41 @@ int url_read_file_nosig(url_t *url, char *dir, char *src, char *dst, char *label
 }
 
 
+/*
+ * Remove old 'dst' (unless URL_FLAG_NOUNLINK is set) and create missing
+ * directories.
+ *
+ * return:
+ *   0: ok
+ *   1: failed
+ */
+int url_prepare_dst(char *dst, unsigned flags)
+{
+  int err = 0;
+  char *buf = NULL, *s, *t;
+
+  if(!dst) return 1;
+  if(!(flags & URL_FLAG_NOUNLINK)) unlink(dst);
+
+  /* create missing directories */
+  str_copy(&buf, dst);
+  for(s = buf; (t = strchr(s, '/')) && !err; s = t + 1) {
+    *t = 0;
+    if(*buf && util_check_exist(buf) != 'd') err = mkdir(buf, 0755);
+    *t = '/';
+  }
+  str_copy(&buf, NULL);
+
+  if(err) {
+    log_info("url read: %s: failed to create directories\n", dst);
+
+    return 1;
+  }
+
+  return 0;
+}
+
+
 /*
  * Like url_read_file() but setup network if necessary.
  *
@@ -2066,11 +3280,12 @@ int url_read_file_nosig(url_t *url, char *dir, char *src, char *dst, char *label
 int url_read_file_anywhere(url_t *url, char *dir, char *src, char *dst, char *label, unsigned flags)
 {
   int err, found, matched;
-  hd_t *hd;
+  hd_t *hd, *hd0;
   hd_res_t *res;
   char *hwaddr;
   str_list_t *sl;
   char *url_device;
+  slist_t *race;
 
   if(!url || !url->is.network || config.ifcfg.if_up) return url_read_file(url, dir, src, dst, label, flags);
 
@@ -2087,7 +3302,11 @@ int url_read_file_anywhere(url_t *url, char *dir, char *src, char *dst, char *la
   if(config.hd_data) {
     url_device = url->device ?: config.ifcfg.manual->device;
 
-    for(found = 0, hd = sort_a_bit(hd_list(config.hd_data, hw_network_ctrl, 0, NULL)); hd; hd = hd->next) {
+    hd0 = sort_a_bit(hd_list(config.hd_data, hw_network_ctrl, 0, NULL));
+
+    race = url_race_setup(url, hd0, url_device);
+
+    for(found = 0, hd = hd0; hd; hd = hd->next) {
       for(hwaddr = NULL, res = hd->res; res; res = res->next) {
         if(res->any.type == res_hwaddr) {
           hwaddr = res->hwaddr.addr;
@@ -2112,6 +3331,8 @@ int url_read_file_anywhere(url_t *url, char *dir, char *src, char *dst, char *la
 
       if(hd->is.wlan) util_set_wlan(hd->unix_dev_name);
 
+      if(url_race_next(&race, hd->unix_dev_name)) continue;
+
       url_setup_device(url);
 
       if(!url_read_file(url, dir, src, dst, label, flags)) {
@@ -2121,6 +3342,8 @@ int url_read_file_anywhere(url_t *url, char *dir, char *src, char *dst, char *la
       if(config.sig_failed || config.digests.failed) break;
     }
 
+    url_race_next(&race, NULL);
+
     if(!found) {
       str_copy(&url->used.device, NULL);
       str_copy(&url->used.model, NULL);
@@ -2424,6 +3647,22 @@ int url_find_instsys(url_t *url, char *dir)
     }
   }
 
+  // can't be mounted: load all parts at once
+  if(
+    ok &&
+    url->is.network &&
+    !url->is.mountable &&
+    config.url.instsys_list && config.url.instsys_list->next &&
+    config.download.parallel > 1
+  ) {
+    ok = url_load_instsys_parallel(url);
+
+    str_copy(&url->path, NULL);
+    url->path = url_path;
+
+    return ok ? 0 : 1;
+  }
+
   if(ok) {
     for(parts = 0, sl = config.url.instsys_list; sl; sl = sl->next) parts++;
 
@@ -2514,6 +3753,95 @@ int url_find_instsys(url_t *url, char *dir)
 }
 
 
+/*
+ * Download all instsys parts concurrently, then mount them.
+ *
+ * This is used for urls that can't be mounted; url_find_instsys() does
+ * the same one part at a time. Parts are mounted in list order after all
+ * downloads have finished.
+ *
+ * return:
+ *   0: failed
+ *   1: ok
+ */
+int url_load_instsys_parallel(url_t *url)
+{
+  int ok = 1, opt, part, parts, i;
+  unsigned flags;
+  char *s, *t, *label = NULL;
+  slist_t *sl, **file_list;
+  url_data_t **url_data;
+  FILE *f;
+
+  for(parts = 0, sl = config.url.instsys_list; sl; sl = sl->next) parts++;
+
+  file_list = calloc(parts, sizeof *file_list);
+  url_data = calloc(parts, sizeof *url_data);
+
+  for(part = 0, sl = config.url.instsys_list; sl; sl = sl->next, part++) {
+    opt = *(s = sl->key) == '?' && s++;
+    t = url_config_get_path(s);
+    file_list[part] = url_config_get_file_list(s);
+
+    sl->value = strdup(new_mountpoint());
+
+    if((f = fopen("/etc/instsys.parts", "a"))) {
+      fprintf(f, "%s %s\n", s, sl->value);
+      fclose(f);
+    }
+
+    strprintf(&label, "%s (%d/%d)",
+      config.rescue ? "Loading Rescue System" : "Loading Installation System", part + 1, parts
+    );
+
+    flags = URL_FLAG_PROGRESS + URL_FLAG_UNZIP + opt * URL_FLAG_OPTIONAL;
+
+    // an empty path means url->path itself, as in url_read_file()
+    url_data[part] = url_data_new_file(url, t, new_download(), label, flags);
+    if(url_prepare_dst(url_data[part]->file_name, flags)) {
+      url_data[part]->err = 101;
+      snprintf(url_data[part]->err_buf, url_data[part]->err_buf_len, "%s: failed to create directories", url_data[part]->file_name);
+    }
+
+    free(t);
+  }
+
+  url_read_multi(url_data, parts, config.download.parallel, NULL);
+
+  for(part = 0, sl = config.url.instsys_list; sl && part < parts; sl = sl->next, part++) {
+    opt = url_data[part]->optional;
+
+    if(ok) {
+      if(url_data_check(url_data[part], 0)) {
+        log_info("mount %s -> %s\n", url_data[part]->file_name, sl->value);
+
+        i = util_mount_ro(url_data[part]->file_name, sl->value, file_list[part]) ? 0 : 1;
+        ok &= i;
+        if(!i) log_info("instsys mount failed: %s\n", sl->value);
+      }
+      else {
+        log_info("download failed: %s%s\n", sl->value, opt ? " (ignored)" : "");
+        if(!opt) ok = 0;
+      }
+    }
+
+    slist_free(file_list[part]);
+    url_data_free(url_data[part]);
+  }
+
+  if(ok) {
+    str_copy(&config.url.instsys->mount, config.mountpoint.instsys);
+    mkdir(config.url.instsys->mount, 0755);
+  }
+
+  free(file_list);
+  free(url_data);
+  free(label);
+
+  return ok;
+}
+
+
 /*
  * Load fs module or setup network interface.
  *
@@ -2934,25 +4262,187 @@ int link_detected(hd_t *hd)
 
 void digest_init(url_data_t *url_data)
 {
+  static int sha_hw_logged;
+
+  digest_thread_stop(url_data);
+
+  if(!sha_hw_logged && (config.digests.sha1 || config.digests.sha224 || config.digests.sha256)) {
+    sha_hw_logged = 1;
+    log_info("sha1/sha256: %s\n", sha_hw_name() ?: "no cpu support");
+  }
+
   if(config.digests.md5) md5_init_ctx(&url_data->digest.ctx.md5);
   if(config.digests.sha1) sha1_init_ctx(&url_data->digest.ctx.sha1);
   if(config.digests.sha224) sha224_init_ctx(&url_data->digest.ctx.sha224);
   if(config.digests.sha256) sha256_init_ctx(&url_data->digest.ctx.sha256);
   if(config.digests.sha384) sha384_init_ctx(&url_data->digest.ctx.sha384);
   if(config.digests.sha512) sha512_init_ctx(&url_data->digest.ctx.sha512);
+
+  // the thread is started in digest_process() once we know the size
+  url_data->digest_bg =
+    config.download.digest_thread &&
+    (
+      config.digests.md5 || config.digests.sha1 || config.digests.sha224 ||
+      config.digests.sha256 || config.digests.sha384 || config.digests.sha512
+    );
 }
 
 
+/*
+ * Feed data to all active digests.
+ *
+ * If there's a digest thread, the data are copied to its ring buffer;
+ * this blocks only if the thread is too far behind.
+ */
 void digest_process(url_data_t *url_data, void *buffer, size_t len)
 {
-  if(len) {
-    if(config.digests.md5) md5_process_bytes(buffer, len, &url_data->digest.ctx.md5);
-    if(config.digests.sha1) sha1_process_bytes(buffer, len, &url_data->digest.ctx.sha1);
-    if(config.digests.sha224) sha256_process_bytes(buffer, len, &url_data->digest.ctx.sha224);
-    if(config.digests.sha256) sha256_process_bytes(buffer, len, &url_data->digest.ctx.sha256);
-    if(config.digests.sha384) sha512_process_bytes(buffer, len, &url_data->digest.ctx.sha384);
-    if(config.digests.sha512) sha512_process_bytes(buffer, len, &url_data->digest.ctx.sha512);
+  digest_thread_t *dt = url_data->digest_thread;
+  unsigned char *buf = buffer;
+  size_t chunk;
+
+  if(!dt && url_data->digest_bg && (url_data->progress || url_data->p_total >= DIGEST_THREAD_MIN)) {
+    url_data->digest_bg = 0;
+    digest_thread_start(url_data);
+    dt = url_data->digest_thread;
+  }
+
+  if(!dt) {
+    digest_process_data(url_data, buffer, len);
+
+    return;
+  }
+
+  while(len) {
+    if(!dt->have_slot) {
+      sem_wait(&dt->empty);
+      dt->have_slot = 1;
+      dt->slot[dt->head].len = 0;
+    }
+
+    chunk = DIGEST_SLOT_SIZE - dt->slot[dt->head].len;
+    if(chunk > len) chunk = len;
+
+    memcpy(dt->slot[dt->head].data + dt->slot[dt->head].len, buf, chunk);
+    dt->slot[dt->head].len += chunk;
+    buf += chunk;
+    len -= chunk;
+
+    if(dt->slot[dt->head].len == DIGEST_SLOT_SIZE) digest_thread_push(dt);
+  }
+}
+
+
+/*
+ * Run all active digests over the data.
+ *
+ * The buffer is processed in small pieces so each piece stays in the cache
+ * while all digests are run over it.
+ */
+void digest_process_data(url_data_t *url_data, void *buffer, size_t len)
+{
+  unsigned char *buf = buffer;
+  size_t chunk;
+
+  for(; len; len -= chunk, buf += chunk) {
+    chunk = len > DIGEST_CHUNK_SIZE ? DIGEST_CHUNK_SIZE : len;
+
+    if(config.digests.md5) md5_process_bytes(buf, chunk, &url_data->digest.ctx.md5);
+    if(config.digests.sha1) sha1_process_bytes(buf, chunk, &url_data->digest.ctx.sha1);
+    if(config.digests.sha224) sha256_process_bytes(buf, chunk, &url_data->digest.ctx.sha224);
+    if(config.digests.sha256) sha256_process_bytes(buf, chunk, &url_data->digest.ctx.sha256);
+    if(config.digests.sha384) sha512_process_bytes(buf, chunk, &url_data->digest.ctx.sha384);
+    if(config.digests.sha512) sha512_process_bytes(buf, chunk, &url_data->digest.ctx.sha512);
+  }
+}
+
+
+/*
+ * Start thread that computes the digests while we continue downloading.
+ *
+ * If that fails, digests are computed directly.
+ */
+void digest_thread_start(url_data_t *url_data)
+{
+  digest_thread_t *dt;
+  unsigned u;
+  int err;
+
+  dt = calloc(1, sizeof *dt);
+  dt->url_data = url_data;
+  for(u = 0; u < DIGEST_RING_SLOTS; u++) dt->slot[u].data = malloc(DIGEST_SLOT_SIZE);
+
+  sem_init(&dt->empty, 0, DIGEST_RING_SLOTS);
+  sem_init(&dt->filled, 0, 0);
+
+  url_data->digest_thread = dt;
+
+  if((err = pthread_create(&dt->thread, NULL, digest_thread_run, dt))) {
+    log_info("digest thread: %s\n", strerror(err));
+    digest_thread_stop(url_data);
+
+    return;
+  }
+
+  dt->running = 1;
+}
+
+
+/*
+ * Pass remaining data to digest thread and wait until it's done.
+ *
+ * Does nothing if there's no digest thread.
+ */
+void digest_thread_stop(url_data_t *url_data)
+{
+  digest_thread_t *dt = url_data->digest_thread;
+  unsigned u;
+
+  if(!dt) return;
+
+  if(dt->running) {
+    if(dt->have_slot && dt->slot[dt->head].len) digest_thread_push(dt);
+
+    // empty slot: end marker
+    if(!dt->have_slot) sem_wait(&dt->empty);
+    dt->slot[dt->head].len = 0;
+    digest_thread_push(dt);
+
+    pthread_join(dt->thread, NULL);
+  }
+
+  sem_destroy(&dt->empty);
+  sem_destroy(&dt->filled);
+  for(u = 0; u < DIGEST_RING_SLOTS; u++) free(dt->slot[u].data);
+  free(dt);
+
+  url_data->digest_thread = NULL;
+}
+
+
+/*
+ * Hand current slot over to the digest thread.
+ */
+void digest_thread_push(digest_thread_t *dt)
+{
+  dt->have_slot = 0;
+  dt->head = (dt->head + 1) % DIGEST_RING_SLOTS;
+  sem_post(&dt->filled);
+}
+
+
+void *digest_thread_run(void *data)
+{
+  digest_thread_t *dt = data;
+
+  for(;;) {
+    sem_wait(&dt->filled);
+    if(!dt->slot[dt->tail].len) break;
+    digest_process_data(dt->url_data, dt->slot[dt->tail].data, dt->slot[dt->tail].len);
+    dt->tail = (dt->tail + 1) % DIGEST_RING_SLOTS;
+    sem_post(&dt->empty);
   }
+
+  return NULL;
 }
 
 
@@ -2961,6 +4451,8 @@ void digest_finish(url_data_t *url_data)
   int i;
   unsigned char buf[MAX_DIGEST_SIZE];
 
+  digest_thread_stop(url_data);
+
   if(config.digests.md5) {
     md5_finish_ctx(&url_data->digest.ctx.md5, buf);
     for(i = 0; i < MD5_DIGEST_SIZE; i++) {
@@ -2,6 +2,7 @@
 #include "sha1.h"
 #include "sha256.h"
 #include "sha512.h"
+#include "zstream.h"
 
 #define MAX_DIGEST_SIZE SHA512_DIGEST_SIZE
 
@@ -22,18 +23,21 @@ typedef struct url_data_s {
   unsigned unzip:1;
   unsigned label_shown:1;
   unsigned optional:1;
-  char *compressed;		// program name used for compression, if any
+  unsigned digest_bg:1;		// digest thread may be started
+  char *compressed;		// compression type, if any
+  zstream_t *zstream;		// decoder for compressed data
   char *label;
   int percent;
-  int pipe_fd;
   char *orig_name;
   unsigned image_size;
-  char *tmp_file;
+  unsigned segments;		// max number of parallel range requests
   struct {
     unsigned len, max;
     unsigned char *data;
   } buf;
   int (*progress)(struct url_data_s *, int);
+  struct digest_thread_s *digest_thread;	// computes digests in the background
+  struct curl_slist *resolve;	// CURLOPT_RESOLVE list for url
   struct {
     struct {
       struct md5_ctx md5;
@@ -60,7 +64,15 @@ typedef struct url_data_s {
 #define URL_FLAG_OPTIONAL	(1 << 5)
 #define URL_FLAG_CHECK_SIG	(1 << 6)
 
+typedef struct {
+  char *src;		// file name, relative to url
+  char *dst;		// local file name
+  unsigned flags;	// URL_FLAG_*
+  int err;		// download result (0: ok, 1: failed)
+} url_file_t;
+
 void url_read(url_data_t *url_data);
+void url_read_multi(url_data_t **url_data, unsigned count, unsigned max, url_data_t *total);
 url_t *url_set(char *str);
 url_t *url_free(url_t *url);
 void url_cleanup(void);
@@ -69,6 +81,7 @@ void url_data_free(url_data_t *url_data);
 void url_umount(url_t *url);
 int url_mount(url_t *url, char *dir, int (*test_func)(url_t *));
 int url_read_file(url_t *url, char *dir, char *src, char *dst, char *label, unsigned flags);
+int url_read_files_batch(url_t *url, char *dir, url_file_t *files, unsigned count);
 int url_read_file_anywhere(url_t *url, char *dir, char *src, char *dst, char *label, unsigned flags);
 int url_find_repo(url_t *url, char *dir);
 int url_find_instsys(url_t *url, char *dir);
@@ -34,6 +34,7 @@
 #include <signal.h>
 #include <sys/swap.h>
 #include <sys/socket.h>
+#include <sys/sendfile.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <utime.h>
@@ -41,9 +42,14 @@
 #include <linux/major.h>
 #include <linux/raid/md_u.h>
 #include <execinfo.h>
+#include <poll.h>
+#include <pthread.h>
+#include <linux/netlink.h>
 
 #define CDROMEJECT	0x5309	/* Ejects the cdrom media */
 
+#define PROBE_CACHE_SIZE	64
+
 #include <linux/posix_types.h>
 #undef dev_t
 #define dev_t __kernel_dev_t
@@ -65,11 +71,17 @@
 #include "utf8.h"
 #include "url.h"
 #include "linuxrc.h"
+#include "archive.h"
 
 extern char **environ;
 
 #define LED_TIME     50000
 
+#define HLINK_HASH_SIZE	1024
+#define CP_THREADS	8		/* max threads for util_do_cp() */
+#define CP_CHUNK	(1 << 30)	/* bytes per copy_file_range()/sendfile() call */
+#define CP_BUF_SIZE	(1 << 20)	/* read/write buffer if neither works */
+
 typedef struct {
   instmode_t scheme;
   char *server;
@@ -81,22 +93,101 @@ typedef struct {
   unsigned port;
 } url1_t;
 
-static struct hlink_s {
+struct hlink_s {
   struct hlink_s *next;
   dev_t dev;
   ino_t ino;
   char *dst;
-} *hlink_list = NULL;
+};
+
+// a directory to copy in util_do_cp()
+typedef struct cp_dir_s {
+  struct cp_dir_s *next;
+  char *src;
+  char *dst;
+  struct stat sbuf;		// src; to fix owner/time/permissions at the end
+  unsigned top:1;		// the directory passed to util_do_cp()
+} cp_dir_t;
+
+/*
+ * State of util_do_cp(), shared by all copy threads.
+ *
+ * All fields are protected by mutex.
+ */
+static struct {
+  cp_dir_t *todo;		// directories waiting to be copied
+  cp_dir_t *done;		// directories already copied
+  unsigned busy;		// threads currently copying a directory
+  int err;			// first error
+  char *exclude;		// top level directory to skip (dst itself)
+  struct hlink_s *hlink[HLINK_HASH_SIZE];	// hard linked files, by dev/inode
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+} cp;
 
-static char *exclude = NULL;
-static int rec_level = 0;
 static int extend_ready = 0;
 
+/*
+ * Device change tracking via kernel uevents.
+ *
+ * Each counter is incremented when we see an event for the respective
+ * subsystem; callers remember the last value they've seen to tell
+ * whether they need to rescan.
+ */
+static struct {
+  pthread_mutex_t mutex;	// probing threads use it, too
+  int fd;			// uevent socket (0: not yet opened, -1: not available)
+  unsigned block;		// block device events
+  unsigned other;		// all other events
+} uevent = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+/*
+ * Cache for probing results (fs type, compression, label).
+ *
+ * Regular files are identified by device, inode, size and mtime; block
+ * devices by their device number. Block device entries become invalid
+ * with the next block device uevent.
+ *
+ * Note: fs and compression types are static strings.
+ */
+typedef struct probe_cache_s {
+  struct probe_cache_s *next;
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+  unsigned block;		// uevent.block when the entry was made
+  char *fstype;			// fstype()
+  char *compr;			// compressed_file()
+  char *archive;		// compressed_archive()
+  char *blkid_type;		// blk_ident()
+  char *blkid_label;		// blk_ident()
+  int file_size;		// util_fileinfo()
+  int file_err;			// util_fileinfo()
+  unsigned is_blk:1;
+  unsigned has_fstype:1;
+  unsigned has_compr:1;
+  unsigned has_archive:1;
+  unsigned has_blkid:1;
+  unsigned has_fileinfo:1;
+  unsigned file_compressed:1;	// util_fileinfo()
+} probe_cache_t;
+
+static probe_cache_t *probe_cache[PROBE_CACHE_SIZE];
+static pthread_mutex_t probe_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned probe_cache_hits;
+
+// util_log() is called from several threads (module loading, device probing, downloads)
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 static void add_flag(slist_t **sl, char *buf, int value, char *name);
 
-static int do_cp(char *src, char *dst);
-static char *walk_hlink_list(ino_t ino, dev_t dev, char *dst);
-static void free_hlink_list(void);
+static void *cp_thread(void *arg);
+static int do_cp(cp_dir_t *dir);
+static int cp_data(int fd1, int fd2);
+static void cp_perror(char *dir, char *name);
+static char *lookup_hlink(ino_t ino, dev_t dev, char *dir, char *name);
+static void free_hlinks(void);
 
 static void add_driver_update(char *dir, char *loc);
 static int cmp_dir_entry(slist_t *sl0, slist_t *sl1);
@@ -119,6 +210,17 @@ static int cmp_alpha(slist_t *sl0, slist_t *sl1);
 static int cmp_alpha_s(const void *p0, const void *p1);
 static slist_t *get_kernel_list(char *dev);
 
+static int uevent_open(void);
+static char *uevent_subsystem(char *buf, ssize_t len);
+static int uevent_update(unsigned *block, unsigned *other);
+static unsigned ms_since(struct timespec *ts0);
+
+static probe_cache_t *probe_cache_get(char *name);
+static void probe_cache_clear(probe_cache_t *pc);
+static int probe_cache_hit(int has);
+
+static int squash_archive(char *file, char *image, char *type, char *compr, slist_t *file_list);
+
 
 void util_redirect_kmsg()
 {
@@ -338,10 +440,23 @@ int util_fileinfo(char *file_name, int *size, int *compressed)
   unsigned char buf[4];
   int fd, err = 0;
   off_t ofs;
+  probe_cache_t *pc;
 
   if(size) *size = 0;
   if(compressed) *compressed = 0;
 
+  pthread_mutex_lock(&probe_cache_mutex);
+  pc = probe_cache_get(file_name);
+  if(probe_cache_hit(pc && pc->has_fileinfo)) {
+    if(size) *size = pc->file_size;
+    if(compressed) *compressed = pc->file_compressed;
+    err = pc->file_err;
+    pthread_mutex_unlock(&probe_cache_mutex);
+
+    return err;
+  }
+  pthread_mutex_unlock(&probe_cache_mutex);
+
   if(!(fd = open(file_name, O_RDONLY | O_LARGEFILE))) return -1;
 
   if(read(fd, buf, 2) != 2) {
@@ -375,6 +490,18 @@ int util_fileinfo(char *file_name, int *size, int *compressed)
 
   close(fd);
 
+  // only cache complete results
+  if(size && compressed) {
+    pthread_mutex_lock(&probe_cache_mutex);
+    if((pc = probe_cache_get(file_name))) {
+      pc->file_size = *size;
+      pc->file_compressed = *compressed;
+      pc->file_err = err;
+      pc->has_fileinfo = 1;
+    }
+    pthread_mutex_unlock(&probe_cache_mutex);
+  }
+
   return err;
 }
 
@@ -985,6 +1112,9 @@ void util_do_driver_update(unsigned idx)
     symlink(buf1, buf2);
   }
 
+  /* the update may have replaced or removed modules */
+  mod_loaded_reset();
+
   /* load new modules */
   strprintf(&buf1, "%s/modules/module.config", dst);
   if(util_check_exist(buf1) == 'r') {
@@ -1689,199 +1819,373 @@ char *util_process_cmdline(pid_t pid)
   return buf;
 }
 
+/*
+ * Copy recursively src to dst. Both must be existing directories.
+ *
+ * Directories are copied in parallel by up to CP_THREADS threads. Owner,
+ * time and permissions of the copied directories are set at the end.
+ */
 int util_do_cp(char *src, char *dst)
 {
-  int i;
+  pthread_t threads[CP_THREADS];
+  cp_dir_t *dir, *next;
+  struct timespec times[2];
+  unsigned u, threads_cnt;
+  long cpus;
 
-  exclude = strrchr(dst, '/');
-  if(exclude) exclude++; else exclude = dst;
-  rec_level = 0;
+  cp.exclude = strrchr(dst, '/');
+  if(cp.exclude) cp.exclude++; else cp.exclude = dst;
 
-  i = do_cp(src, dst);
-  free_hlink_list();
+  dir = calloc(1, sizeof *dir);
+  dir->src = strdup(src);
+  dir->dst = strdup(dst);
+  dir->top = 1;
 
-  return i;
+  cp.todo = dir;
+  cp.done = NULL;
+  cp.busy = 0;
+  cp.err = 0;
+
+  pthread_mutex_init(&cp.mutex, NULL);
+  pthread_cond_init(&cp.cond, NULL);
+
+  cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  threads_cnt = cpus < 1 ? 1 : cpus > CP_THREADS ? CP_THREADS : cpus;
+
+  for(u = 0; u < threads_cnt; u++) {
+    if(pthread_create(threads + u, NULL, cp_thread, NULL)) break;
+  }
+  threads_cnt = u;
+
+  // no threads at all: do it ourselves
+  if(!threads_cnt) cp_thread(NULL);
+
+  for(u = 0; u < threads_cnt; u++) pthread_join(threads[u], NULL);
+
+  pthread_cond_destroy(&cp.cond);
+  pthread_mutex_destroy(&cp.mutex);
+
+  for(dir = cp.done; dir; dir = next) {
+    next = dir->next;
+    if(!dir->top) {
+      lchown(dir->dst, dir->sbuf.st_uid, dir->sbuf.st_gid);
+      chmod(dir->dst, dir->sbuf.st_mode);
+      times[0] = dir->sbuf.st_atim;
+      times[1] = dir->sbuf.st_mtim;
+      utimensat(AT_FDCWD, dir->dst, times, 0);
+    }
+    free(dir->src);
+    free(dir->dst);
+    free(dir);
+  }
+
+  // left over after an error
+  for(dir = cp.todo; dir; dir = next) {
+    next = dir->next;
+    free(dir->src);
+    free(dir->dst);
+    free(dir);
+  }
+
+  free_hlinks();
+
+  return cp.err;
 }
 
 
 /*
- * Copy recursively src to dst. Both must be existing directories.
+ * Copy thread for util_do_cp().
+ *
+ * Pick directories from cp.todo until there are none left and no other
+ * thread could add new ones.
  */
-int do_cp(char *src, char *dst)
+void *cp_thread(void *arg)
 {
-  DIR *dir;
+  cp_dir_t *dir;
+  int err;
+
+  pthread_mutex_lock(&cp.mutex);
+
+  for(;;) {
+    while(!cp.todo && cp.busy && !cp.err) pthread_cond_wait(&cp.cond, &cp.mutex);
+
+    if(!cp.todo || cp.err) break;
+
+    dir = cp.todo;
+    cp.todo = dir->next;
+    cp.busy++;
+
+    pthread_mutex_unlock(&cp.mutex);
+
+    err = do_cp(dir);
+
+    pthread_mutex_lock(&cp.mutex);
+
+    cp.busy--;
+    if(err && !cp.err) cp.err = err;
+    dir->next = cp.done;
+    cp.done = dir;
+  }
+
+  pthread_cond_broadcast(&cp.cond);
+  pthread_mutex_unlock(&cp.mutex);
+
+  return NULL;
+}
+
+
+/*
+ * Copy the contents of a single directory.
+ *
+ * Subdirectories are created and added to cp.todo.
+ */
+int do_cp(cp_dir_t *dir)
+{
+  DIR *d;
   struct dirent *de;
   struct stat sbuf, sbuf2;
-  char src2[0x100];
-  char dst2[0x100];
-  char *s;
-  int i, j;
+  struct timespec times[2];
+  cp_dir_t *sub;
+  char *s, *buf = NULL;
+  int i, sfd, dfd, fd1, fd2;
   int err = 0;
-  unsigned char buf[0x1000];
-  int fd1, fd2;
-  struct utimbuf ubuf;
+  size_t len;
 
-  if((dir = opendir(src))) {
-    while((de = readdir(dir))) {
-      if(!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) continue;
-      sprintf(src2, "%s/%s", src, de->d_name);
-      sprintf(dst2, "%s/%s", dst, de->d_name);
-      i = lstat(src2, &sbuf);
-      if(i == -1) {
-        perror_info(src2);
-        err = 2;
-        break;
-      }
+  if(!(d = opendir(dir->src))) {
+    perror_info(dir->src);
+    return 1;
+  }
+  sfd = dirfd(d);
 
-      if(S_ISDIR(sbuf.st_mode)) {
-        // avoid infinite recursion
-        if(exclude && !rec_level && !strcmp(exclude, de->d_name)) continue;
+  dfd = open(dir->dst, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if(dfd == -1) {
+    perror_info(dir->dst);
+    closedir(d);
+    return 4;
+  }
 
-        i = stat(dst2, &sbuf2);
-        if(i || !S_ISDIR(sbuf2.st_mode)) {
-          unlink(dst2);
-          i = mkdir(dst2, 0755);
-          if(i) {
-            err = 4;
-            perror_info(dst2);
-            break;
-          }
-        }
+  while((de = readdir(d))) {
+    if(!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) continue;
+    i = fstatat(sfd, de->d_name, &sbuf, AT_SYMLINK_NOFOLLOW);
+    if(i == -1) {
+      cp_perror(dir->src, de->d_name);
+      err = 2;
+      break;
+    }
 
-        rec_level++;
-        err = do_cp(src2, dst2);
-        rec_level--;
+    if(S_ISDIR(sbuf.st_mode)) {
+      // avoid infinite recursion
+      if(cp.exclude && dir->top && !strcmp(cp.exclude, de->d_name)) continue;
 
-        if(err) break;
+      i = fstatat(dfd, de->d_name, &sbuf2, 0);
+      if(i || !S_ISDIR(sbuf2.st_mode)) {
+        unlinkat(dfd, de->d_name, 0);
+        i = mkdirat(dfd, de->d_name, 0755);
+        if(i) {
+          err = 4;
+          cp_perror(dir->dst, de->d_name);
+          break;
+        }
       }
 
-      else if(S_ISREG(sbuf.st_mode)) {
-        unlink(dst2);
-        s = NULL;
-        if(sbuf.st_nlink > 1) {
-          s = walk_hlink_list(sbuf.st_ino, sbuf.st_dev, dst2);
-        }
+      sub = calloc(1, sizeof *sub);
+      asprintf(&sub->src, "%s/%s", dir->src, de->d_name);
+      asprintf(&sub->dst, "%s/%s", dir->dst, de->d_name);
+      sub->sbuf = sbuf;
 
-        if(s) {
-          // just make a link
+      pthread_mutex_lock(&cp.mutex);
+      sub->next = cp.todo;
+      cp.todo = sub;
+      pthread_cond_signal(&cp.cond);
+      pthread_mutex_unlock(&cp.mutex);
 
-          i = link(s, dst2);
-          if(i) {
-            err = 12;
-            perror_info(dst2);
-            break;
-          }
-        }
-        else {
-          // actually copy it
+      // owner/time/permissions are fixed in util_do_cp()
+      continue;
+    }
 
-          fd1 = open(src2, O_RDONLY);
-          if(fd1 < 0) {
-            err = 5;
-            perror_info(src2);
-            break;
-          }
-          fd2 = open(dst2, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-          if(fd2 < 0) {
-            err = 6;
-            perror_info(dst2);
-            close(fd1);
-            break;
-          }
-          do {
-            i = read(fd1, buf, sizeof buf);
-            j = 0;
-            if(i > 0) {
-              j = write(fd2, buf, i);
-            }
-          }
-          while(i > 0 && j > 0);
-          if(i < 0) {
-            perror_info(src2);
-            err = 7;
-          }
-          if(j < 0) {
-            perror_info(dst2);
-            err = 8;
-          }
-          close(fd1);
-          close(fd2);
-          if(err) break;
-        }
+    else if(S_ISREG(sbuf.st_mode)) {
+      unlinkat(dfd, de->d_name, 0);
+      s = NULL;
+      fd2 = -1;
+      i = 0;
+
+      // create the file while holding the lock so other threads can link to it
+      if(sbuf.st_nlink > 1) {
+        pthread_mutex_lock(&cp.mutex);
+        s = lookup_hlink(sbuf.st_ino, sbuf.st_dev, dir->dst, de->d_name);
       }
+      if(s) {
+        // just make a link
+        i = linkat(AT_FDCWD, s, dfd, de->d_name, 0);
+      }
+      else {
+        fd2 = openat(dfd, de->d_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+      }
+      if(sbuf.st_nlink > 1) pthread_mutex_unlock(&cp.mutex);
 
-      else if(S_ISLNK(sbuf.st_mode)) {
-        i = readlink(src2, buf, sizeof buf - 1);
-        if(i < 0) {
-          err = 9;
-          perror_info(src2);
-          break;
-        }
-        else {
-          buf[i] = 0;
-        }
-        unlink(dst2);
-        i = symlink(buf, dst2);
+      if(s) {
         if(i) {
-          err = 10;
-          perror_info(dst2);
+          err = 12;
+          cp_perror(dir->dst, de->d_name);
           break;
         }
       }
+      else {
+        // actually copy it
 
-      else if(
-        S_ISCHR(sbuf.st_mode) ||
-        S_ISBLK(sbuf.st_mode) ||
-        S_ISFIFO(sbuf.st_mode) ||
-        S_ISSOCK(sbuf.st_mode)
-      ) {
-        unlink(dst2);
-        i = mknod(dst2, sbuf.st_mode, sbuf.st_rdev);
-        if(i) {
-          err = 11;
-          perror_info(dst2);
+        if(fd2 < 0) {
+          err = 6;
+          cp_perror(dir->dst, de->d_name);
+          break;
+        }
+        fd1 = openat(sfd, de->d_name, O_RDONLY | O_CLOEXEC);
+        if(fd1 < 0) {
+          err = 5;
+          cp_perror(dir->src, de->d_name);
+          close(fd2);
           break;
         }
+        err = cp_data(fd1, fd2);
+        if(err) cp_perror(err == 7 ? dir->src : dir->dst, de->d_name);
+        close(fd1);
+        close(fd2);
+        if(err) break;
       }
+    }
 
+    else if(S_ISLNK(sbuf.st_mode)) {
+      // st_size is the target length, but don't rely on it
+      len = sbuf.st_size < 0x100 ? 0x100 : sbuf.st_size + 1;
+      for(;; len *= 2) {
+        buf = realloc(buf, len);
+        i = readlinkat(sfd, de->d_name, buf, len);
+        if(i < 0 || i < len) break;
+      }
+      if(i < 0) {
+        err = 9;
+        cp_perror(dir->src, de->d_name);
+        break;
+      }
       else {
-        log_info("%s: type not supported\n", src2);
-        err = 3;
+        buf[i] = 0;
+      }
+      unlinkat(dfd, de->d_name, 0);
+      i = symlinkat(buf, dfd, de->d_name);
+      if(i) {
+        err = 10;
+        cp_perror(dir->dst, de->d_name);
         break;
       }
+    }
 
-      // fix owner/time/permissions
-
-      lchown(dst2, sbuf.st_uid, sbuf.st_gid);
-      if(!S_ISLNK(sbuf.st_mode)) {
-        chmod(dst2, sbuf.st_mode);
-        ubuf.actime = sbuf.st_atime;
-        ubuf.modtime = sbuf.st_mtime;
-        utime(dst2, &ubuf);
+    else if(
+      S_ISCHR(sbuf.st_mode) ||
+      S_ISBLK(sbuf.st_mode) ||
+      S_ISFIFO(sbuf.st_mode) ||
+      S_ISSOCK(sbuf.st_mode)
+    ) {
+      unlinkat(dfd, de->d_name, 0);
+      i = mknodat(dfd, de->d_name, sbuf.st_mode, sbuf.st_rdev);
+      if(i) {
+        err = 11;
+        cp_perror(dir->dst, de->d_name);
+        break;
       }
+    }
 
+    else {
+      log_info("%s/%s: type not supported\n", dir->src, de->d_name);
+      err = 3;
+      break;
+    }
+
+    // fix owner/time/permissions
+
+    fchownat(dfd, de->d_name, sbuf.st_uid, sbuf.st_gid, AT_SYMLINK_NOFOLLOW);
+    if(!S_ISLNK(sbuf.st_mode)) {
+      fchmodat(dfd, de->d_name, sbuf.st_mode, 0);
+      times[0] = sbuf.st_atim;
+      times[1] = sbuf.st_mtim;
+      utimensat(dfd, de->d_name, times, 0);
     }
-  } else {
-    perror_info(src);
-    return 1;
   }
 
-  closedir(dir);
+  free(buf);
+  close(dfd);
+  closedir(d);
 
   return err;
 }
 
 
+/*
+ * Copy file contents from fd1 to fd2.
+ *
+ * Use copy_file_range() to let the kernel do it; fall back to sendfile()
+ * if it can't (e.g. across file systems) and to read/write as last resort.
+ *
+ * Return 0 if ok, 7 on read error, 8 on write error.
+ */
+int cp_data(int fd1, int fd2)
+{
+  ssize_t i, j, k;
+  int err = 0;
+  char *buf;
+
+  while((i = copy_file_range(fd1, NULL, fd2, NULL, CP_CHUNK, 0)) > 0);
+  if(!i) return 0;
+  if(errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP) return 8;
+
+  // both continue at the current file offsets
+  while((i = sendfile(fd2, fd1, NULL, CP_CHUNK)) > 0);
+  if(!i) return 0;
+  if(errno != EINVAL && errno != ENOSYS) return 8;
+
+  buf = malloc(CP_BUF_SIZE);
+
+  while(!err && (i = read(fd1, buf, CP_BUF_SIZE)) > 0) {
+    for(k = 0; k < i; k += j) {
+      if((j = write(fd2, buf + k, i - k)) <= 0) {
+        err = 8;
+        break;
+      }
+    }
+  }
+  if(i < 0) err = 7;
+
+  free(buf);
+
+  return err;
+}
+
+
+/*
+ * Log error for dir/name.
+ */
+void cp_perror(char *dir, char *name)
+{
+  int err = errno;
+  char *s = NULL;
+
+  strprintf(&s, "%s/%s", dir, name);
+  errno = err;
+  perror_info(s);
+  free(s);
+}
+
+
 /*
  * Return either the file name belonging to dev/inode or, if
- * that's not found, return NULL and append dev/inode/dst to
- * the current list.
+ * that's not found, return NULL and remember dir/name for it.
+ *
+ * cp.mutex must be held.
  */
-char *walk_hlink_list(ino_t ino, dev_t dev, char *dst)
+char *lookup_hlink(ino_t ino, dev_t dev, char *dir, char *name)
 {
   struct hlink_s **hl;
+  unsigned h = (unsigned) (ino ^ dev * 31) % HLINK_HASH_SIZE;
 
-  for(hl = &hlink_list; *hl; hl = &(*hl)->next) {
+  for(hl = &cp.hlink[h]; *hl; hl = &(*hl)->next) {
     if((*hl)->dev == dev && (*hl)->ino == ino) {
       return (*hl)->dst;
     }
@@ -1891,23 +2195,25 @@ char *walk_hlink_list(ino_t ino, dev_t dev, char *dst)
 
   (*hl)->dev = dev;
   (*hl)->ino = ino;
-  (*hl)->dst = strdup(dst);
+  strprintf(&(*hl)->dst, "%s/%s", dir, name);
 
   return NULL;
 }
 
 
-void free_hlink_list()
+void free_hlinks()
 {
   struct hlink_s *hl, *next;
+  unsigned u;
 
-  for(hl = hlink_list; hl; hl = next) {
-    next = hl->next;
-    if(hl->dst) free(hl->dst);
-    free(hl);
+  for(u = 0; u < HLINK_HASH_SIZE; u++) {
+    for(hl = cp.hlink[u]; hl; hl = next) {
+      next = hl->next;
+      if(hl->dst) free(hl->dst);
+      free(hl);
+    }
+    cp.hlink[u] = NULL;
   }
-
-  hlink_list = NULL;
 }
 
 
@@ -2540,10 +2846,27 @@ void strprintf(char **buf, char *format, ...)
 int util_fstype_main(int argc, char **argv)
 {
   char *s, buf[64], *compr, *archive;
+  struct timespec ts0;
+  unsigned u, rounds, ms;
+  int i;
 
   argv++; argc--;
 
-  if(!argc) return log_info("usage: fstype blockdevice\n"), 1;
+  /* benchmark: fstype -b rounds file... */
+  if(argc >= 3 && !strcmp(*argv, "-b")) {
+    rounds = strtoul(argv[1], NULL, 0) ?: 1;
+    argv += 2; argc -= 2;
+    clock_gettime(CLOCK_MONOTONIC, &ts0);
+    for(u = 0; u < rounds; u++) {
+      for(i = 0; i < argc; i++) fstype(argv[i]);
+    }
+    ms = ms_since(&ts0);
+    printf("%u probes in %u ms (%.1f us/probe)\n", rounds * argc, ms, ms * 1000.0 / (rounds * argc));
+
+    return 0;
+  }
+
+  if(!argc) return log_info("usage: fstype [-b rounds] blockdevice\n"), 1;
 
   while(argc--) {
     s = fstype(*argv);
@@ -2572,10 +2895,28 @@ int util_fstype_main(int argc, char **argv)
  */
 char *util_fstype(char *dev, char **module)
 {
-  char *type, *s;
+  char *type = NULL, *s;
   file_t *f0, *f;
-
-  type = dev ? fstype(dev) : NULL;
+  probe_cache_t *pc;
+  int cached = 0;
+
+  if(dev) {
+    pthread_mutex_lock(&probe_cache_mutex);
+    pc = probe_cache_get(dev);
+    if((cached = probe_cache_hit(pc && pc->has_fstype))) type = pc->fstype;
+    pthread_mutex_unlock(&probe_cache_mutex);
+
+    if(!cached) {
+      type = fstype(dev);
+
+      pthread_mutex_lock(&probe_cache_mutex);
+      if((pc = probe_cache_get(dev))) {
+        pc->fstype = type;
+        pc->has_fstype = 1;
+      }
+      pthread_mutex_unlock(&probe_cache_mutex);
+    }
+  }
 
   if(module) *module = type;
 
@@ -2814,6 +3155,22 @@ int util_mount(char *dev, char *dir, unsigned long flags, slist_t *file_list)
     char *buf = NULL;
     char *msg;
 
+    if(config.squash) {
+      tmp_dev = new_download();
+      log_info("%s -> %s: converting to squashfs\n", dev, tmp_dev);
+      if(!squash_archive(dev, tmp_dev, type, compr, file_list)) {
+        // if we downloaded the file, replace it
+        if(
+          !strncmp(dev, config.download.base, strlen(config.download.base)) &&
+          !rename(tmp_dev, dev)
+        ) {
+          tmp_dev = dev;
+        }
+        return util_mount(tmp_dev, dir, flags, NULL);
+      }
+      log_info("%s: direct conversion failed, unpacking archive first\n", dev);
+    }
+
     err = mount("tmpfs", dir, "tmpfs", 0, "size=0,nr_inodes=0");
     if(err) {
       if(config.run_as_linuxrc) log_info("mount: tmpfs: %s\n", strerror(errno));
@@ -2822,36 +3179,43 @@ int util_mount(char *dev, char *dir, unsigned long flags, slist_t *file_list)
 
     chmod(dir, 0755);
 
-    str_copy(&cpio_opts, "--quiet --sparse -dimu --no-absolute-filenames");
+    err = archive_unpack(dev, dir, type, compr, file_list);
 
-    if(file_list) {
-      s = slist_join("' '", file_list);
-      strprintf(&cpio_opts, "%s '%s'", cpio_opts, s);
-      free(s);
+    if(err != ARCHIVE_UNSUPPORTED) {
+      msg = type;
     }
+    else {
+      str_copy(&cpio_opts, "--quiet --sparse -dimu --no-absolute-filenames");
 
-    if(!strcmp(type, "cpio")) {
-      if(compr) {
-        strprintf(&buf, "cd %s ; %s -dc %s | cpio %s", dir, compr, dev, cpio_opts);
+      if(file_list) {
+        s = slist_join("' '", file_list);
+        strprintf(&cpio_opts, "%s '%s'", cpio_opts, s);
+        free(s);
+      }
+
+      if(!strcmp(type, "cpio")) {
+        if(compr) {
+          strprintf(&buf, "cd %s ; %s -dc %s | cpio %s", dir, compr, dev, cpio_opts);
+        }
+        else {
+          strprintf(&buf, "cd %s ; cpio %s < %s", dir, cpio_opts, dev);
+        }
+        msg = "cpio";
+      }
+      else if(!strcmp(type, "tar")) {
+        strprintf(&buf, "cd %s ; tar -xpf %s", dir, dev);
+        msg = "tar";
       }
       else {
-        strprintf(&buf, "cd %s ; cpio %s < %s", dir, cpio_opts, dev);
+        strprintf(&buf, "cd %s ; rpm2cpio %s | cpio %s", dir, dev, cpio_opts);
+        msg = "rpm unpacking";
       }
-      msg = "cpio";
-    }
-    else if(!strcmp(type, "tar")) {
-      strprintf(&buf, "cd %s ; tar -xpf %s", dir, dev);
-      msg = "tar";
-    }
-    else {
-      strprintf(&buf, "cd %s ; rpm2cpio %s | cpio %s", dir, dev, cpio_opts);
-      msg = "rpm unpacking";
-    }
 
-    str_copy(&cpio_opts, NULL);
+      str_copy(&cpio_opts, NULL);
 
-    err = lxrc_run(buf);
-    str_copy(&buf, NULL);
+      err = lxrc_run(buf);
+      str_copy(&buf, NULL);
+    }
 
     if(err) {
       if(config.run_as_linuxrc) log_info("mount: %s failed\n", msg);
@@ -2972,11 +3336,31 @@ void util_update_netdevice_list(char *module, int add)
 
 int util_update_disk_list(char *module, int add)
 {
+  static unsigned last_block, last_valid, scans;
   str_list_t *hsl;
   slist_t *sl;
   int added = 0;
+  unsigned block;
+  hd_data_t *hd_data;
+  struct timespec ts0;
 
-  hd_data_t *hd_data = calloc(1, sizeof *hd_data);
+  /*
+   * Right after loading a driver, always rescan: storage drivers probe
+   * asynchronously and their block events may not have arrived yet.
+   */
+  if(uevent_update(&block, NULL) && last_valid && last_block == block && !(module && add)) {
+    log_debug("disk list: unchanged\n");
+
+    return 0;
+  }
+
+  // while udev is still busy the scan may see stale data: rescan next time
+  last_block = block;
+  last_valid = util_check_exist("/run/udev/queue") ? 0 : 1;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts0);
+
+  hd_data = calloc(1, sizeof *hd_data);
 
   hd_data->flags.list_md = 1;
   fix_device_names(hd_list(hd_data, hw_disk, 1, NULL));
@@ -3015,6 +3399,8 @@ int util_update_disk_list(char *module, int add)
   hd_free_hd_data(hd_data);
   free(hd_data);
 
+  log_info("disk list: scan #%u took %u ms\n", ++scans, ms_since(&ts0));
+
   return added;
 }
 
@@ -3781,10 +4167,307 @@ int util_process_running(char *name)
 }
 
 
+/*
+ * Start listening to kernel uevents for util_wait_settle().
+ *
+ * Call it before the action whose events you want to wait for, else the
+ * first events are lost.
+ *
+ * Return socket to pass to util_wait_settle() or -1.
+ */
+int util_wait_settle_start()
+{
+  return uevent_open();
+}
+
+
+/*
+ * Wait for device events to settle.
+ *
+ * Read kernel uevents from 'fd' (see util_wait_settle_start()) and return
+ * once there was no event from any of 'subsystems' (space separated list;
+ * NULL: all) for 'quiet' ms and udev has processed its event queue - but
+ * wait at most 'timeout' ms. If 'fd' is -1, just wait 'timeout' ms.
+ *
+ * 'fd' is closed.
+ *
+ * 'name' is only used for logging.
+ *
+ * Return time waited in ms.
+ */
+unsigned util_wait_settle(int fd, char *name, char *subsystems, unsigned timeout, unsigned quiet)
+{
+  struct pollfd pfd = { .fd = fd, .events = POLLIN };
+  struct timespec ts0;
+  char buf[4096], *s;
+  unsigned now, last = 0, events = 0, wait;
+  ssize_t len;
+  slist_t *sl0;
+
+  if(!timeout || fd == -1) {
+    if(fd != -1) close(fd);
+    usleep(timeout * 1000);
+
+    return timeout;
+  }
+
+  sl0 = subsystems ? slist_split(' ', subsystems) : NULL;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts0);
+
+  for(;;) {
+    now = ms_since(&ts0);
+
+    if(now >= timeout) break;
+
+    if(now - last >= quiet) {
+      if(!util_check_exist("/run/udev/queue")) break;
+      // udev still busy
+      wait = 100;
+    }
+    else {
+      wait = quiet - (now - last);
+    }
+
+    if(wait > timeout - now) wait = timeout - now;
+
+    if(poll(&pfd, 1, wait) <= 0) continue;
+
+    while((len = recv(pfd.fd, buf, sizeof buf - 1, 0)) > 0) {
+      s = uevent_subsystem(buf, len);
+      if(!sl0 || (s && slist_getentry(sl0, s))) {
+        events++;
+        last = now;
+      }
+    }
+  }
+
+  close(pfd.fd);
+  slist_free(sl0);
+
+  log_info(
+    "%s: %s after %u ms (%u events, max %u ms)\n",
+    name, now >= timeout ? "timeout" : "settled", now, events, timeout
+  );
+
+  return now;
+}
+
+
+/*
+ * Open new socket to receive kernel uevents.
+ *
+ * Return file descriptor or -1.
+ */
+int uevent_open()
+{
+  struct sockaddr_nl sa = { .nl_family = AF_NETLINK, .nl_groups = 1 };
+  int fd;
+
+  fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+
+  if(fd != -1 && bind(fd, (struct sockaddr *) &sa, sizeof sa)) {
+    close(fd);
+    fd = -1;
+  }
+
+  if(fd == -1) perror_debug("uevent socket");
+
+  return fd;
+}
+
+
+/*
+ * Get subsystem from uevent message (NULL if there's none).
+ *
+ * 'buf' must be 0-terminated.
+ */
+char *uevent_subsystem(char *buf, ssize_t len)
+{
+  char *s;
+
+  for(s = buf; s < buf + len; s += strlen(s) + 1) {
+    if(!strncmp(s, "SUBSYSTEM=", sizeof "SUBSYSTEM=" - 1)) return s + sizeof "SUBSYSTEM=" - 1;
+  }
+
+  return NULL;
+}
+
+
+/*
+ * Read pending uevents and update the change counters.
+ *
+ * The current counter values are returned in 'block' and 'other' (if not
+ * NULL). The first call just opens the socket.
+ *
+ * Return 0 if device changes can't be tracked (callers must assume
+ * that something has changed).
+ */
+int uevent_update(unsigned *block, unsigned *other)
+{
+  char buf[4096], *s;
+  ssize_t len = 0;
+  int size = 1 << 20, tracked = 0;
+
+  pthread_mutex_lock(&uevent.mutex);
+
+  if(!uevent.fd) {
+    if((uevent.fd = uevent_open()) != -1) {
+      setsockopt(uevent.fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof size);
+    }
+  }
+  else if(uevent.fd != -1) {
+    tracked = 1;
+  }
+
+  while(tracked && (len = recv(uevent.fd, buf, sizeof buf - 1, 0)) > 0) {
+    buf[len] = 0;
+    s = uevent_subsystem(buf, len);
+    if(s && !strcmp(s, "block")) {
+      uevent.block++;
+    }
+    else {
+      uevent.other++;
+    }
+  }
+
+  // we lost some events
+  if(len == -1 && errno == ENOBUFS) {
+    log_debug("uevent: buffer overrun\n");
+    uevent.block++;
+    uevent.other++;
+  }
+
+  if(block) *block = uevent.block;
+  if(other) *other = uevent.other;
+
+  pthread_mutex_unlock(&uevent.mutex);
+
+  return tracked;
+}
+
+
+/*
+ * Milliseconds since 'ts0'.
+ */
+unsigned ms_since(struct timespec *ts0)
+{
+  struct timespec ts1;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts1);
+
+  return (ts1.tv_sec - ts0->tv_sec) * 1000 + (ts1.tv_nsec - ts0->tv_nsec) / 1000000;
+}
+
+
+/*
+ * Find probe cache entry for file or block device 'name'; add a new one
+ * if there's none.
+ *
+ * Return NULL if 'name' can't be cached.
+ *
+ * probe_cache_mutex must be held.
+ */
+probe_cache_t *probe_cache_get(char *name)
+{
+  struct stat64 sbuf;
+  probe_cache_t *pc, **pcp;
+  dev_t dev;
+  ino_t ino;
+  unsigned block = 0;
+  int tracked;
+
+  if(!name || stat64(name, &sbuf)) return NULL;
+
+  if(S_ISBLK(sbuf.st_mode)) {
+    // block devices can only be cached if we notice changes
+    tracked = uevent_update(&block, NULL);
+    dev = sbuf.st_rdev;
+    ino = 0;
+  }
+  else if(S_ISREG(sbuf.st_mode)) {
+    tracked = 1;
+    dev = sbuf.st_dev;
+    ino = sbuf.st_ino;
+  }
+  else {
+    return NULL;
+  }
+
+  pcp = &probe_cache[(dev ^ ino) % PROBE_CACHE_SIZE];
+
+  for(pc = *pcp; pc; pc = pc->next) {
+    if(pc->dev == dev && pc->ino == ino && pc->is_blk == (S_ISBLK(sbuf.st_mode) ? 1 : 0)) break;
+  }
+
+  if(!tracked) {
+    if(pc) probe_cache_clear(pc);
+
+    return NULL;
+  }
+
+  if(!pc) {
+    pc = calloc(1, sizeof *pc);
+    pc->next = *pcp;
+    *pcp = pc;
+    pc->dev = dev;
+    pc->ino = ino;
+    pc->is_blk = S_ISBLK(sbuf.st_mode) ? 1 : 0;
+    pc->block = block;
+  }
+
+  if(
+    pc->is_blk ?
+      pc->block != block :
+      (
+        pc->size != sbuf.st_size ||
+        pc->mtime.tv_sec != sbuf.st_mtim.tv_sec ||
+        pc->mtime.tv_nsec != sbuf.st_mtim.tv_nsec
+      )
+  ) {
+    probe_cache_clear(pc);
+  }
+
+  pc->block = block;
+  pc->size = sbuf.st_size;
+  pc->mtime = sbuf.st_mtim;
+
+  return pc;
+}
+
+
+/*
+ * Forget cached results.
+ */
+void probe_cache_clear(probe_cache_t *pc)
+{
+  str_copy(&pc->blkid_type, NULL);
+  str_copy(&pc->blkid_label, NULL);
+
+  pc->has_fstype = pc->has_compr = pc->has_archive = pc->has_blkid = pc->has_fileinfo = 0;
+}
+
+
+/*
+ * Helper to count cache hits: return 'has'.
+ */
+int probe_cache_hit(int has)
+{
+  if(has) {
+    probe_cache_hits++;
+    log_debug("probe cache: hit #%u\n", probe_cache_hits);
+  }
+
+  return has;
+}
+
+
 char *blk_ident(char *dev)
 {
-  char *type, *label, *size;
+  char *type = NULL, *label = NULL, *size;
   static char *id = NULL;
+  probe_cache_t *pc;
+  int cached;
 
   if(id) {
     free(id);
@@ -3793,10 +4476,29 @@ char *blk_ident(char *dev)
 
   if(!dev) return id;
 
-  if(!config.blkid.cache) blkid_get_cache(&config.blkid.cache, "/dev/null");
+  pthread_mutex_lock(&probe_cache_mutex);
+  pc = probe_cache_get(dev);
+  if((cached = probe_cache_hit(pc && pc->has_blkid))) {
+    if(pc->blkid_type) type = strdup(pc->blkid_type);
+    if(pc->blkid_label) label = strdup(pc->blkid_label);
+  }
+  pthread_mutex_unlock(&probe_cache_mutex);
+
+  if(!cached) {
+    if(!config.blkid.cache) blkid_get_cache(&config.blkid.cache, "/dev/null");
+
+    type = blkid_get_tag_value(config.blkid.cache, "TYPE", dev);
+    label = blkid_get_tag_value(config.blkid.cache, "LABEL", dev);
+
+    pthread_mutex_lock(&probe_cache_mutex);
+    if((pc = probe_cache_get(dev))) {
+      str_copy(&pc->blkid_type, type);
+      str_copy(&pc->blkid_label, label);
+      pc->has_blkid = 1;
+    }
+    pthread_mutex_unlock(&probe_cache_mutex);
+  }
 
-  type = blkid_get_tag_value(config.blkid.cache, "TYPE", dev);
-  label = blkid_get_tag_value(config.blkid.cache, "LABEL", dev);
   size = blk_size_str(dev);
 
   if(!size) return id;
@@ -3862,9 +4564,10 @@ uint64_t blk_size(char *dev)
  */
 void update_device_list(int force)
 {
-  static time_t last_time;
-  struct stat sbuf;
+  static unsigned last_block, last_other, last_valid, scans, skipped;
+  unsigned block, other;
   hd_t *hd, *net_list;
+  struct timespec ts0;
 
   log_info("update_device_list(%d)\n", force);
 
@@ -3874,18 +4577,27 @@ void update_device_list(int force)
 
   if(!config.hd_data) force = 1;
 
-  if(stat("/run/udev/queue.bin", &sbuf)) {
+  if(!uevent_update(&block, &other) || !last_valid || last_block != block || last_other != other) {
     force = 1;
   }
-  else if(last_time != sbuf.st_mtime) {
-    last_time = sbuf.st_mtime;
-    force = 1;
+
+  if(force) {
+    // while udev is still busy the scan may see stale data: rescan next time
+    last_block = block;
+    last_other = other;
+    last_valid = util_check_exist("/run/udev/queue") ? 0 : 1;
   }
 
-  if(!force) return;
+  if(!force) {
+    log_debug("device list unchanged, %u rescans saved\n", ++skipped);
+
+    return;
+  }
 
   log_info("%sscanning devices\n", config.hd_data ? "re" : "");
 
+  clock_gettime(CLOCK_MONOTONIC, &ts0);
+
   if(config.hd_data) {
     hd_free_hd_data(config.hd_data);
     free(config.hd_data);
@@ -3901,6 +4613,8 @@ void update_device_list(int force)
     if(hd->is.wlan) util_set_wlan(hd->unix_dev_name);
   }
   hd_free_hd_list(net_list);
+
+  log_info("device scan #%u took %u ms\n", ++scans, ms_since(&ts0));
 }
 
 
@@ -3953,6 +4667,42 @@ int util_copy_file(char *src_dir, char *src_file, char *dst)
 }
 
 
+/*
+ * Build squashfs image 'image' from archive 'file'.
+ *
+ * The archive is converted into a tar stream and fed directly into
+ * 'mksquashfs -tar' (squashfs-tools >= 4.6); no need to unpack it first.
+ *
+ * Return 0 if ok.
+ */
+int squash_archive(char *file, char *image, char *type, char *compr, slist_t *file_list)
+{
+  FILE *f;
+  char *cmd = NULL;
+  int err = 1, i;
+  sighandler_t old_sigpipe = signal(SIGPIPE, SIG_IGN);
+
+  strprintf(&cmd, "mksquashfs - %s -tar -noappend -no-progress -quiet", image);
+
+  if((f = popen(cmd, "w"))) {
+    err = archive_to_tar(file, fileno(f), type, compr, file_list);
+    i = pclose(f);
+    if(i) {
+      log_info("mount: mksquashfs failed\n");
+      if(!err) err = 1;
+    }
+  }
+
+  signal(SIGPIPE, old_sigpipe);
+
+  if(err) unlink(image);
+
+  str_copy(&cmd, NULL);
+
+  return err;
+}
+
+
 /*
  * Return new download image name.
  */
@@ -4102,20 +4852,24 @@ void run_braille()
   hd_data_t *hd_data = calloc(1, sizeof *hd_data);
   char *cmd = NULL;
   FILE *f;
+  int fd;
 
   hd_data->debug = -1;
 
   log_show("Activating usb devices...\n");
 
   /* braille dev might need usb modules */
+  fd = util_wait_settle_start();
   util_load_usb();
 
-  sleep(config.usbwait + 1);
+  util_wait_settle(fd, "usb", "usb", (config.usbwait + 1) * 1000, 1000);
 
   hd_list(hd_data, hw_usb, 1, NULL);
+
+  fd = util_wait_settle_start();
   load_drivers(hd_data, hw_usb);
 
-  sleep(config.usbwait + 1);
+  util_wait_settle(fd, "usb", "usb tty", (config.usbwait + 1) * 1000, 1000);
 
   log_show("detecting braille devices...\n");
 
@@ -4869,6 +5623,15 @@ char *compressed_file(char *name)
   int fd;
   char buf[8];
   char *compr = NULL;
+  probe_cache_t *pc;
+  int cached;
+
+  pthread_mutex_lock(&probe_cache_mutex);
+  pc = probe_cache_get(name);
+  if((cached = probe_cache_hit(pc && pc->has_compr))) compr = pc->compr;
+  pthread_mutex_unlock(&probe_cache_mutex);
+
+  if(cached) return compr;
 
   fd = open(name, O_RDONLY | O_LARGEFILE);
 
@@ -4883,6 +5646,13 @@ char *compressed_file(char *name)
     perror_debug(name);
   }
 
+  pthread_mutex_lock(&probe_cache_mutex);
+  if((pc = probe_cache_get(name))) {
+    pc->compr = compr;
+    pc->has_compr = 1;
+  }
+  pthread_mutex_unlock(&probe_cache_mutex);
+
   return compr;
 }
 
@@ -4893,10 +5663,17 @@ char *compressed_archive(char *name, char **archive)
   char buf1[64], buf2[0x108];
   FILE *f;
   char *type = NULL;
+  probe_cache_t *pc;
+  int cached;
 
   if(!archive) return compr;
 
-  if(compr) {
+  pthread_mutex_lock(&probe_cache_mutex);
+  pc = probe_cache_get(name);
+  if((cached = probe_cache_hit(pc && pc->has_archive))) type = pc->archive;
+  pthread_mutex_unlock(&probe_cache_mutex);
+
+  if(compr && !cached) {
     snprintf(buf1, sizeof buf1, "%s -dc %s", compr, name);
 
     if((f = popen(buf1, "r"))) {
@@ -4908,6 +5685,13 @@ char *compressed_archive(char *name, char **archive)
 
       pclose(f);
     }
+
+    pthread_mutex_lock(&probe_cache_mutex);
+    if((pc = probe_cache_get(name))) {
+      pc->archive = type;
+      pc->has_archive = 1;
+    }
+    pthread_mutex_unlock(&probe_cache_mutex);
   }
 
   *archive = type;
@@ -5297,15 +6081,18 @@ void util_log(unsigned level, char *format, ...)
   char *buf, *caller = NULL;
   int buf_len = 0;
   log_file_t *lf;
+  struct tm gm_buf;
 
   time_t t = time(NULL);
-  struct tm *gm = gmtime(&t);
+  struct tm *gm = gmtime_r(&t, &gm_buf);
 
   va_start(args, format);
   if(vasprintf(&buf, format, args) == -1) buf = NULL;
   if(buf) buf_len = strlen(buf);
   va_end(args);
 
+  pthread_mutex_lock(&log_mutex);
+
   for(lf = config.log.dest; lf < config.log.dest + sizeof config.log.dest / sizeof *config.log.dest; lf++) {
     if((level & lf->level)) {
       if(!lf->f && lf->name) {
@@ -5337,6 +6124,8 @@ void util_log(unsigned level, char *format, ...)
     }
   }
 
+  pthread_mutex_unlock(&log_mutex);
+
   str_copy(&buf, NULL);
 }
 
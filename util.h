@@ -113,6 +113,8 @@ int util_read_and_chop(char* path, char* dst, int dst_size);
 
 char *get_translation(slist_t *trans, char *locale);
 int util_process_running(char *name);
+int util_wait_settle_start(void);
+unsigned util_wait_settle(int fd, char *name, char *subsystems, unsigned timeout, unsigned quiet);
 
 char *blk_size_str(char *dev);
 uint64_t blk_size(char *dev);
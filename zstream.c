@@ -0,0 +1,285 @@
+/*
+ * Streaming decompression (gzip, xz).
+ *
+ * Used to unpack downloaded files on the fly instead of running an
+ * external 'gzip -dc' or 'xz -dc'.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <zlib.h>
+#include <lzma.h>
+
+#include "zstream.h"
+
+#define ZSTREAM_BUF_SIZE	(1 << 16)
+
+static int gzip_write(zstream_t *zs, unsigned char *buf, size_t len);
+static int gzip_finish(zstream_t *zs);
+static int xz_write(zstream_t *zs, unsigned char *buf, size_t len, lzma_action action);
+static char *xz_error(lzma_ret ret);
+
+
+/*
+ * Return 1 if we can decode 'type' data.
+ */
+int zstream_supported(char *type)
+{
+  return type && (!strcmp(type, "gzip") || !strcmp(type, "xz"));
+}
+
+
+/*
+ * Create new decoder for 'type' compressed data.
+ *
+ * Decoded data are passed to write(data, buf, len).
+ *
+ * Return NULL if 'type' is not supported.
+ */
+zstream_t *zstream_new(char *type, int (*write)(void *, void *, size_t), void *data)
+{
+  zstream_t *zs;
+  z_stream *z;
+  lzma_stream *lz;
+  lzma_stream lz_init = LZMA_STREAM_INIT;
+
+  if(!zstream_supported(type)) return NULL;
+
+  zs = calloc(1, sizeof *zs);
+  zs->type = strdup(type);
+  zs->write = write;
+  zs->data = data;
+  zs->buf = malloc(ZSTREAM_BUF_SIZE);
+
+  if(!strcmp(type, "gzip")) {
+    z = calloc(1, sizeof *z);
+    zs->stream = z;
+    // 16: expect gzip header
+    if(inflateInit2(z, 16 + MAX_WBITS) != Z_OK) zs->err = "gzip: decoder init failed";
+  }
+  else {
+    lz = calloc(1, sizeof *lz);
+    *lz = lz_init;
+    zs->stream = lz;
+    if(lzma_stream_decoder(lz, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK) zs->err = "xz: decoder init failed";
+  }
+
+  return zs;
+}
+
+
+/*
+ * Decode 'len' bytes from 'buf'.
+ *
+ * return:
+ *   0: ok
+ *   1: error (see zs->err)
+ */
+int zstream_write(zstream_t *zs, void *buf, size_t len)
+{
+  if(zs->err) return 1;
+
+  if(!len) return 0;
+
+  if(*zs->type == 'g') return gzip_write(zs, buf, len);
+
+  return xz_write(zs, buf, len, LZMA_RUN);
+}
+
+
+/*
+ * Flush remaining data and check that the compressed stream was complete.
+ *
+ * return:
+ *   0: ok
+ *   1: error (see zs->err)
+ */
+int zstream_finish(zstream_t *zs)
+{
+  if(zs->err) return 1;
+
+  if(*zs->type == 'g') return gzip_finish(zs);
+
+  return xz_write(zs, NULL, 0, LZMA_FINISH);
+}
+
+
+zstream_t *zstream_free(zstream_t *zs)
+{
+  if(!zs) return NULL;
+
+  if(zs->stream) {
+    if(*zs->type == 'g') {
+      inflateEnd(zs->stream);
+    }
+    else {
+      lzma_end(zs->stream);
+    }
+    free(zs->stream);
+  }
+
+  free(zs->type);
+  free(zs->buf);
+  free(zs);
+
+  return NULL;
+}
+
+
+/*
+ * Decode gzip data.
+ *
+ * Handles concatenated gzip members. Like 'gzip -dc' anything that
+ * doesn't look like a gzip member after the first one is ignored.
+ */
+int gzip_write(zstream_t *zs, unsigned char *buf, size_t len)
+{
+  z_stream *z = zs->stream;
+  size_t out;
+  int i;
+
+  if(zs->trailing) {
+    zs->bytes_in += len;
+
+    return 0;
+  }
+
+  z->next_in = buf;
+  z->avail_in = len;
+
+  while(z->avail_in) {
+    if(zs->stream_end) {
+      // another gzip member follows
+      inflateReset(z);
+      zs->stream_end = 0;
+    }
+
+    z->next_out = zs->buf;
+    z->avail_out = ZSTREAM_BUF_SIZE;
+
+    i = inflate(z, Z_NO_FLUSH);
+
+    out = ZSTREAM_BUF_SIZE - z->avail_out;
+
+    if(i == Z_DATA_ERROR && zs->bytes_out && !z->total_out) {
+      // garbage after a complete gzip member
+      zs->trailing = 1;
+      zs->bytes_in += len;
+
+      return 0;
+    }
+
+    if(i != Z_OK && i != Z_STREAM_END && !(i == Z_BUF_ERROR && out)) {
+      zs->err = i == Z_MEM_ERROR ? "gzip: out of memory" : "gzip: invalid compressed data";
+
+      return 1;
+    }
+
+    if(out) {
+      if(zs->write(zs->data, zs->buf, out)) {
+        zs->err = "gzip: write error";
+
+        return 1;
+      }
+      zs->bytes_out += out;
+    }
+
+    if(i == Z_STREAM_END) zs->stream_end = 1;
+  }
+
+  zs->bytes_in += len;
+
+  return 0;
+}
+
+
+int gzip_finish(zstream_t *zs)
+{
+  if(!zs->stream_end && !zs->trailing) {
+    zs->err = "gzip: unexpected end of file";
+
+    return 1;
+  }
+
+  return 0;
+}
+
+
+/*
+ * Decode xz data.
+ *
+ * Pass LZMA_FINISH as 'action' to flush the decoder at the end.
+ */
+int xz_write(zstream_t *zs, unsigned char *buf, size_t len, lzma_action action)
+{
+  lzma_stream *lz = zs->stream;
+  lzma_ret ret;
+  size_t out;
+
+  lz->next_in = buf;
+  lz->avail_in = len;
+
+  do {
+    lz->next_out = zs->buf;
+    lz->avail_out = ZSTREAM_BUF_SIZE;
+
+    ret = lzma_code(lz, action);
+
+    out = ZSTREAM_BUF_SIZE - lz->avail_out;
+
+    if(out) {
+      if(zs->write(zs->data, zs->buf, out)) {
+        zs->err = "xz: write error";
+
+        return 1;
+      }
+      zs->bytes_out += out;
+    }
+
+    if(ret == LZMA_STREAM_END) {
+      zs->stream_end = 1;
+      break;
+    }
+
+    if(ret != LZMA_OK) {
+      zs->err = xz_error(ret);
+
+      return 1;
+    }
+  }
+  while(lz->avail_in || !lz->avail_out || (action == LZMA_FINISH && out));
+
+  if(action == LZMA_FINISH && !zs->stream_end) {
+    zs->err = "xz: unexpected end of file";
+
+    return 1;
+  }
+
+  zs->bytes_in += len;
+
+  return 0;
+}
+
+
+char *xz_error(lzma_ret ret)
+{
+  switch(ret) {
+    case LZMA_MEM_ERROR:
+      return "xz: out of memory";
+
+    case LZMA_FORMAT_ERROR:
+      return "xz: file format not recognized";
+
+    case LZMA_OPTIONS_ERROR:
+      return "xz: unsupported options";
+
+    case LZMA_BUF_ERROR:
+      return "xz: unexpected end of file";
+
+    default:
+      return "xz: invalid compressed data";
+  }
+}
@@ -0,0 +1,25 @@
+/*
+ * Streaming decompression (gzip, xz).
+ *
+ * Compressed data is fed in arbitrary chunks via zstream_write(); the
+ * decoded data is passed on to the 'write' callback.
+ */
+
+typedef struct zstream_s {
+  char *type;			// compression type ("gzip", "xz")
+  int (*write)(void *data, void *buf, size_t len);	// output function; return 0 if ok
+  void *data;			// passed to write()
+  uint64_t bytes_in;		// compressed bytes processed
+  uint64_t bytes_out;		// uncompressed bytes written
+  char *err;			// error message, if any
+  void *stream;			// internal decoder state
+  unsigned char *buf;		// output buffer
+  unsigned stream_end:1;	// last stream has been completely decoded
+  unsigned trailing:1;		// got trailing garbage after last stream
+} zstream_t;
+
+int zstream_supported(char *type);
+zstream_t *zstream_new(char *type, int (*write)(void *, void *, size_t), void *data);
+int zstream_write(zstream_t *zs, void *buf, size_t len);
+int zstream_finish(zstream_t *zs);
+zstream_t *zstream_free(zstream_t *zs);